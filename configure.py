@@ -505,7 +505,10 @@ else:
 all_targets = []
 
 n.comment('Distributed build support')
-objs = cxx('daemon_exec', variables=cxxvariables)
+getopt_objs = []
+if platform.is_windows() or platform.is_aix():
+    getopt_objs = cc('getopt')
+objs = cxx('daemon_exec', variables=cxxvariables) + getopt_objs
 all_targets += n.build(binary('daemon_exec'), 'link', objs, implicit=daemon_lib, variables=[('libs', libs)])
 n.newline()
 
@@ -518,6 +521,7 @@ for name in ['build',
              'build_log',
              'clean',
              'clparser',
+             'content_hash',
              'debug_flags',
              'depfile_parser',
              'deps_log',
@@ -528,16 +532,20 @@ for name in ['build',
              'eval_env',
              'graph',
              'graphviz',
+             'hash_cache',
              'host_parser',
              'lexer',
              'line_printer',
              'manifest_parser',
+             'mapped_file',
              'metrics',
              'parser',
              'state',
              'string_view_util',
+             'subprocess',
              'util',
-             'version']:
+             'version',
+             'watcher']:
     objs += cxx(name, variables=cxxvariables)
 if platform.is_windows():
     for name in ['subprocess-win32',
@@ -547,11 +555,11 @@ if platform.is_windows():
         objs += cxx(name, variables=cxxvariables)
     if platform.is_msvc():
         objs += cxx('minidump-win32', variables=cxxvariables)
-    objs += cc('getopt')
+    objs += getopt_objs
 else:
     objs += cxx('subprocess-posix')
 if platform.is_aix():
-    objs += cc('getopt')
+    objs += getopt_objs
 if platform.is_msvc():
     shinobi_lib = n.build(built('shinobi.lib'), 'ar', objs)
 else:
@@ -589,6 +597,7 @@ for name in ['build_log_test',
              'build_test',
              'clean_test',
              'clparser_test',
+             'content_hash_test',
              'dcache_test',
              'depfile_parser_test',
              'deps_log_test',
@@ -596,15 +605,19 @@ for name in ['build_log_test',
              'disk_interface_test',
              'edit_distance_test',
              'graph_test',
+             'hash_cache_test',
              'host_parser_test',
              'lexer_test',
+             'line_printer_test',
              'manifest_parser_test',
+             'mapped_file_test',
              'ninja_test',
              'state_test',
              'string_view_util_test',
              'subprocess_test',
              'test',
-             'util_test']:
+             'util_test',
+             'watcher_test']:
     objs += cxx(name, variables=cxxvariables)
 if platform.is_windows():
     for name in ['includes_normalize_test', 'msvc_helper_test']:
@@ -620,9 +633,14 @@ n.comment('Ancillary executables.')
 
 for name in ['build_log_perftest',
              'canon_perftest',
+             'dcache_perftest',
              'depfile_parser_perftest',
+             'depth_perftest',
+             'dyndep_perftest',
              'hash_collision_bench',
              'manifest_parser_perftest',
+             'plan_perftest',
+             'spawn_perftest',
              'clparser_perftest']:
   if platform.is_msvc():
     cxxvariables = [('pdb', name + '.pdb')]
@@ -16,14 +16,22 @@
 
 #include <bits/stdint-uintn.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
 
 #ifdef _WIN32
 #include <fcntl.h>
@@ -36,6 +44,7 @@
 
 #include "build_log.h"
 #include "clparser.h"
+#include "content_hash.h"
 #include "debug_flags.h"
 #include "depfile_parser.h"
 #include "deps_log.h"
@@ -47,6 +56,100 @@
 
 namespace {
 
+/// Name of the entry listing the dependencies discovered by a command, next
+/// to its outputs in the distributed cache.
+const char kCacheDepsName[] = ".deps";
+
+/// Name of the entry listing which outputs of a command are executable, one
+/// per line, next to its outputs in the distributed cache.  The outputs are
+/// only restored along with it.
+const char kCacheExecutablesName[] = ".executables";
+
+/// A file whose contents go into a key of the distributed cache.
+struct CacheKeyFile {
+  std::string path;
+  /// Whether the file may be missing, like the outputs of phony edges.
+  bool optional;
+};
+
+/// The files of |nodes| as they go into a key of the distributed cache.
+std::vector<CacheKeyFile> CacheKeyFiles(const std::vector<Node*>& nodes) {
+  std::vector<CacheKeyFile> files;
+  files.reserve(nodes.size());
+  for (const Node* node : nodes) {
+    files.push_back(
+        { node->path(), node->in_edge() && node->in_edge()->is_phony() });
+  }
+  return files;
+}
+
+/// Hashes a seed along with the paths and the contents of some files into a
+/// key of the distributed cache.  Doesn't touch the graph, so that it may
+/// run on any thread.
+/// @return false if a file can't be hashed.
+bool HashIntoCacheKey(const DiskInterface* disk_interface, std::string seed,
+                      const std::vector<CacheKeyFile>& files,
+                      std::string* key) {
+  for (const CacheKeyFile& file : files) {
+    std::string hash_err;
+    ContentHash contents_hash = disk_interface->Hash(file.path, &hash_err);
+    if (!contents_hash) {
+      if (file.optional)
+        continue;
+      return false;
+    }
+    seed.push_back('\0');
+    seed += file.path;
+    seed.push_back('\0');
+    seed.append(reinterpret_cast<const char*>(&contents_hash.low),
+                sizeof(contents_hash.low));
+    seed.append(reinterpret_cast<const char*>(&contents_hash.high),
+                sizeof(contents_hash.high));
+  }
+
+  *key = HashContents(seed.data(), seed.size()).ToHex();
+  return true;
+}
+
+/// The command of |edge| and the inputs listed in the manifest, which make
+/// up its key in the distributed cache along with their contents.
+/// @return false if the edge can't be cached.
+bool CacheKeyInputs(const Edge* edge, DepsLog* deps_log, std::string* command,
+                    std::vector<CacheKeyFile>* inputs) {
+  // Generators may rewrite the manifest itself, and commands discovering
+  // their dependencies through a depfile without deps only do so after
+  // running; their outputs can't be trusted to depend only on what is known
+  // beforehand.
+  const std::string deps_type = edge->GetBinding("deps");
+  if (edge->GetBindingBool("generator") ||
+      (deps_type.empty() && !edge->GetBinding("depfile").empty()))
+    return false;
+
+  auto inputs_end = edge->inputs_.end() - edge->order_only_deps_;
+  if (!deps_type.empty()) {
+    // Dependencies loaded from the deps log come last among the implicit
+    // ones.  They depend on the history of this build directory, so leave
+    // them out: the ones that matter are stored in the cache.
+    DepsLog::Deps* deps =
+        deps_log ? deps_log->GetDeps(edge->outputs_[0]) : nullptr;
+    if (deps && deps->node_count <= edge->implicit_deps_ &&
+        std::equal(deps->nodes, deps->nodes + deps->node_count,
+                   inputs_end - deps->node_count))
+      inputs_end -= deps->node_count;
+  }
+
+  *command = edge->EvaluateCommand(true);
+  *inputs = CacheKeyFiles(std::vector<Node*>(edge->inputs_.begin(),
+                                             inputs_end));
+  return true;
+}
+
+/// Whether the outputs of |edge| count as unchanged when the command
+/// rewrites them with the same contents, i.e. it has "restat = hash".
+bool RestatsByHash(const Edge* edge) {
+  return edge->GetBinding("restat") == "hash";
+}
+
 /// A CommandRunner that doesn't actually run the commands.
 struct DryRunCommandRunner : public CommandRunner {
   ~DryRunCommandRunner() override = default;
@@ -191,8 +294,10 @@ void BuildStatus::BuildLoadDyndeps() {
   // line.  Start a new line so that the first explanation does not
   // append to the status line.  After the explanations are done a
   // new build status line will appear.
-  if (g_explaining)
+  if (g_explaining) {
     printer_.PrintOnNewLine("");
+    printer_.Flush();
+  }
 }
 
 void BuildStatus::BuildStarted() {
@@ -203,6 +308,7 @@ void BuildStatus::BuildStarted() {
 void BuildStatus::BuildFinished() {
   printer_.SetConsoleLocked(false);
   printer_.PrintOnNewLine("");
+  printer_.Flush();
 }
 
 std::string BuildStatus::FormatProgressStatus(
@@ -316,6 +422,10 @@ void Plan::Reset() {
   wanted_edges_ = 0;
   ready_.clear();
   want_.clear();
+  planned_edges_.clear();
+  pending_edges_ = 0;
+  ready_dyndeps_.clear();
+  default_duration_ = 1;
 }
 
 bool Plan::AddTarget(const Node* node, std::string* err) {
@@ -323,7 +433,7 @@ bool Plan::AddTarget(const Node* node, std::string* err) {
 }
 
 bool Plan::AddSubTarget(const Node* node, const Node* dependent,
-                        std::string* err, std::set<Edge*>* dyndep_walk) {
+                        std::string* err, EdgeWorklist* dyndep_walk) {
   Edge* edge = node->in_edge();
   if (!edge) {  // Leaf node.
     if (node->dirty()) {
@@ -340,29 +450,26 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent,
   if (edge->outputs_ready())
     return false;  // Don't need to do anything.
 
-  // If an entry in want_ does not already exist for edge, create an entry which
-  // maps to kWantNothing, indicating that we do not want to build this
-  // entry itself.
-  std::pair<std::map<Edge*, Want>::iterator, bool> want_ins =
-      want_.emplace(edge, kWantNothing);
-  Want& want = want_ins.first->second;
+  // If edge is not already part of the plan, add it as kWantNothing,
+  // indicating that we do not want to build this entry itself.
+  bool added;
+  Want& want = PlanEdge(edge, &added);
 
   if (dyndep_walk && want == kWantToFinish)
     return false;  // Don't need to do anything with already-scheduled edge.
 
   // If we do need to build edge and we haven't already marked it as wanted,
-  // mark it now.
+  // mark it now.  It is only scheduled once the whole plan is known, so that
+  // its priority can account for everything depending on it.
   if (node->dirty() && want == kWantNothing) {
     want = kWantToStart;
     EdgeWanted(edge);
-    if (!dyndep_walk && edge->AllInputsReady())
-      ScheduleWork(want_ins.first);
   }
 
   if (dyndep_walk)
-    dyndep_walk->insert(edge);
+    dyndep_walk->Add(edge);
 
-  if (!want_ins.second)
+  if (!added)
     return true;  // We've already processed the inputs.
 
   for (auto& input : edge->inputs_) {
@@ -373,23 +480,186 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent,
   return true;
 }
 
+Plan::Want& Plan::PlanEdge(Edge* edge, bool* added) {
+  if (edge->id_ >= want_.size())
+    want_.resize(edge->id_ + 1, kWantNotPlanned);
+  Want& want = want_[edge->id_];
+  *added = want == kWantNotPlanned;
+  if (*added) {
+    want = kWantNothing;
+    planned_edges_.push_back(edge);
+    ++pending_edges_;
+  }
+  return want;
+}
+
 void Plan::EdgeWanted(const Edge* edge) {
   ++wanted_edges_;
   if (!edge->is_phony())
     ++command_edges_;
 }
 
+void Plan::PrepareQueue() {
+  ComputeCriticalPath();
+  ScheduleInitialEdges();
+}
+
+void Plan::ComputeCriticalPath() {
+  METRIC_RECORD("ComputeCriticalPath");
+
+  // Expect each edge to take as long as it took last time.  Edges never
+  // built before are expected to take as long as an average edge.
+  std::vector<int64_t> durations(want_.size(), -1);
+  int64_t total_duration = 0;
+  int64_t known_durations = 0;
+  for (const Edge* edge : planned_edges_) {
+    if (want(edge) == kWantNotPlanned)
+      continue;
+    const int64_t duration = LoggedDuration(edge);
+    if (duration > 0) {
+      total_duration += duration;
+      ++known_durations;
+    }
+    durations[edge->id_] = duration;
+  }
+  default_duration_ = known_durations ? total_duration / known_durations : 1;
+  for (auto& duration : durations) {
+    if (duration < 0)
+      duration = default_duration_;
+  }
+
+  // Sort the wanted edges so that the edges producing the inputs of an edge
+  // come before it.
+  std::vector<Edge*> sorted_edges;
+  std::vector<bool> visited(want_.size());
+  std::vector<std::pair<Edge*, size_t>> stack;
+  for (Edge* root : planned_edges_) {
+    if (want(root) == kWantNotPlanned || visited[root->id_])
+      continue;
+    visited[root->id_] = true;
+    stack.emplace_back(root, 0);
+    while (!stack.empty()) {
+      Edge* edge = stack.back().first;
+      size_t& next_input = stack.back().second;
+      if (next_input == edge->inputs_.size()) {
+        sorted_edges.push_back(edge);
+        stack.pop_back();
+        continue;
+      }
+      Edge* producer = edge->inputs_[next_input++]->in_edge();
+      if (producer && want(producer) != kWantNotPlanned &&
+          !visited[producer->id_]) {
+        visited[producer->id_] = true;
+        stack.emplace_back(producer, 0);
+      }
+    }
+  }
+
+  // Walk back from the targets to the leaves, handing to the producers of
+  // the inputs of each edge the longest chain of work found behind it.
+  for (Edge* edge : sorted_edges)
+    edge->set_critical_path_weight(durations[edge->id_]);
+  for (auto it = sorted_edges.rbegin(); it != sorted_edges.rend(); ++it) {
+    const Edge* edge = *it;
+    for (const Node* input : edge->inputs_) {
+      Edge* producer = input->in_edge();
+      if (!producer || want(producer) == kWantNotPlanned)
+        continue;
+      const int64_t weight =
+          edge->critical_path_weight() + durations[producer->id_];
+      if (weight > producer->critical_path_weight())
+        producer->set_critical_path_weight(weight);
+    }
+  }
+}
+
+int64_t Plan::LoggedDuration(const Edge* edge) const {
+  if (edge->is_phony())
+    return 0;
+  BuildLog* build_log = builder_ ? builder_->build_log() : nullptr;
+  if (!build_log)
+    return -1;
+  const BuildLog::LogEntry* entry =
+      build_log->LookupByOutput(edge->outputs_[0]->path());
+  if (!entry)
+    return -1;
+  return std::max(entry->end_time - entry->start_time, 1);
+}
+
+void Plan::WeighEdgesPlannedSince(size_t first) {
+  std::vector<bool> unweighed(want_.size());
+  for (size_t i = first; i < planned_edges_.size(); ++i)
+    unweighed[planned_edges_[i]->id_] = true;
+
+  // Weigh each new edge after the wanted edges depending on it, which are
+  // either new too or weighed already.
+  std::vector<Edge*> stack;
+  for (size_t i = first; i < planned_edges_.size(); ++i) {
+    stack.push_back(planned_edges_[i]);
+    while (!stack.empty()) {
+      Edge* edge = stack.back();
+      if (!unweighed[edge->id_]) {
+        stack.pop_back();
+        continue;
+      }
+      int64_t heaviest = 0;
+      bool dependents_weighed = true;
+      for (const Node* output : edge->outputs_) {
+        for (Edge* dependent : output->out_edges()) {
+          if (want(dependent) == kWantNotPlanned)
+            continue;
+          if (unweighed[dependent->id_]) {
+            stack.push_back(dependent);
+            dependents_weighed = false;
+          } else {
+            heaviest = std::max(heaviest, dependent->critical_path_weight());
+          }
+        }
+      }
+      if (!dependents_weighed)
+        continue;
+      stack.pop_back();
+      const int64_t duration = LoggedDuration(edge);
+      edge->set_critical_path_weight(
+          (duration < 0 ? default_duration_ : duration) + heaviest);
+      unweighed[edge->id_] = false;
+    }
+  }
+}
+
+void Plan::ScheduleInitialEdges() {
+  std::set<Pool*> pools;
+  for (Edge* edge : planned_edges_) {
+    if (want(edge) != kWantToStart || !edge->AllInputsReady())
+      continue;
+
+    Pool* pool = edge->pool();
+    if (pool->ShouldDelayEdge()) {
+      want_[edge->id_] = kWantToFinish;
+      pool->DelayEdge(edge);
+      pools.insert(pool);
+    } else {
+      ScheduleWork(edge);
+    }
+  }
+
+  // Only let the pools release their edges once they know about all of
+  // them, so that the most urgent ones go first.
+  for (Pool* pool : pools)
+    pool->RetrieveReadyEdges(&ready_);
+}
+
 Edge* Plan::FindWork() {
   if (ready_.empty())
     return nullptr;
-  auto e = ready_.begin();
-  Edge* edge = *e;
-  ready_.erase(e);
+  Edge* edge = ready_.top();
+  ready_.pop();
   return edge;
 }
 
-void Plan::ScheduleWork(std::map<Edge*, Want>::iterator want_e) {
-  if (want_e->second == kWantToFinish) {
+void Plan::ScheduleWork(Edge* edge) {
+  Want& want = want_[edge->id_];
+  if (want == kWantToFinish) {
     // This edge has already been scheduled.  We can get here again if an edge
     // and one of its dependencies share an order-only input, or if a node
     // duplicates an out edge (see
@@ -397,24 +667,26 @@ void Plan::ScheduleWork(std::map<Edge*, Want>::iterator want_e) {
     // again.
     return;
   }
-  assert(want_e->second == kWantToStart);
-  want_e->second = kWantToFinish;
+  assert(want == kWantToStart);
+  want = kWantToFinish;
 
-  Edge* edge = want_e->first;
   Pool* pool = edge->pool();
   if (pool->ShouldDelayEdge()) {
     pool->DelayEdge(edge);
     pool->RetrieveReadyEdges(&ready_);
   } else {
     pool->EdgeScheduled(*edge);
-    ready_.insert(edge);
+    ready_.push(edge);
   }
 }
 
 bool Plan::EdgeFinished(Edge* edge, EdgeResult result, std::string* err) {
-  auto e = want_.find(edge);
-  assert(e != want_.end());
-  bool directly_wanted = e->second != kWantNothing;
+  return FinishEdge(edge, result, err) && LoadReadyDyndeps(err);
+}
+
+bool Plan::FinishEdge(Edge* edge, EdgeResult result, std::string* err) {
+  assert(want(edge) != kWantNotPlanned);
+  bool directly_wanted = want(edge) != kWantNothing;
 
   // See if this job frees up any delayed jobs.
   if (directly_wanted)
@@ -427,7 +699,8 @@ bool Plan::EdgeFinished(Edge* edge, EdgeResult result, std::string* err) {
 
   if (directly_wanted)
     --wanted_edges_;
-  want_.erase(e);
+  want_[edge->id_] = kWantNotPlanned;
+  --pending_edges_;
   edge->outputs_ready_ = true;
 
   // Check off any nodes we were waiting for with this edge.
@@ -439,37 +712,34 @@ bool Plan::EdgeFinished(Edge* edge, EdgeResult result, std::string* err) {
 }
 
 bool Plan::NodeFinished(Node* node, std::string* err) {
-  // If this node provides dyndep info, load it now.
+  // If this node provides dyndep info, load it along with the other dyndep
+  // files this makes ready, so that their dependents are updated once.
   if (node->dyndep_pending()) {
     assert(builder_ && "dyndep requires Plan to have a Builder");
-    // Load the now-clean dyndep file.  This will also update the
-    // build plan and schedule any new work that is ready.
-    return builder_->LoadDyndeps(node, err);
+    ready_dyndeps_.push_back(node);
+    return true;
   }
 
   // See if we we want any edges from this node.
   for (auto oe : node->out_edges()) {
-    auto want_e = want_.find(oe);
-    if (want_e == want_.end())
+    if (want(oe) == kWantNotPlanned)
       continue;
 
     // See if the edge is now ready.
-    if (!EdgeMaybeReady(want_e, err))
+    if (!EdgeMaybeReady(oe, err))
       return false;
   }
   return true;
 }
 
-bool Plan::EdgeMaybeReady(std::map<Edge*, Want>::iterator want_e,
-                          std::string* err) {
-  Edge* edge = want_e->first;
+bool Plan::EdgeMaybeReady(Edge* edge, std::string* err) {
   if (edge->AllInputsReady()) {
-    if (want_e->second != kWantNothing) {
-      ScheduleWork(want_e);
+    if (want(edge) != kWantNothing) {
+      ScheduleWork(edge);
     } else {
       // We do not need to build this edge, but we might need to build one of
       // its dependents.
-      if (!EdgeFinished(edge, kEdgeSucceeded, err))
+      if (!FinishEdge(edge, kEdgeSucceeded, err))
         return false;
     }
   }
@@ -481,8 +751,8 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, std::string* err) {
 
   for (auto oe : node->out_edges()) {
     // Don't process edges that we don't actually want.
-    auto want_e = want_.find(oe);
-    if (want_e == want_.end() || want_e->second == kWantNothing)
+    const Want oe_want = want(oe);
+    if (oe_want == kWantNotPlanned || oe_want == kWantNothing)
       continue;
 
     // Don't attempt to clean an edge if it failed to load deps.
@@ -516,7 +786,7 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, std::string* err) {
             return false;
         }
 
-        want_e->second = kWantNothing;
+        want_[oe->id_] = kWantNothing;
         --wanted_edges_;
         if (!oe->is_phony())
           --command_edges_;
@@ -526,40 +796,55 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, std::string* err) {
   return true;
 }
 
-bool Plan::DyndepsLoaded(DependencyScan* scan, const Node* node,
-                         const DyndepFile& ddf, std::string* err) {
+bool Plan::LoadReadyDyndeps(std::string* err) {
+  while (!ready_dyndeps_.empty()) {
+    // Loading a batch may finish more edges, and make more dyndep files
+    // ready for the next one.
+    std::vector<Node*> batch;
+    batch.swap(ready_dyndeps_);
+    if (!builder_->LoadDyndeps(batch, err))
+      return false;
+  }
+  return true;
+}
+
+bool Plan::DyndepsLoaded(DependencyScan* scan, const std::vector<Node*>& nodes,
+                         const std::vector<DyndepFile>& ddfs,
+                         std::string* err) {
   // Recompute the dirty state of all our direct and indirect dependents now
   // that our dyndep information has been loaded.
-  if (!RefreshDyndepDependents(scan, node, err))
+  if (!RefreshDyndepDependents(scan, nodes, err))
     return false;
 
-  // We loaded dyndep information for those out_edges of the dyndep node that
-  // specify the node in a dyndep binding, but they may not be in the plan.
-  // Starting with those already in the plan, walk newly-reachable portion
-  // of the graph through the dyndep-discovered dependencies.
+  // We loaded dyndep information for those out_edges of the dyndep nodes
+  // that specify the nodes in a dyndep binding, but they may not be in the
+  // plan.  Starting with those already in the plan, walk newly-reachable
+  // portion of the graph through the dyndep-discovered dependencies.
 
   // Find edges in the the build plan for which we have new dyndep info.
   std::vector<DyndepFile::const_iterator> dyndep_roots;
-  for (auto oe = ddf.begin(); oe != ddf.end(); ++oe) {
-    Edge* edge = oe->first;
-
-    // If the edge outputs are ready we do not need to consider it here.
-    if (edge->outputs_ready())
-      continue;
+  for (const DyndepFile& ddf : ddfs) {
+    for (auto oe = ddf.begin(); oe != ddf.end(); ++oe) {
+      Edge* edge = oe->first;
 
-    auto want_e = want_.find(edge);
+      // If the edge outputs are ready we do not need to consider it here.
+      if (edge->outputs_ready())
+        continue;
 
-    // If the edge has not been encountered before then nothing already in the
-    // plan depends on it so we do not need to consider the edge yet either.
-    if (want_e == want_.end())
-      continue;
+      // If the edge has not been encountered before then nothing already in
+      // the plan depends on it so we do not need to consider the edge yet
+      // either.
+      if (want(edge) == kWantNotPlanned)
+        continue;
 
-    // This edge is already in the plan so queue it for the walk.
-    dyndep_roots.push_back(oe);
+      // This edge is already in the plan so queue it for the walk.
+      dyndep_roots.push_back(oe);
+    }
   }
 
   // Walk dyndep-discovered portion of the graph to add it to the build plan.
-  std::set<Edge*> dyndep_walk;
+  const size_t planned_before = planned_edges_.size();
+  EdgeWorklist dyndep_walk;
   for (auto oe : dyndep_roots) {
     for (auto i = oe->second.implicit_inputs_.begin();
          i != oe->second.implicit_inputs_.end(); ++i) {
@@ -569,98 +854,212 @@ bool Plan::DyndepsLoaded(DependencyScan* scan, const Node* node,
     }
   }
 
-  // Add out edges from this node that are in the plan (just as
+  // Add out edges from these nodes that are in the plan (just as
   // Plan::NodeFinished would have without taking the dyndep code path).
-  for (auto oe : node->out_edges()) {
-    auto want_e = want_.find(oe);
-    if (want_e == want_.end())
-      continue;
-    dyndep_walk.insert(want_e->first);
+  for (const Node* node : nodes) {
+    for (auto oe : node->out_edges()) {
+      if (want(oe) == kWantNotPlanned)
+        continue;
+      dyndep_walk.Add(oe);
+    }
   }
 
+  // Rank the edges that joined the plan against those already in it before
+  // any of them is scheduled.
+  WeighEdgesPlannedSince(planned_before);
+
   // See if any encountered edges are now ready.
-  for (auto wi : dyndep_walk) {
-    auto want_e = want_.find(wi);
-    if (want_e == want_.end())
+  for (auto wi : dyndep_walk.edges) {
+    if (want(wi) == kWantNotPlanned)
       continue;
-    if (!EdgeMaybeReady(want_e, err))
+    if (!EdgeMaybeReady(wi, err))
       return false;
   }
 
   return true;
 }
 
-bool Plan::RefreshDyndepDependents(DependencyScan* scan, const Node* node,
+namespace {
+
+bool HasDirtyOutput(const Edge* edge) {
+  return std::any_of(edge->outputs_.begin(), edge->outputs_.end(),
+                     std::mem_fn(&Node::dirty));
+}
+
+/// Whether |edge|, one of the out edges of |input|, is dirty when |input|
+/// is, i.e. whether |input| isn't only one of its order-only inputs.
+bool DirtiedBy(const Edge* edge, const Node* input) {
+  // Order-only inputs come last, and are usually few: look there first,
+  // rather than through every input of the edge.
+  auto order_only = edge->inputs_.end() - edge->order_only_deps_;
+  if (std::find(order_only, edge->inputs_.end(), input) == edge->inputs_.end())
+    return true;
+  return std::find(edge->inputs_.begin(), order_only, input) != order_only;
+}
+
+}  // namespace
+
+bool Plan::RefreshDyndepDependents(DependencyScan* scan,
+                                   const std::vector<Node*>& nodes,
                                    std::string* err) {
-  // Collect the transitive closure of dependents and mark their edges
-  // as not yet visited by RecomputeDirty.
-  std::set<Node*> dependents;
-  UnmarkDependents(node, &dependents);
-
-  // Update the dirty state of all dependents and check if their edges
-  // have become wanted.
-  for (auto n : dependents) {
-    // Check if this dependent node is now dirty.  Also checks for new cycles.
-    if (!scan->RecomputeDirty(n, err))
-      return false;
-    if (!n->dirty())
+  // Collect the transitive closure of dependents, each edge once, and mark
+  // their edges as not yet visited by RecomputeDirty.  The mark tells which
+  // edges were already collected.
+  std::vector<Edge*> dependents;
+  auto collect_out_edges = [&](const Node* node) {
+    for (Edge* edge : node->out_edges()) {
+      if (want(edge) == kWantNotPlanned || edge->mark_ == Edge::VisitNone)
+        continue;
+      edge->mark_ = Edge::VisitNone;
+      dependents.push_back(edge);
+    }
+  };
+  for (const Node* node : nodes)
+    collect_out_edges(node);
+  const size_t direct_dependents = dependents.size();
+  for (size_t i = 0; i < dependents.size(); ++i) {
+    for (const Node* output : dependents[i]->outputs_)
+      collect_out_edges(output);
+  }
+
+  // Only the edges reading the dyndep files have new inputs and outputs:
+  // evaluate those again.  This also checks for new cycles, through the
+  // rest of the dependents, which are unmarked.
+  for (size_t i = 0; i < direct_dependents; ++i) {
+    Edge* edge = dependents[i];
+    for (size_t o = 0; o < edge->outputs_.size(); ++o) {
+      if (!scan->RecomputeDirty(edge->outputs_[o], err))
+        return false;
+    }
+  }
+
+  // The other dependents can only become dirty because one of their inputs
+  // did.  Rather than evaluating each of them again, through all of their
+  // inputs, mark them dirty forward from the dirty edges.
+  std::vector<Edge*> dirty_edges;
+  for (Edge* edge : dependents) {
+    if (edge->mark_ == Edge::VisitDone && HasDirtyOutput(edge))
+      dirty_edges.push_back(edge);
+  }
+  while (!dirty_edges.empty()) {
+    Edge* edge = dirty_edges.back();
+    dirty_edges.pop_back();
+    for (const Node* output : edge->outputs_) {
+      if (!output->dirty())
+        continue;
+      for (Edge* oe : output->out_edges()) {
+        if (oe->mark_ != Edge::VisitNone || want(oe) == kWantNotPlanned ||
+            !DirtiedBy(oe, output))
+          continue;
+        for (Node* o : oe->outputs_)
+          o->MarkDirty();
+        oe->outputs_ready_ = false;
+        oe->mark_ = Edge::VisitDone;
+        dirty_edges.push_back(oe);
+      }
+    }
+  }
+
+  for (Edge* edge : dependents) {
+    // Dependents whose inputs didn't change stay as they were.
+    edge->mark_ = Edge::VisitDone;
+    if (!HasDirtyOutput(edge))
       continue;
 
     // This edge was encountered before.  However, we may not have wanted to
     // build it if the outputs were not known to be dirty.  With dyndep
     // information an output is now known to be dirty, so we want the edge.
-    Edge* edge = n->in_edge();
-    assert(edge && !edge->outputs_ready());
-    auto want_e = want_.find(edge);
-    assert(want_e != want_.end());
-    if (want_e->second == kWantNothing) {
-      want_e->second = kWantToStart;
+    assert(!edge->outputs_ready());
+    if (want(edge) == kWantNothing) {
+      want_[edge->id_] = kWantToStart;
       EdgeWanted(edge);
     }
   }
   return true;
 }
 
-void Plan::UnmarkDependents(const Node* node, std::set<Node*>* dependents) {
-  for (auto edge : node->out_edges()) {
-    auto want_e = want_.find(edge);
-    if (want_e == want_.end())
-      continue;
-
-    if (edge->mark_ != Edge::VisitNone) {
-      edge->mark_ = Edge::VisitNone;
-      for (auto& output : edge->outputs_) {
-        if (dependents->insert(output).second)
-          UnmarkDependents(output, dependents);
-      }
-    }
-  }
+void Plan::EdgeWorklist::Add(Edge* edge) {
+  if (edge->id_ >= added.size())
+    added.resize(edge->id_ + 1);
+  if (added[edge->id_])
+    return;
+  added[edge->id_] = true;
+  edges.push_back(edge);
 }
 
 void Plan::Dump() const {
-  printf("pending: %d\n", (int)want_.size());
-  for (auto e : want_) {
-    if (e.second != kWantNothing)
+  printf("pending: %d\n", pending_edges_);
+  for (auto e : planned_edges_) {
+    if (want(e) == kWantNotPlanned)
+      continue;
+    if (want(e) != kWantNothing)
       printf("want ");
-    e.first->Dump();
+    e->Dump();
   }
   printf("ready: %d\n", (int)ready_.size());
 }
 
+bool MemoryBudget::Fits(const Edge* edge) const {
+  if (budget_kb_ == 0 || running_ == 0)
+    return true;
+  return running_kb_ + PredictedKb(edge) <= budget_kb_;
+}
+
+void MemoryBudget::Started(const Edge* edge) {
+  ++running_;
+  running_kb_ += PredictedKb(edge);
+}
+
+void MemoryBudget::Finished(const Edge* edge) {
+  --running_;
+  running_kb_ -= PredictedKb(edge);
+}
+
+int64_t MemoryBudget::PredictedKb(const Edge* edge) const {
+  if (!build_log_ || edge->outputs_.empty())
+    return 0;
+  const BuildLog::LogEntry* entry =
+      build_log_->LookupByOutput(edge->outputs_[0]->path());
+  return entry ? entry->usage.max_rss_kb : 0;
+}
+
 struct RealCommandRunner : public CommandRunner {
-  explicit RealCommandRunner(const BuildConfig& config) : config_(config) {}
+  RealCommandRunner(const BuildConfig& config, BuildLog* build_log);
   ~RealCommandRunner() override = default;
   bool CanRunMore() const override;
+  bool CanRunEdge(const Edge* edge) const override;
   bool StartCommand(Edge* edge) override;
   bool WaitForCommand(Result* result) override;
+  void Wake() override;
   std::vector<Edge*> GetActiveEdges() override;
   void Abort() override;
 
+  /// The file in which to save all of the output of the command of |edge|
+  /// if it's too long to keep in memory, or empty if there's none.
+  std::string SpillPath(const Edge* edge) const;
+
   const BuildConfig& config_;
+  BuildLog* build_log_;
   SubprocessSet subprocs_;
   std::map<const Subprocess*, Edge*> subproc_to_edge_;
+
+  MemoryBudget memory_;
 };
 
+RealCommandRunner::RealCommandRunner(const BuildConfig& config,
+                                     BuildLog* build_log)
+    : config_(config), build_log_(build_log),
+      memory_(config.max_memory_kb < 0
+                  ? std::max<int64_t>(GetAvailableMemoryKb(), 0)
+                  : config.max_memory_kb,
+              build_log) {
+  // A buffer for each command that may run at once is all there is to
+  // reuse.
+  subprocs_.max_spare_buffers_ = config.parallelism;
+  if (!config.output_spill_dir.empty())
+    subprocs_.FindSpillFiles(config.output_spill_dir);
+}
+
 std::vector<Edge*> RealCommandRunner::GetActiveEdges() {
   std::vector<Edge*> edges;
   for (auto& e : subproc_to_edge_)
@@ -672,6 +1071,26 @@ void RealCommandRunner::Abort() {
   subprocs_.Clear();
 }
 
+std::string RealCommandRunner::SpillPath(const Edge* edge) const {
+  if (config_.output_spill_dir.empty() || edge->outputs_.empty())
+    return std::string();
+  // Escape the separators in the output's path, so that it can't escape the
+  // directory, and the escape character itself, so that no two outputs get
+  // the same file.
+  std::string path = config_.output_spill_dir + "/";
+  for (char c : edge->outputs_[0]->path()) {
+    if (c == '/' || c == '\\' || c == ':' || c == '%') {
+      static const char kHexDigits[] = "0123456789ABCDEF";
+      path += '%';
+      path += kHexDigits[static_cast<unsigned char>(c) >> 4];
+      path += kHexDigits[c & 0xf];
+    } else {
+      path += c;
+    }
+  }
+  return path;
+}
+
 bool RealCommandRunner::CanRunMore() const {
   size_t subproc_number =
       subprocs_.running_.size() + subprocs_.finished_.size();
@@ -680,12 +1099,18 @@ bool RealCommandRunner::CanRunMore() const {
           GetLoadAverage() < config_.max_load_average);
 }
 
+bool RealCommandRunner::CanRunEdge(const Edge* edge) const {
+  return memory_.Fits(edge);
+}
+
 bool RealCommandRunner::StartCommand(Edge* edge) {
   std::string command = edge->EvaluateCommand();
-  Subprocess* subproc = subprocs_.Add(command, edge->use_console());
+  Subprocess* subproc =
+      subprocs_.Add(command, edge->use_console(), SpillPath(edge));
   if (!subproc)
     return false;
   subproc_to_edge_.emplace(subproc, edge);
+  memory_.Started(edge);
 
   return true;
 }
@@ -696,27 +1121,647 @@ bool RealCommandRunner::WaitForCommand(Result* result) {
     bool interrupted = subprocs_.DoWork();
     if (interrupted)
       return false;
+    if (subprocs_.woken_) {
+      subprocs_.woken_ = false;
+      return true;
+    }
   }
 
   result->status = subproc->Finish();
   result->output = subproc->GetOutput();
+  result->usage = subproc->GetResourceUsage();
 
   auto e = subproc_to_edge_.find(subproc);
   result->edge = e->second;
+  memory_.Finished(e->second);
   subproc_to_edge_.erase(e);
 
   delete subproc;
   return true;
 }
 
+void RealCommandRunner::Wake() {
+  subprocs_.Wake();
+}
+
+/// What finishing a command needs from the disk: the dependencies listed in
+/// its depfile or output, and the mtime and, for the deps log, the hash of
+/// its outputs.
+struct Builder::Completion {
+  CommandRunner::Result result;
+
+  /// Bindings of the edge, and paths of its outputs, evaluated on the main
+  /// thread beforehand.
+  std::string deps_type;
+  std::string deps_prefix;
+  std::string depfile;
+  std::vector<std::string> outputs;
+
+  /// Whether to stat the outputs, i.e. this isn't a dry run.
+  bool stat_outputs{ false };
+
+  /// Canonical path and slash bits of each dependency found.
+  std::vector<std::pair<std::string, uint64_t>> deps;
+
+  /// Mtime of each output, up to the first one that couldn't be stat'ed,
+  /// which is -1.
+  std::vector<TimeStamp> output_mtimes;
+
+  /// Whether to hash the outputs even without deps to record, to restat
+  /// them by hash.
+  bool hash_outputs{ false };
+
+  /// When recording deps or restating by hash, hash of each output, up to
+  /// the first one that couldn't be hashed, which is 0.
+  std::vector<ContentHash> output_hashes;
+
+  /// Why an output couldn't be stat'ed or hashed.
+  std::string output_err;
+
+  /// Whether the command failed, and that was counted against the failures
+  /// allowed, before it was examined.
+  bool failure_counted{ false };
+
+  /// Key of the edge in the distributed cache, computed before its command
+  /// started, or empty if its outputs aren't to be stored there.
+  std::string cache_key;
+
+  /// Whether the outputs were restored from the distributed cache rather
+  /// than built by the command.
+  bool restored{ false };
+};
+
+class Builder::ThreadPool : public boost::asio::thread_pool {
+ public:
+  using boost::asio::thread_pool::thread_pool;
+};
+
+/// Examines finished commands on a pool of threads, and hands them back to
+/// the main thread as they are done.  Without threads, they are examined
+/// as soon as they are posted.
+class Builder::CompletionWorkers {
+ public:
+  CompletionWorkers(ThreadPool* pool, DiskInterface* disk_interface,
+                    const DepfileParserOptions& options, CommandRunner* runner)
+      : pool_(pool), disk_interface_(disk_interface), options_(options),
+        runner_(runner) {}
+
+  /// Wait for the examinations in progress, which refer to this.
+  ~CompletionWorkers() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return examining_ == 0; });
+  }
+
+  void Post(std::unique_ptr<Completion> completion) {
+    ++pending_;
+    if (!pool_) {
+      ExamineCompletion(disk_interface_, options_, completion.get());
+      done_.push(std::move(completion));
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++examining_;
+    }
+    boost::asio::post(*pool_, [this, c = std::move(completion)]() mutable {
+      ExamineCompletion(disk_interface_, options_, c.get());
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_.push(std::move(c));
+      }
+      // The main thread may be waiting for a command rather than for us.
+      runner_->Wake();
+      std::lock_guard<std::mutex> lock(mutex_);
+      --examining_;
+      done_cv_.notify_all();
+    });
+  }
+
+  /// Return the next examined completion, or null if there is none yet.
+  std::unique_ptr<Completion> TakeDone() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (done_.empty())
+      return nullptr;
+    std::unique_ptr<Completion> completion = std::move(done_.front());
+    done_.pop();
+    --pending_;
+    return completion;
+  }
+
+  /// Wait until a completion is examined.
+  void WaitForDone() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return !done_.empty(); });
+  }
+
+  /// Number of completions posted but not taken back yet.
+  int pending() const { return pending_; }
+
+ private:
+  ThreadPool* pool_;
+  DiskInterface* disk_interface_;
+  const DepfileParserOptions& options_;
+  CommandRunner* runner_;
+  int pending_{ 0 };
+  int examining_{ 0 };
+
+  std::mutex mutex_;
+  std::condition_variable done_cv_;
+  std::queue<std::unique_ptr<Completion>> done_;
+};
+
+/// Creates the output directories and writes the response file of edges
+/// about to start on a pool of threads, so that starting them doesn't wait
+/// on the disk.  The outputs of edges restating by hash are hashed there
+/// too, before the command rewrites them.  Without threads, edges are only
+/// prepared as they start.
+class Builder::EdgePreparer {
+ public:
+  enum State : uint8_t { kNotPrepared, kPreparing, kPrepared, kFailed };
+
+  EdgePreparer(ThreadPool* pool, DiskInterface* disk_interface,
+               DirectoryMaker* directories, bool hash_outputs)
+      : pool_(pool), disk_interface_(disk_interface),
+        directories_(directories), hash_outputs_(hash_outputs) {}
+
+  /// Wait for the preparations in progress, which refer to this.
+  ~EdgePreparer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    prepared_cv_.wait(lock, [this] { return preparing_ == 0; });
+  }
+
+  /// Start preparing |edge| on the pool, unless it already was.
+  void Prepare(const Edge* edge) {
+    if (!pool_)
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      State& state = StateOf(edge);
+      if (state != kNotPrepared)
+        return;
+      state = kPreparing;
+      ++preparing_;
+    }
+    Work work = Preparation(edge);
+    if (!work.rspfile.empty()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      rspfiles_[edge] = work.rspfile;
+    }
+    boost::asio::post(*pool_, [this, edge, prep = std::move(work)] {
+      std::vector<ContentHash> output_hashes;
+      bool success = Run(prep, &output_hashes);
+      std::lock_guard<std::mutex> lock(mutex_);
+      StateOf(edge) = success ? kPrepared : kFailed;
+      if (!output_hashes.empty())
+        output_hashes_[edge] = std::move(output_hashes);
+      --preparing_;
+      prepared_cv_.notify_all();
+    });
+  }
+
+  /// Prepare |edge|, or wait for its preparation on the pool to finish.
+  /// Stores the hash of each of its outputs in |output_hashes| if they were
+  /// hashed, 0 for those that couldn't be.
+  /// @return false on error.
+  bool Finish(const Edge* edge, std::vector<ContentHash>* output_hashes) {
+    State state = Take(edge, output_hashes);
+    if (state == kNotPrepared)
+      return Run(Preparation(edge), output_hashes);
+    return state == kPrepared;
+  }
+
+  /// Forget about |edge|, which won't start after all, e.g. because its
+  /// outputs were restored from the cache, removing the response file
+  /// written for it.
+  void Forget(const Edge* edge) {
+    std::string rspfile;
+    if (Take(edge, nullptr, &rspfile) != kNotPrepared)
+      RemoveRspfile(rspfile);
+  }
+
+  /// Forget about all the edges prepared but not started, once the build
+  /// stopped, removing the response files written for them.
+  void ForgetAll() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    prepared_cv_.wait(lock, [this] { return preparing_ == 0; });
+    for (const auto& edge_rspfile : rspfiles_)
+      RemoveRspfile(edge_rspfile.second);
+    rspfiles_.clear();
+    output_hashes_.clear();
+    std::fill(states_.begin(), states_.end(), kNotPrepared);
+  }
+
+ private:
+  /// Wait for the preparation of |edge| on the pool to finish, if it's in
+  /// progress, and forget about it, so that the edge is prepared again if
+  /// it runs in another build.  Returns its state beforehand, and moves the
+  /// hashes of its outputs to |output_hashes| and the response file written
+  /// for it to |rspfile| if given.
+  State Take(const Edge* edge, std::vector<ContentHash>* output_hashes,
+             std::string* rspfile = nullptr) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    prepared_cv_.wait(lock, [&] { return StateOf(edge) != kPreparing; });
+    State state = StateOf(edge);
+    StateOf(edge) = kNotPrepared;
+    auto hashes = output_hashes_.find(edge);
+    if (hashes != output_hashes_.end()) {
+      if (output_hashes)
+        *output_hashes = std::move(hashes->second);
+      output_hashes_.erase(hashes);
+    }
+    auto rsp = rspfiles_.find(edge);
+    if (rsp != rspfiles_.end()) {
+      if (rspfile)
+        *rspfile = std::move(rsp->second);
+      rspfiles_.erase(rsp);
+    }
+    return state;
+  }
+
+  void RemoveRspfile(const std::string& rspfile) {
+    if (!rspfile.empty() && !g_keep_rsp)
+      disk_interface_->RemoveFile(rspfile);
+  }
+
+  /// What preparing an edge does on the disk, evaluated on the main thread
+  /// beforehand.
+  struct Work {
+    std::vector<std::string> outputs;
+    bool hash_outputs{ false };
+    std::string rspfile;
+    std::string rspfile_content;
+  };
+
+  Work Preparation(const Edge* edge) const {
+    Work work;
+    for (const Node* output : edge->outputs_)
+      work.outputs.push_back(output->path());
+    work.hash_outputs = hash_outputs_ && RestatsByHash(edge);
+    work.rspfile = edge->GetUnescapedRspfile();
+    if (!work.rspfile.empty())
+      work.rspfile_content = edge->GetBinding("rspfile_content");
+    return work;
+  }
+
+  bool Run(const Work& work, std::vector<ContentHash>* output_hashes) {
+    // Create directories necessary for outputs.
+    for (const std::string& output : work.outputs) {
+      if (!directories_->MakeDirs(output))
+        return false;
+    }
+
+    // Remember what the outputs contain before the command rewrites them.
+    // Those that don't exist yet can't be left unchanged.
+    if (work.hash_outputs) {
+      for (const std::string& output : work.outputs) {
+        std::string err;
+        output_hashes->push_back(disk_interface_->Hash(output, &err));
+      }
+    }
+
+    // Create response file, if needed
+    if (!work.rspfile.empty() &&
+        !disk_interface_->WriteFile(work.rspfile, work.rspfile_content))
+      return false;
+    return true;
+  }
+
+  /// Must be called with mutex_ held.
+  State& StateOf(const Edge* edge) {
+    if (edge->id_ >= states_.size())
+      states_.resize(edge->id_ + 1, kNotPrepared);
+    return states_[edge->id_];
+  }
+
+  ThreadPool* pool_;
+  DiskInterface* disk_interface_;
+  DirectoryMaker* directories_;
+  /// Whether to hash the outputs of edges restating by hash, i.e. this
+  /// isn't a dry run.
+  bool hash_outputs_;
+
+  std::mutex mutex_;
+  std::condition_variable prepared_cv_;
+  /// Indexed by edge id.
+  std::vector<State> states_;
+  /// Hashes of the outputs of the edges prepared on the pool which restat
+  /// by hash.
+  std::unordered_map<const Edge*, std::vector<ContentHash>> output_hashes_;
+  /// Response files of the edges prepared on the pool, until they start.
+  std::unordered_map<const Edge*, std::string> rspfiles_;
+  int preparing_{ 0 };
+};
+
+/// Stores the outputs of finished edges in the distributed cache on a pool
+/// of threads, an edge at a time, so that reading the outputs and sending
+/// them over the network doesn't hold the main loop up.  Uploads go through
+/// connections of their own, which leaves those of the builder to lookups.
+/// Without threads, edges are stored as soon as they are posted.
+class Builder::CacheUploader {
+ public:
+  /// What storing an edge needs, evaluated on the main thread beforehand.
+  struct Upload {
+    std::string key;
+    /// Whether the command discovers its dependencies, which are then
+    /// listed under the key and make up the key of the outputs.
+    bool has_deps{ false };
+    std::vector<CacheKeyFile> deps;
+    std::vector<std::string> outputs;
+  };
+
+  CacheUploader(ThreadPool* pool, DiskInterface* disk_interface,
+                const HostInfos& hosts)
+      : pool_(pool), disk_interface_(disk_interface), hosts_(hosts) {}
+
+  /// Wait for the uploads in progress, which refer to this.
+  ~CacheUploader() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this] { return !uploading_; });
+  }
+
+  void Post(Upload upload) {
+    if (!pool_) {
+      Store(upload);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push(std::move(upload));
+    if (uploading_)
+      return;
+    uploading_ = true;
+    boost::asio::post(*pool_, [this] { Drain(); });
+  }
+
+ private:
+  /// Store the queued edges until there are none left.
+  void Drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!queue_.empty()) {
+      Upload upload = std::move(queue_.front());
+      queue_.pop();
+      lock.unlock();
+      Store(upload);
+      lock.lock();
+    }
+    uploading_ = false;
+    idle_cv_.notify_all();
+  }
+
+  /// This is best effort: failing to store anything isn't an error.
+  void Store(const Upload& upload) {
+    if (!dcache_) {
+      dcache_ = std::make_unique<DCache>();
+      dcache_->Init(hosts_);
+    }
+
+    std::string outputs_key = upload.key;
+    if (upload.has_deps &&
+        !HashIntoCacheKey(disk_interface_, upload.key, upload.deps,
+                          &outputs_key))
+      return;
+
+    std::string executables;
+    for (const std::string& output : upload.outputs) {
+      std::string contents;
+      std::string read_err;
+      if (disk_interface_->ReadFile(output, &contents, &read_err) !=
+              DiskInterface::Okay ||
+          !dcache_->PutFile(outputs_key + "/" + output, contents))
+        return;
+      if (disk_interface_->IsExecutable(output))
+        executables += output + '\n';
+    }
+    if (!dcache_->PutFile(outputs_key + "/" + kCacheExecutablesName,
+                          executables))
+      return;
+
+    // Store the dependencies last: until they are there, the outputs can't
+    // be found.
+    if (upload.has_deps) {
+      std::string deps;
+      for (const CacheKeyFile& dep : upload.deps)
+        deps += dep.path + '\n';
+      dcache_->PutFile(upload.key + "/" + kCacheDepsName, deps);
+    }
+  }
+
+  ThreadPool* pool_;
+  DiskInterface* disk_interface_;
+  const HostInfos hosts_;
+  /// Connections to the hosts, made by the first upload.
+  std::unique_ptr<DCache> dcache_;
+
+  std::mutex mutex_;
+  std::condition_variable idle_cv_;
+  std::queue<Upload> queue_;
+  bool uploading_{ false };
+};
+
+/// An edge to look up in the distributed cache, and what came of it.
+struct Builder::CacheLookup {
+  /// What the key of the edge is made of, evaluated on the main thread.
+  std::string command;
+  std::vector<CacheKeyFile> inputs;
+
+  /// The edge as if its command had succeeded, once its outputs are
+  /// restored.  Its key in the cache, computed even on a miss, and the
+  /// dependencies listed there are filled in by the lookup.
+  Completion completion;
+
+  /// Why outputs found in the cache couldn't be restored, which fails the
+  /// build, unlike a miss.
+  std::string err;
+};
+
+/// Looks edges up in the distributed cache and restores their outputs from
+/// it on a pool of threads, an edge at a time, and hands the edges back to
+/// the main thread as they are done, whether they were found or not.  This
+/// keeps a slow host from holding up the main loop.  Lookups go through the
+/// connections of the builder, which only they use.  Without threads,
+/// edges are looked up as soon as they are posted.
+class Builder::CacheRestorer {
+ public:
+  CacheRestorer(ThreadPool* pool, DiskInterface* disk_interface,
+                DirectoryMaker* directories, const DCache* dcache,
+                CommandRunner* runner)
+      : pool_(pool), disk_interface_(disk_interface),
+        directories_(directories), dcache_(dcache), runner_(runner) {}
+
+  /// Wait for the lookups in progress, which refer to this.
+  ~CacheRestorer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return !draining_; });
+  }
+
+  void Post(std::unique_ptr<CacheLookup> lookup) {
+    ++pending_;
+    if (!pool_) {
+      Restore(lookup.get());
+      done_.push(std::move(lookup));
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push(std::move(lookup));
+    if (draining_)
+      return;
+    draining_ = true;
+    boost::asio::post(*pool_, [this] { Drain(); });
+  }
+
+  /// Return the next edge looked up, or null if there is none yet.
+  std::unique_ptr<CacheLookup> TakeDone() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (done_.empty())
+      return nullptr;
+    std::unique_ptr<CacheLookup> lookup = std::move(done_.front());
+    done_.pop();
+    --pending_;
+    return lookup;
+  }
+
+  /// Wait until an edge is looked up.
+  void WaitForDone() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return !done_.empty(); });
+  }
+
+  /// Number of edges posted but not taken back yet.
+  int pending() const { return pending_; }
+
+ private:
+  /// Look the queued edges up until there are none left.
+  void Drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!queue_.empty()) {
+      std::unique_ptr<CacheLookup> lookup = std::move(queue_.front());
+      queue_.pop();
+      lock.unlock();
+      Restore(lookup.get());
+      lock.lock();
+      done_.push(std::move(lookup));
+      done_cv_.notify_all();
+      // The main thread may be waiting for a command rather than for us.
+      lock.unlock();
+      runner_->Wake();
+      lock.lock();
+    }
+    draining_ = false;
+    done_cv_.notify_all();
+  }
+
+  /// Restore the outputs of an edge if the cache has all of them.
+  void Restore(CacheLookup* lookup) {
+    METRIC_RECORD("RestoreFromCache");
+    Completion& completion = lookup->completion;
+    std::string& key = completion.cache_key;
+    if (!HashIntoCacheKey(disk_interface_, lookup->command, lookup->inputs,
+                          &key)) {
+      key.clear();
+      return;
+    }
+
+    // Commands discovering their dependencies have them listed in the
+    // cache, and the outputs depend on them too.  Whether a dependency is
+    // the output of a phony edge isn't known here: a missing one is left
+    // out of the key, which can only match a key that left it out too.
+    std::string outputs_key = key;
+    if (!completion.deps_type.empty()) {
+      std::string deps;
+      if (!dcache_->GetFile(key + "/" + kCacheDepsName, &deps))
+        return;
+      std::vector<CacheKeyFile> deps_files;
+      for (size_t start = 0, end; start < deps.size(); start = end + 1) {
+        end = deps.find('\n', start);
+        if (end == std::string::npos)
+          end = deps.size();
+        std::string path = deps.substr(start, end - start);
+        if (path.empty())
+          continue;
+        uint64_t slash_bits;
+        std::string path_err;
+        if (!CanonicalizePath(&path, &slash_bits, &path_err))
+          return;  // Not something we could have stored.
+        deps_files.push_back({ path, true });
+        completion.deps.emplace_back(std::move(path), slash_bits);
+      }
+      if (!HashIntoCacheKey(disk_interface_, key, deps_files, &outputs_key))
+        return;
+    }
+
+    // Only use the cache when it has everything the command would produce.
+    const std::vector<std::string>& outputs = completion.outputs;
+    std::vector<std::string> contents(outputs.size());
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      if (!dcache_->GetFile(outputs_key + "/" + outputs[i], &contents[i]))
+        return;
+    }
+    std::string executables;
+    if (!dcache_->GetFile(outputs_key + "/" + kCacheExecutablesName,
+                          &executables))
+      return;
+    std::vector<bool> executable(outputs.size());
+    for (size_t start = 0, end; start < executables.size(); start = end + 1) {
+      end = executables.find('\n', start);
+      if (end == std::string::npos)
+        end = executables.size();
+      auto output = std::find(outputs.begin(), outputs.end(),
+                              executables.substr(start, end - start));
+      if (output != outputs.end())
+        executable[output - outputs.begin()] = true;
+    }
+
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      // Leave outputs which already have the right contents alone, so that
+      // their mtime, and thus restat rules, behave as if the command ran
+      // and didn't touch them.
+      std::string hash_err;
+      if (disk_interface_->Hash(outputs[i], &hash_err) ==
+              HashContents(contents[i].data(), contents[i].size()) &&
+          disk_interface_->IsExecutable(outputs[i]) == executable[i])
+        continue;
+
+      // Replace the outputs whole, so that an interrupted build doesn't
+      // leave part of one behind.
+      if (!directories_->MakeDirs(outputs[i]) ||
+          !disk_interface_->ReplaceFile(outputs[i], contents[i],
+                                        executable[i])) {
+        lookup->err = "restoring '" + outputs[i] + "' from the cache failed";
+        return;
+      }
+    }
+
+    completion.restored = true;
+    StatOutputs(disk_interface_, &completion);
+  }
+
+  ThreadPool* pool_;
+  DiskInterface* disk_interface_;
+  DirectoryMaker* directories_;
+  const DCache* dcache_;
+  CommandRunner* runner_;
+  int pending_{ 0 };
+
+  std::mutex mutex_;
+  std::condition_variable done_cv_;
+  std::queue<std::unique_ptr<CacheLookup>> queue_;
+  std::queue<std::unique_ptr<CacheLookup>> done_;
+  bool draining_{ false };
+};
+
 Builder::Builder(State* state, const BuildConfig& config, BuildLog* build_log,
                  DepsLog* deps_log, DiskInterface* disk_interface)
     : state_(state), config_(config), plan_(this),
-      disk_interface_(disk_interface),
+      disk_interface_(disk_interface), directories_(disk_interface),
       scan_(state, build_log, deps_log, disk_interface,
             &config_.depfile_parser_options) {
   status_ = new BuildStatus(config);
   dcache_.Init(state_->hosts_);
+  if (config_.io_threads > 0) {
+    ScopedSignalsBlocked signals_blocked;
+    thread_pool_ = std::make_unique<ThreadPool>(config_.io_threads);
+  }
+  preparer_ = std::make_unique<EdgePreparer>(
+      thread_pool_.get(), disk_interface_, &directories_, !config_.dry_run);
 }
 
 Builder::~Builder() {
@@ -750,9 +1795,9 @@ void Builder::Cleanup() {
           Error("%s", err.c_str());
         }
         if ((*o)->mtime() != new_mtime) {
-          uint64_t new_contents_hash =
+          ContentHash new_contents_hash =
               disk_interface_->Hash((*o)->path(), &err);
-          if (new_contents_hash == 0) {
+          if (!new_contents_hash) {
             // Log and ignore Hash() errors.
             Error("%s", err.c_str());
           }
@@ -761,6 +1806,7 @@ void Builder::Cleanup() {
       }
     }
   }
+  preparer_->ForgetAll();
 }
 
 Node* Builder::AddTarget(const std::string& name, std::string* err) {
@@ -805,21 +1851,81 @@ bool Builder::Build(std::string* err) {
     if (config_.dry_run)
       command_runner_ = std::make_unique<DryRunCommandRunner>();
     else
-      command_runner_ = std::make_unique<RealCommandRunner>(config_);
+      command_runner_ =
+          std::make_unique<RealCommandRunner>(config_, build_log());
   }
 
+  plan_.PrepareQueue();
+
+  // Reading depfiles and stat'ing and hashing outputs can take a while,
+  // e.g. for a large library.  Do it on other threads, so that commands
+  // keep starting meanwhile.
+  CompletionWorkers workers(thread_pool_.get(), disk_interface_,
+                            config_.depfile_parser_options,
+                            command_runner_.get());
+
+  // Storing outputs in the distributed cache waits on the network, so it
+  // happens on other threads too.  The build ends once they are stored.
+  CacheUploader uploader(thread_pool_.get(), disk_interface_,
+                         dcache_.hosts());
+
+  // So does looking edges up there and restoring their outputs.
+  cache_keys_.clear();
+  CacheRestorer restorer(thread_pool_.get(), disk_interface_, &directories_,
+                         &dcache_, command_runner_.get());
+
   // We are about to start the build process.
   status_->BuildStarted();
 
   // This main loop runs the entire build process.
   // It is structured like this:
-  // First, we attempt to start as many commands as allowed by the
+  // First, we finish the commands whose outputs were examined, which may
+  // make more edges ready.
+  // Second, we attempt to start as many commands as allowed by the
   // command runner.
-  // Second, we attempt to wait for / reap the next finished command.
+  // Third, we attempt to wait for / reap the next finished command, or
+  // else for the examination of one.
   while (plan_.more_to_do()) {
+    // See if we can finish any examined commands.
+    if (std::unique_ptr<Completion> completion = workers.TakeDone()) {
+      if (!FinishCommand(completion.get(), &uploader, err)) {
+        Cleanup();
+        status_->BuildFinished();
+        return false;
+      }
+
+      // A command failing once its outputs are examined, e.g. because its
+      // deps can't be extracted, only counts now.
+      if (!completion->result.success() && !completion->failure_counted) {
+        if (failures_allowed)
+          failures_allowed--;
+      }
+
+      // We made some progress; start the main loop over.
+      continue;
+    }
+
+    // See if any edge was looked up in the cache.
+    if (std::unique_ptr<CacheLookup> lookup = restorer.TakeDone()) {
+      if (!FinishLookup(lookup.get(), err)) {
+        Cleanup();
+        status_->BuildFinished();
+        return false;
+      }
+      continue;
+    }
+
     // See if we can start any more commands.
-    if (failures_allowed && command_runner_->CanRunMore()) {
+    // The most urgent edge waits for memory to free up rather than letting
+    // less urgent ones overtake it.
+    if (failures_allowed && command_runner_->CanRunMore() &&
+        plan_.PeekWork() && command_runner_->CanRunEdge(plan_.PeekWork())) {
       if (Edge* edge = plan_.FindWork()) {
+        // Look the edge up in the cache first.  It's back in the queue if
+        // it isn't there.
+        if (LookUpInCache(edge, &restorer))
+          continue;
+
         if (!StartEdge(edge, err)) {
           Cleanup();
           status_->BuildFinished();
@@ -841,6 +1947,9 @@ bool Builder::Build(std::string* err) {
       }
     }
 
+    // Nothing can start right now; get the next edges ready meanwhile.
+    PrepareAhead();
+
     // See if we can reap any finished commands.
     if (pending_commands) {
       CommandRunner::Result result;
@@ -852,22 +1961,38 @@ bool Builder::Build(std::string* err) {
         return false;
       }
 
+      // Woken up by the examination of a command.
+      if (!result.edge)
+        continue;
+
       --pending_commands;
-      if (!FinishCommand(&result, err)) {
-        Cleanup();
-        status_->BuildFinished();
-        return false;
-      }
 
+      // Count a failed command right away rather than once it is examined,
+      // so that no more commands start meanwhile than allowed.
+      std::unique_ptr<Completion> completion = BeginCompletion(result);
       if (!result.success()) {
+        completion->failure_counted = true;
         if (failures_allowed)
           failures_allowed--;
       }
+      workers.Post(std::move(completion));
 
       // We made some progress; start the main loop over.
       continue;
     }
 
+    // See if we can wait for the examination of a finished command.
+    if (workers.pending()) {
+      workers.WaitForDone();
+      continue;
+    }
+
+    // See if we can wait for an edge to be looked up in the cache.
+    if (restorer.pending()) {
+      restorer.WaitForDone();
+      continue;
+    }
+
     // If we get here, we cannot make any more progress.
     status_->BuildFinished();
     if (failures_allowed == 0) {
@@ -887,6 +2012,73 @@ bool Builder::Build(std::string* err) {
   return true;
 }
 
+void Builder::PrepareAhead() {
+  if (!thread_pool_)
+    return;
+  // Enough edges for every running command to finish at once.
+  const std::vector<Edge*>& ready = plan_.ready_edges();
+  size_t count = std::min<size_t>(ready.size(), config_.parallelism);
+  for (size_t i = 0; i < count; ++i) {
+    if (!ready[i]->is_phony())
+      preparer_->Prepare(ready[i]);
+  }
+}
+
+void Builder::StatAhead(const std::vector<Node*>& targets) {
+  if (!thread_pool_)
+    return;
+  METRIC_RECORD("stat ahead");
+  std::vector<Node*> nodes;
+  scan_.CollectNodesToStat(targets, &nodes);
+  if (nodes.empty())
+    return;
+
+  // A node that can't be stat'ed is left unknown, for RecomputeDirty() to
+  // stat it again and report the error.
+  std::vector<const std::string*> paths;
+  paths.reserve(nodes.size());
+  for (Node* n : nodes)
+    paths.push_back(&n->path());
+  std::vector<TimeStamp> mtimes(nodes.size());
+  if (disk_interface_->StatMany(paths, mtimes.data())) {
+    // Stat the nodes the batch left out across the threads, as if there
+    // were no batch.
+    size_t left = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      if (mtimes[i] != -1)
+        nodes[i]->set_mtime(mtimes[i]);
+      else
+        nodes[left++] = nodes[i];
+    }
+    nodes.resize(left);
+    if (nodes.empty())
+      return;
+  }
+
+  // Threads take nodes by batches, to keep them from contending on |next|.
+  const size_t kBatchSize = 64;
+  std::atomic<size_t> next{ 0 };
+  int running = config_.io_threads;
+  std::mutex mutex;
+  std::condition_variable done_cv;
+  for (int i = 0; i < config_.io_threads; ++i) {
+    boost::asio::post(*thread_pool_, [&] {
+      std::string err;
+      size_t begin;
+      while ((begin = next.fetch_add(kBatchSize)) < nodes.size()) {
+        size_t end = std::min(begin + kBatchSize, nodes.size());
+        for (size_t j = begin; j < end; ++j)
+          nodes[j]->Stat(disk_interface_, &err);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--running == 0)
+        done_cv.notify_one();
+    });
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  done_cv.wait(lock, [&] { return running == 0; });
+}
+
 bool Builder::StartEdge(Edge* edge, std::string* err) {
   METRIC_RECORD("StartEdge");
   if (edge->is_phony())
@@ -894,21 +2086,13 @@ bool Builder::StartEdge(Edge* edge, std::string* err) {
 
   status_->BuildEdgeStarted(edge);
 
-  // Create directories necessary for outputs.
-  // XXX: this will block; do we care?
-  for (auto& output : edge->outputs_) {
-    if (!disk_interface_->MakeDirs(output->path()))
-      return false;
-  }
-
-  // Create response file, if needed
-  // XXX: this may also block; do we care?
-  std::string rspfile = edge->GetUnescapedRspfile();
-  if (!rspfile.empty()) {
-    std::string content = edge->GetBinding("rspfile_content");
-    if (!disk_interface_->WriteFile(rspfile, content))
-      return false;
-  }
+  // Create the output directories and the response file, unless that was
+  // done while waiting for a command to finish.
+  std::vector<ContentHash> output_hashes;
+  if (!preparer_->Finish(edge, &output_hashes))
+    return false;
+  for (size_t i = 0; i < output_hashes.size(); ++i)
+    edge->outputs_[i]->set_contents_hash(output_hashes[i]);
 
   // start command computing and run it
   if (!command_runner_->StartCommand(edge)) {
@@ -919,23 +2103,42 @@ bool Builder::StartEdge(Edge* edge, std::string* err) {
   return true;
 }
 
-bool Builder::FinishCommand(CommandRunner::Result* result, std::string* err) {
-  METRIC_RECORD("FinishCommand");
+std::unique_ptr<Builder::Completion> Builder::BeginCompletion(
+    const CommandRunner::Result& result) {
+  auto completion = std::make_unique<Completion>();
+  completion->result = result;
+  const Edge* edge = result.edge;
+  auto key = cache_keys_.find(edge);
+  if (key != cache_keys_.end()) {
+    completion->cache_key = std::move(key->second);
+    cache_keys_.erase(key);
+  }
+  completion->deps_type = edge->GetBinding("deps");
+  if (completion->deps_type == "msvc")
+    completion->deps_prefix = edge->GetBinding("msvc_deps_prefix");
+  else if (completion->deps_type == "gcc")
+    completion->depfile = edge->GetUnescapedDepfile();
+  for (const Node* output : edge->outputs_)
+    completion->outputs.push_back(output->path());
+  completion->stat_outputs = !config_.dry_run;
+  completion->hash_outputs = RestatsByHash(edge);
+  return completion;
+}
 
-  Edge* edge = result->edge;
+void Builder::ExamineCompletion(DiskInterface* disk_interface,
+                                const DepfileParserOptions& options,
+                                Completion* completion) {
+  METRIC_RECORD("ExamineCompletion");
+  CommandRunner::Result* result = &completion->result;
 
   // First try to extract dependencies from the result, if any.
   // This must happen first as it filters the command output (we want
   // to filter /showIncludes output, even on compile failure) and
   // extraction itself can fail, which makes the command fail from a
   // build perspective.
-  std::vector<Node*> deps_nodes;
-  std::string deps_type = edge->GetBinding("deps");
-  const std::string deps_prefix = edge->GetBinding("msvc_deps_prefix");
-  if (!deps_type.empty()) {
+  if (!completion->deps_type.empty()) {
     std::string extract_err;
-    if (!ExtractDeps(result, deps_type, deps_prefix, &deps_nodes,
-                     &extract_err) &&
+    if (!ExtractDeps(disk_interface, options, completion, &extract_err) &&
         result->success()) {
       if (!result->output.empty())
         result->output.append("\n");
@@ -944,29 +2147,91 @@ bool Builder::FinishCommand(CommandRunner::Result* result, std::string* err) {
     }
   }
 
+  if (result->success() && completion->stat_outputs)
+    StatOutputs(disk_interface, completion);
+}
+
+void Builder::StatOutputs(DiskInterface* disk_interface,
+                          Completion* completion) {
+  for (const std::string& output : completion->outputs) {
+    TimeStamp mtime = disk_interface->Stat(output, &completion->output_err);
+    completion->output_mtimes.push_back(mtime);
+    if (mtime == -1)
+      return;
+  }
+
+  if (completion->deps_type.empty() && !completion->hash_outputs)
+    return;
+  for (const std::string& output : completion->outputs) {
+    ContentHash hash = disk_interface->Hash(output, &completion->output_err);
+    completion->output_hashes.push_back(hash);
+    if (!hash)
+      return;
+  }
+}
+
+bool Builder::FinishCommand(Completion* completion, CacheUploader* uploader,
+                            std::string* err) {
+  METRIC_RECORD("FinishCommand");
+
+  const CommandRunner::Result& result = completion->result;
+  Edge* edge = result.edge;
+
+  std::vector<Node*> deps_nodes;
+  deps_nodes.reserve(completion->deps.size());
+  for (const auto& dep : completion->deps)
+    deps_nodes.push_back(state_->GetNode(dep.first, dep.second));
+
   int start_time;
   int end_time;
-  status_->BuildEdgeFinished(edge, result->success(), result->output,
+  status_->BuildEdgeFinished(edge, result.success(), result.output,
                              &start_time, &end_time);
 
   // The rest of this function only applies to successful commands.
-  if (!result->success()) {
+  if (!result.success()) {
     return plan_.EdgeFinished(edge, Plan::kEdgeFailed, err);
   }
 
+  if (!FinishSucceededEdge(*completion, deps_nodes, start_time, end_time, err))
+    return false;
+
+  if (!completion->cache_key.empty())
+    StoreInCache(*completion, deps_nodes, uploader);
+  return true;
+}
+
+bool Builder::FinishSucceededEdge(const Completion& completion,
+                                  const std::vector<Node*>& deps_nodes,
+                                  int start_time, int end_time,
+                                  std::string* err) {
+  Edge* edge = completion.result.edge;
+  const std::string& deps_type = completion.deps_type;
+
   // Restat the edge outputs
   TimeStamp output_mtime = 0;
   bool restat = edge->GetBindingBool("restat");
   if (!config_.dry_run) {
     bool node_cleaned = false;
 
-    for (auto& output : edge->outputs_) {
-      TimeStamp new_mtime = disk_interface_->Stat(output->path(), err);
-      if (new_mtime == -1)
+    for (size_t i = 0; i < edge->outputs_.size(); ++i) {
+      Node* output = edge->outputs_[i];
+      TimeStamp new_mtime = completion.output_mtimes[i];
+      if (new_mtime == -1) {
+        *err = completion.output_err;
         return false;
+      }
       if (new_mtime > output_mtime)
         output_mtime = new_mtime;
-      if (output->mtime() == new_mtime && restat) {
+      bool unchanged = output->mtime() == new_mtime;
+      if (!unchanged && output->contents_hash() &&
+          i < completion.output_hashes.size() &&
+          completion.output_hashes[i] == output->contents_hash()) {
+        // The command rewrote the output with the same contents.  Put its
+        // previous mtime back, so that it looks untouched to its dependents
+        // in the next builds too.
+        unchanged = disk_interface_->SetMtime(output->path(), output->mtime());
+      }
+      if (unchanged && restat) {
         // The rule command did not change the output. Propagate the clean
         // state through the build graph.
         // Note that this also applies to nonexistent outputs (mtime == 0).
@@ -1014,9 +2279,19 @@ bool Builder::FinishCommand(CommandRunner::Result* result, std::string* err) {
   if (!rspfile.empty() && !g_keep_rsp)
     disk_interface_->RemoveFile(rspfile);
 
-  if (scan_.build_log()) {
-    if (!scan_.build_log()->RecordCommand(edge, start_time, end_time,
-                                          output_mtime)) {
+  if (BuildLog* build_log = scan_.build_log()) {
+    // Restoring the outputs says nothing of what running the command takes:
+    // keep what was logged when it last ran, for scheduling it next time.
+    ResourceUsage usage = completion.result.usage;
+    if (completion.restored) {
+      if (const BuildLog::LogEntry* entry =
+              build_log->LookupByOutput(edge->outputs_[0]->path())) {
+        usage = entry->usage;
+        end_time = start_time + (entry->end_time - entry->start_time);
+      }
+    }
+    if (!build_log->RecordCommand(edge, start_time, end_time, output_mtime,
+                                  usage)) {
       *err = std::string("Error writing to build log: ") + strerror(errno);
       return false;
     }
@@ -1024,16 +2299,16 @@ bool Builder::FinishCommand(CommandRunner::Result* result, std::string* err) {
 
   if (!deps_type.empty() && !config_.dry_run) {
     assert(!edge->outputs_.empty() && "should have been rejected by parser");
-    for (auto output : edge->outputs_) {
-      TimeStamp deps_mtime = disk_interface_->Stat(output->path(), err);
-      if (deps_mtime == -1)
-        return false;
-      uint64_t deps_contents_hash = disk_interface_->Hash(output->path(), err);
-      if (deps_contents_hash == 0) {
+    for (size_t i = 0; i < edge->outputs_.size(); ++i) {
+      const ContentHash& deps_contents_hash = completion.output_hashes[i];
+      if (!deps_contents_hash) {
+        *err = completion.output_err;
         return false;
       }
-      if (!scan_.deps_log()->RecordDeps(output, deps_mtime, deps_contents_hash,
-                                        deps_nodes)) {
+      // The deps log keeps 64 bits of the hash.
+      if (!scan_.deps_log()->RecordDeps(edge->outputs_[i],
+                                        completion.output_mtimes[i],
+                                        deps_contents_hash.low, deps_nodes)) {
         *err = std::string("Error writing to deps log: ") + strerror(errno);
         return false;
       }
@@ -1042,14 +2317,93 @@ bool Builder::FinishCommand(CommandRunner::Result* result, std::string* err) {
   return true;
 }
 
-bool Builder::ExtractDeps(CommandRunner::Result* result,
-                          const std::string& deps_type,
-                          const std::string& deps_prefix,
-                          std::vector<Node*>* deps_nodes, std::string* err) {
+bool Builder::CacheKey(const Edge* edge, std::string* key) const {
+  std::string command;
+  std::vector<CacheKeyFile> inputs;
+  return CacheKeyInputs(edge, scan_.deps_log(), &command, &inputs) &&
+         HashIntoCacheKey(disk_interface_, std::move(command), inputs, key);
+}
+
+bool Builder::DepsCacheKey(const std::string& key,
+                           const std::vector<Node*>& deps_nodes,
+                           std::string* outputs_key) const {
+  return HashIntoCacheKey(disk_interface_, key, CacheKeyFiles(deps_nodes),
+                          outputs_key);
+}
+
+bool Builder::LookUpInCache(Edge* edge, CacheRestorer* restorer) {
+  if (edge->is_phony() || config_.dry_run || dcache_.empty() ||
+      cache_keys_.count(edge))
+    return false;
+
+  auto lookup = std::make_unique<CacheLookup>();
+  if (!CacheKeyInputs(edge, scan_.deps_log(), &lookup->command,
+                      &lookup->inputs))
+    return false;
+  Completion& completion = lookup->completion;
+  completion.result.edge = edge;
+  completion.result.status = ExitSuccess;
+  completion.deps_type = edge->GetBinding("deps");
+  for (const Node* output : edge->outputs_)
+    completion.outputs.push_back(output->path());
+  completion.stat_outputs = true;
+  restorer->Post(std::move(lookup));
+  return true;
+}
+
+bool Builder::FinishLookup(CacheLookup* lookup, std::string* err) {
+  if (!lookup->err.empty()) {
+    *err = lookup->err;
+    return false;
+  }
+
+  Completion& completion = lookup->completion;
+  Edge* edge = completion.result.edge;
+  if (!completion.restored) {
+    // Run the command once the edge's turn comes again, and store the
+    // outputs under the key it was looked up with.
+    cache_keys_[edge] = std::move(completion.cache_key);
+    plan_.Requeue(edge);
+    return true;
+  }
+
+  preparer_->Forget(edge);
+  std::vector<Node*> deps_nodes;
+  deps_nodes.reserve(completion.deps.size());
+  for (const auto& dep : completion.deps)
+    deps_nodes.push_back(state_->GetNode(dep.first, dep.second));
+
+  int start_time;
+  int end_time;
+  status_->BuildEdgeStarted(edge);
+  status_->BuildEdgeFinished(edge, true, "", &start_time, &end_time);
+  return FinishSucceededEdge(completion, deps_nodes, start_time, end_time,
+                             err);
+}
+
+void Builder::StoreInCache(const Completion& completion,
+                           const std::vector<Node*>& deps_nodes,
+                           CacheUploader* uploader) {
+  METRIC_RECORD("StoreInCache");
+
+  CacheUploader::Upload upload;
+  upload.key = completion.cache_key;
+  upload.has_deps = !completion.deps_type.empty();
+  if (upload.has_deps)
+    upload.deps = CacheKeyFiles(deps_nodes);
+  upload.outputs = completion.outputs;
+  uploader->Post(std::move(upload));
+}
+
+bool Builder::ExtractDeps(DiskInterface* disk_interface,
+                          const DepfileParserOptions& options,
+                          Completion* completion, std::string* err) {
+  CommandRunner::Result* result = &completion->result;
+  const std::string& deps_type = completion->deps_type;
   if (deps_type == "msvc") {
     CLParser parser;
     std::string output;
-    if (!parser.Parse(result->output, deps_prefix, &output, err))
+    if (!parser.Parse(result->output, completion->deps_prefix, &output, err))
       return false;
     result->output = output;
     for (const auto& include : parser.includes_) {
@@ -1057,10 +2411,10 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
       // all backslashes (as some of the slashes will certainly be backslashes
       // anyway). This could be fixed if necessary with some additional
       // complexity in IncludesNormalize::Relativize.
-      deps_nodes->push_back(state_->GetNode(include, ~0u));
+      completion->deps.emplace_back(include, ~0u);
     }
   } else if (deps_type == "gcc") {
-    std::string depfile = result->edge->GetUnescapedDepfile();
+    const std::string& depfile = completion->depfile;
     if (depfile.empty()) {
       *err = std::string("edge with deps=gcc but no depfile makes no sense");
       return false;
@@ -1068,7 +2422,7 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
 
     // Read depfile content.  Treat a missing depfile as empty.
     std::string content;
-    switch (disk_interface_->ReadFile(depfile, &content, err)) {
+    switch (disk_interface->ReadFile(depfile, &content, err)) {
     case DiskInterface::Okay:
       break;
     case DiskInterface::NotFound:
@@ -1080,23 +2434,24 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
     if (content.empty())
       return true;
 
-    DepfileParser deps(config_.depfile_parser_options);
+    DepfileParser deps(options);
     if (!deps.Parse(&content, err))
       return false;
 
     // XXX check depfile matches expected output.
-    deps_nodes->reserve(deps.ins_.size());
+    completion->deps.reserve(deps.ins_.size());
     for (auto& in : deps.ins_) {
       uint64_t slash_bits;
       size_t in_size = in.size();
       if (!CanonicalizePath(const_cast<char*>(in.data()), &in_size, &slash_bits,
                             err))
         return false;
-      deps_nodes->push_back(state_->GetNode(in, slash_bits));
+      completion->deps.emplace_back(std::string(in.data(), in_size),
+                                    slash_bits);
     }
 
     if (!g_keep_depfile) {
-      if (disk_interface_->RemoveFile(depfile) < 0) {
+      if (disk_interface->RemoveFile(depfile) < 0) {
         *err = std::string("deleting depfile: ") + strerror(errno) +
                std::string("\n");
         return false;
@@ -1109,16 +2464,18 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
   return true;
 }
 
-bool Builder::LoadDyndeps(Node* node, std::string* err) {
+bool Builder::LoadDyndeps(const std::vector<Node*>& nodes, std::string* err) {
   status_->BuildLoadDyndeps();
 
-  // Load the dyndep information provided by this node.
-  DyndepFile ddf;
-  if (!scan_.LoadDyndeps(node, &ddf, err))
-    return false;
+  // Load the dyndep information provided by these nodes.
+  std::vector<DyndepFile> ddfs(nodes.size());
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (!scan_.LoadDyndeps(nodes[i], &ddfs[i], err))
+      return false;
+  }
 
   // Update the build plan to account for dyndep modifications to the graph.
-  if (!plan_.DyndepsLoaded(&scan_, node, ddf, err))
+  if (!plan_.DyndepsLoaded(&scan_, nodes, ddfs, err))
     return false;
 
   // New command edges may have been added to the plan.
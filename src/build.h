@@ -21,14 +21,17 @@
 #include <queue>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "dcache.h"
 #include "depfile_parser.h"
+#include "disk_interface.h"
 #include "exit_status.h"
 #include "graph.h"  // XXX needed for DependencyScan; should rearrange.
 #include "line_printer.h"
 #include "metrics.h"
+#include "resource_usage.h"
 #include "util.h"  // int64_t
 
 struct BuildLog;
@@ -49,10 +52,26 @@ struct Plan {
   /// fill in |err| with an error message if there's a problem.
   bool AddTarget(const Node* node, std::string* err);
 
+  /// Prioritize the wanted edges by the length of the critical path they
+  /// start, and queue those that are ready to run.  Must be called once all
+  /// the targets are added, before looking for work.
+  void PrepareQueue();
+
   // Pop a ready edge off the queue of edges to build.
   // Returns NULL if there's no work to do.
   Edge* FindWork();
 
+  /// Put back in the queue an edge FindWork() returned which didn't start,
+  /// e.g. because it was looked up in the distributed cache meanwhile.
+  void Requeue(Edge* edge) { ready_.push(edge); }
+
+  /// The edge FindWork() would return next, left in the queue.
+  Edge* PeekWork() const { return ready_.empty() ? nullptr : ready_.top(); }
+
+  /// The ready edges, the one PeekWork() returns first and the next ones
+  /// mostly among those FindWork() returns soon.
+  const std::vector<Edge*>& ready_edges() const { return ready_.heap(); }
+
   /// Returns true if there's more work to be done.
   bool more_to_do() const { return wanted_edges_ > 0 && command_edges_ > 0; }
 
@@ -63,7 +82,8 @@ struct Plan {
 
   /// Mark an edge as done building (whether it succeeded or failed).
   /// If any of the edge's outputs are dyndep bindings of their dependents,
-  /// this loads dynamic dependencies from the nodes' paths.
+  /// this loads dynamic dependencies from the nodes' paths, along with the
+  /// other dyndep files the edge made ready.
   /// Returns 'false' if loading dyndep info fails and 'true' otherwise.
   bool EdgeFinished(Edge* edge, EdgeResult result, std::string* err);
 
@@ -78,25 +98,64 @@ struct Plan {
   void Reset();
 
   /// Update the build plan to account for modifications made to the graph
-  /// by information loaded from a dyndep file.
-  bool DyndepsLoaded(DependencyScan* scan, const Node* node,
-                     const DyndepFile& ddf, std::string* err);
+  /// by information loaded from a batch of dyndep files, |ddfs| having been
+  /// loaded from |nodes|.
+  bool DyndepsLoaded(DependencyScan* scan, const std::vector<Node*>& nodes,
+                     const std::vector<DyndepFile>& ddfs, std::string* err);
 
  private:
-  bool RefreshDyndepDependents(DependencyScan* scan, const Node* node,
+  /// Edges in the order they were first added, each once.
+  struct EdgeWorklist {
+    void Add(Edge* edge);
+
+    std::vector<Edge*> edges;
+    /// Whether each edge was added, by edge id.
+    std::vector<bool> added;
+  };
+
+  /// Update the dirty state of the dependents of |nodes|, once for the whole
+  /// batch, and want those which became dirty.
+  bool RefreshDyndepDependents(DependencyScan* scan,
+                               const std::vector<Node*>& nodes,
                                std::string* err);
-  void UnmarkDependents(const Node* node, std::set<Node*>* dependents);
   bool AddSubTarget(const Node* node, const Node* dependent, std::string* err,
-                    std::set<Edge*>* dyndep_walk);
+                    EdgeWorklist* dyndep_walk);
+
+  /// EdgeFinished() without loading the dyndep files it makes ready.
+  bool FinishEdge(Edge* edge, EdgeResult result, std::string* err);
+
+  /// Load the dyndep files which became ready, in batches, until loading
+  /// them makes no more ready.
+  bool LoadReadyDyndeps(std::string* err);
+
+  /// Set the critical path weight of every wanted edge: its own expected
+  /// duration plus the longest chain of expected durations of the wanted
+  /// edges depending on it.  Durations come from the build log.
+  void ComputeCriticalPath();
+
+  /// How long |edge| took last time, according to the build log, or -1 if
+  /// unknown.
+  int64_t LoggedDuration(const Edge* edge) const;
+
+  /// Set the critical path weight of the edges which joined the plan after
+  /// the first |first| planned ones, e.g. by dyndep loading, the way
+  /// ComputeCriticalPath() would have.
+  void WeighEdgesPlannedSince(size_t first);
+
+  /// Queue the wanted edges whose inputs are all ready.
+  void ScheduleInitialEdges();
 
   /// Update plan with knowledge that the given node is up to date.
   /// If the node is a dyndep binding on any of its dependents, this
-  /// loads dynamic dependencies from the node's path.
-  /// Returns 'false' if loading dyndep info fails and 'true' otherwise.
+  /// queues it for LoadReadyDyndeps() instead.
+  /// Returns false on error.
   bool NodeFinished(Node* node, std::string* err);
 
   /// Enumerate possible steps we want for an edge.
   enum Want {
+    /// The edge is not part of the plan: we want to build neither it nor
+    /// its dependents.
+    kWantNotPlanned,
     /// We do not want to build the edge, but we might want to build one of
     /// its dependents.
     kWantNothing,
@@ -107,21 +166,44 @@ struct Plan {
     kWantToFinish
   };
 
+  /// What we want for |edge|, kWantNotPlanned if it isn't in the plan.
+  Want want(const Edge* edge) const {
+    return edge->id_ < want_.size() ? want_[edge->id_] : kWantNotPlanned;
+  }
+
+  /// Adds |edge| to the plan, as wanted for nothing, unless it is already
+  /// part of it.  Returns what we want for the edge, and sets |*added| when
+  /// it just joined the plan.
+  Want& PlanEdge(Edge* edge, bool* added);
+
   void EdgeWanted(const Edge* edge);
-  bool EdgeMaybeReady(std::map<Edge*, Want>::iterator want_e, std::string* err);
+  bool EdgeMaybeReady(Edge* edge, std::string* err);
 
   /// Submits a ready edge as a candidate for execution.
   /// The edge may be delayed from running, for example if it's a member of a
   /// currently-full pool.
-  void ScheduleWork(std::map<Edge*, Want>::iterator want_e);
+  void ScheduleWork(Edge* edge);
+
+  /// Keep track of which edges we want to build in this plan, indexed by
+  /// edge id.  Edges created after the plan was started (e.g. by dyndep
+  /// loading) may lie beyond its end, which means kWantNotPlanned.
+  std::vector<Want> want_;
+
+  /// The edges that joined the plan, in the order they did.  Edges that
+  /// have since finished are left in, with kWantNotPlanned in want_.
+  std::vector<Edge*> planned_edges_;
 
-  /// Keep track of which edges we want to build in this plan.  If this std::map
-  /// does not contain an entry for an edge, we do not want to build the entry
-  /// or its dependents.  If it does contain an entry, the enumeration indicates
-  /// what we want for the edge.
-  std::map<Edge*, Want> want_;
+  /// Expected duration of the edges missing from the build log: the
+  /// average of those found in it.
+  int64_t default_duration_{ 1 };
 
-  std::set<Edge*> ready_;
+  /// Number of edges in the plan that haven't finished yet.
+  int pending_edges_{ 0 };
+
+  /// Dyndep files which became ready and are waiting to be loaded.
+  std::vector<Node*> ready_dyndeps_;
+
+  EdgePriorityQueue ready_;
 
   Builder* builder_;
 
@@ -138,6 +220,9 @@ struct Plan {
 struct CommandRunner {
   virtual ~CommandRunner() = default;
   virtual bool CanRunMore() const = 0;
+  /// Whether |edge| may start now, next to the commands already running.
+  /// Only asked once CanRunMore() returned true.
+  virtual bool CanRunEdge(const Edge* /*edge*/) const { return true; }
   virtual bool StartCommand(Edge* edge) = 0;
 
   /// The result of waiting for a command.
@@ -146,15 +231,55 @@ struct CommandRunner {
     Edge* edge;
     ExitStatus status;
     std::string output;
+    ResourceUsage usage;
     bool success() const { return status == ExitSuccess; }
   };
-  /// Wait for a command to complete, or return false if interrupted.
+  /// Wait for a command to complete, or return false if interrupted.  If
+  /// Wake() was called, may return true with no edge in |result|.
   virtual bool WaitForCommand(Result* result) = 0;
 
+  /// Make a WaitForCommand() call waiting on another thread return early.
+  /// May be called from any thread.
+  virtual void Wake() {}
+
   virtual std::vector<Edge*> GetActiveEdges() { return std::vector<Edge*>(); }
   virtual void Abort() {}
 };
 
+/// MemoryBudget keeps the commands running at once within some memory, based
+/// on the peak memory each one used last time it ran, as logged.  Command
+/// runners answer CanRunEdge() with it.
+struct MemoryBudget {
+  /// |budget_kb| is the memory, in KiB, that the running commands may use.
+  /// 0 means no limit.
+  MemoryBudget(int64_t budget_kb, BuildLog* build_log)
+      : budget_kb_(budget_kb), build_log_(build_log) {}
+
+  /// Whether |edge| fits next to the running commands.  A command needing
+  /// more than the whole budget still runs, on its own.
+  bool Fits(const Edge* edge) const;
+
+  /// Accounts for the command of |edge| starting and finishing.
+  void Started(const Edge* edge);
+  void Finished(const Edge* edge);
+
+  /// The peak memory, in KiB, the command of |edge| used last time it ran,
+  /// or 0 if that isn't known.  The build log entry of a running edge is
+  /// only updated once it's reaped, so this doesn't change while it runs.
+  int64_t PredictedKb(const Edge* edge) const;
+
+  /// The memory, in KiB, the running commands are predicted to use.
+  int64_t running_kb() const { return running_kb_; }
+
+ private:
+  int64_t budget_kb_;
+  BuildLog* build_log_;
+
+  /// Number of running commands, and the sum of their predicted memory.
+  int running_{ 0 };
+  int64_t running_kb_{ 0 };
+};
+
 /// Options (e.g. verbosity, parallelism) passed to a build.
 struct BuildConfig {
   BuildConfig()
@@ -173,6 +298,19 @@ struct BuildConfig {
   /// The maximum load average we must not exceed. A negative value
   /// means that we do not have any limit.
   double max_load_average{ -0.0f };
+  /// The memory, in KiB, the running commands may be expected to use, based
+  /// on the peak memory they used last time.  A negative value means the
+  /// memory available when the build starts; 0 means no limit.
+  int64_t max_memory_kb{ 0 };
+  /// Threads doing disk work off the main loop: reading the depfiles and
+  /// stat'ing and hashing the outputs of finished commands, and creating
+  /// the output directories and response files of the next commands to
+  /// start.  0 does all of it on the main loop, as it gets to it.
+  int io_threads{ 0 };
+  /// Directory where a command printing more than is kept in memory saves
+  /// all of its output, in a file named after its first output.  Empty to
+  /// only keep the head and the tail of such output.
+  std::string output_spill_dir;
   DepfileParserOptions depfile_parser_options;
 };
 
@@ -191,6 +329,11 @@ struct Builder {
   /// @return false on error.
   bool AddTarget(Node* target, std::string* err);
 
+  /// Stat the nodes AddTarget() will look at for |targets|, in a batch if
+  /// the disk interface can, or else across the I/O threads, rather than
+  /// one at a time as it goes.
+  void StatAhead(const std::vector<Node*>& targets);
+
   /// Returns true if the build targets are already up to date.
   bool AlreadyUpToDate() const;
 
@@ -200,15 +343,31 @@ struct Builder {
 
   bool StartEdge(Edge* edge, std::string* err);
 
-  /// Update status ninja logs following a command termination.
-  /// @return false if the build can not proceed further due to a fatal error.
-  bool FinishCommand(CommandRunner::Result* result, std::string* err);
-
   /// Used for tests.
   void SetBuildLog(BuildLog* log) { scan_.set_build_log(log); }
 
-  /// Load the dyndep information provided by the given node.
-  bool LoadDyndeps(Node* node, std::string* err);
+  BuildLog* build_log() const { return scan_.build_log(); }
+
+  /// Load the dyndep information provided by the given nodes, and update
+  /// the plan for all of it at once.
+  bool LoadDyndeps(const std::vector<Node*>& nodes, std::string* err);
+
+  /// Compute the key of an edge in the distributed cache, from its command
+  /// and the contents of the inputs listed in the manifest.  The outputs are
+  /// stored as "<key>/<output path>", along with "<key>/.executables", which
+  /// lists those to restore executable.  When the command discovers its own
+  /// dependencies, they are listed in "<key>/.deps" instead, and the outputs
+  /// are stored under the key returned by DepsCacheKey.
+  /// @return false if the edge can't be cached.
+  bool CacheKey(const Edge* edge, std::string* key) const;
+
+  /// Compute the key under which the outputs of an edge are stored in the
+  /// distributed cache, from the key of the edge and the contents of the
+  /// dependencies discovered by its command.
+  /// @return false if a dependency can't be hashed.
+  bool DepsCacheKey(const std::string& key,
+                    const std::vector<Node*>& deps_nodes,
+                    std::string* outputs_key) const;
 
   State* state_;
   const BuildConfig& config_;
@@ -223,13 +382,84 @@ struct Builder {
   DCache dcache_;
 
  private:
-  bool ExtractDeps(CommandRunner::Result* result, const std::string& deps_type,
-                   const std::string& deps_prefix,
-                   std::vector<Node*>* deps_nodes, std::string* err);
+  struct CacheLookup;
+  struct Completion;
+  class CacheRestorer;
+  class CacheUploader;
+  class CompletionWorkers;
+  class EdgePreparer;
+  class ThreadPool;
+
+  /// Start getting the edges likely to start next ready, while waiting for
+  /// a command to finish.
+  void PrepareAhead();
+
+  /// Prepare the examination of the outputs of a finished command, taking
+  /// over the key of its edge in the distributed cache.
+  std::unique_ptr<Completion> BeginCompletion(
+      const CommandRunner::Result& result);
+
+  /// Examine the outputs of a finished command.  Doesn't touch the graph,
+  /// so that it may run on any thread.
+  static void ExamineCompletion(DiskInterface* disk_interface,
+                                const DepfileParserOptions& options,
+                                Completion* completion);
+
+  static bool ExtractDeps(DiskInterface* disk_interface,
+                          const DepfileParserOptions& options,
+                          Completion* completion, std::string* err);
+
+  static void StatOutputs(DiskInterface* disk_interface,
+                          Completion* completion);
+
+  /// Update status ninja logs following a command termination, once its
+  /// outputs were examined.
+  /// @return false if the build can not proceed further due to a fatal error.
+  bool FinishCommand(Completion* completion, CacheUploader* uploader,
+                     std::string* err);
+
+  /// Post an edge about to start to |restorer|, to try to bring its outputs
+  /// up to date from the distributed cache instead of running its command.
+  /// @return false if the edge isn't to be looked up, because it can't be
+  /// cached or already was looked up.
+  bool LookUpInCache(Edge* edge, CacheRestorer* restorer);
+
+  /// Finish an edge whose outputs were restored from the distributed cache
+  /// exactly as if its command had run.  On a miss, put it back in the
+  /// queue, remembering the key under which to store its outputs once its
+  /// command ran.
+  /// @return false on error, which is distinct from a cache miss.
+  bool FinishLookup(CacheLookup* lookup, std::string* err);
+
+  /// Share the outputs of an edge whose command just succeeded, and the
+  /// dependencies the command discovered, through the distributed cache.
+  /// The key is the one computed before the command started, so that inputs
+  /// changing while it ran don't file its outputs under their new contents.
+  /// The outputs are read and sent by |uploader|, in the background.
+  void StoreInCache(const Completion& completion,
+                    const std::vector<Node*>& deps_nodes,
+                    CacheUploader* uploader);
+
+  /// Update the plan and the logs following the success of an edge, whether
+  /// its command ran or its outputs were restored from the cache.
+  bool FinishSucceededEdge(const Completion& completion,
+                           const std::vector<Node*>& deps_nodes,
+                           int start_time, int end_time, std::string* err);
 
   DiskInterface* disk_interface_;
+  DirectoryMaker directories_;
   DependencyScan scan_;
 
+  /// Threads doing disk work for the main loop, if BuildConfig::io_threads
+  /// isn't 0.
+  std::unique_ptr<ThreadPool> thread_pool_;
+
+  std::unique_ptr<EdgePreparer> preparer_;
+
+  /// Keys in the distributed cache of the edges looked up there, empty for
+  /// those whose outputs aren't to be stored, until their command runs.
+  std::unordered_map<const Edge*, std::string> cache_keys_;
+
   // Unimplemented copy ctor and operator= ensure we don't copy the auto_ptr.
   Builder(const Builder& other);         // DO NOT IMPLEMENT
   void operator=(const Builder& other);  // DO NOT IMPLEMENT
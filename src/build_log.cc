@@ -32,6 +32,7 @@
 #include <unistd.h>
 
 #include <cinttypes>
+#include <iterator>
 #include <utility>
 
 #endif
@@ -56,7 +57,7 @@ namespace {
 
 const char kFileSignature[] = "# ninja log v%d\n";
 const int kOldestSupportedVersion = 4;
-const int kCurrentVersion = 5;
+const int kCurrentVersion = 6;
 
 }  // namespace
 
@@ -109,7 +110,7 @@ bool BuildLog::OpenForWrite(const std::string& path, const BuildLogUser& user,
 }
 
 bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
-                             TimeStamp mtime) {
+                             TimeStamp mtime, const ResourceUsage& usage) {
   std::string command = edge->EvaluateCommand(true);
   uint64_t command_hash = LogEntry::Hash(command);
   for (auto& output : edge->outputs_) {
@@ -126,6 +127,7 @@ bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
     log_entry->start_time = start_time;
     log_entry->end_time = end_time;
     log_entry->mtime = mtime;
+    log_entry->usage = usage;
 
     if (log_file_) {
       if (!WriteEntry(log_file_, *log_entry))
@@ -269,6 +271,26 @@ LoadStatus BuildLog::Load(const std::string& path, std::string* err) {
     start = end + 1;
     end = line_end;
 
+    // Since version 6, the command hash is followed by the resources the
+    // command used: its peak memory, its CPU times and the blocks it read and
+    // wrote.
+    ResourceUsage usage;
+    if (log_version >= 6) {
+      end = (char*)memchr(start, kFieldSeparator, line_end - start);
+      if (!end)
+        continue;
+      *end = 0;
+
+      int64_t* const fields[] = { &usage.max_rss_kb, &usage.user_time_ms,
+                                  &usage.system_time_ms, &usage.blocks_read,
+                                  &usage.blocks_written };
+      char* field = end + 1;
+      for (size_t f = 0; f < std::size(fields) && field < line_end; ++f) {
+        *fields[f] = strtoll(field, &field, 10);
+        ++field;  // Skip the separator.
+      }
+    }
+
     LogEntry* entry;
     auto i = entries_.find(output);
     if (i != entries_.end()) {
@@ -283,6 +305,7 @@ LoadStatus BuildLog::Load(const std::string& path, std::string* err) {
     entry->start_time = start_time;
     entry->end_time = end_time;
     entry->mtime = restat_mtime;
+    entry->usage = usage;
     if (log_version >= 5) {
       char c = *end;
       *end = '\0';
@@ -322,9 +345,14 @@ BuildLog::LogEntry* BuildLog::LookupByOutput(const std::string& path) {
 }
 
 bool BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
-  return fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\n", entry.start_time,
-                 entry.end_time, entry.mtime, entry.output.c_str(),
-                 entry.command_hash) > 0;
+  const ResourceUsage& usage = entry.usage;
+  return fprintf(f,
+                 "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\t%" PRId64
+                 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\n",
+                 entry.start_time, entry.end_time, entry.mtime,
+                 entry.output.c_str(), entry.command_hash, usage.max_rss_kb,
+                 usage.user_time_ms, usage.system_time_ms, usage.blocks_read,
+                 usage.blocks_written) > 0;
 }
 
 bool BuildLog::Recompact(const std::string& path, const BuildLogUser& user,
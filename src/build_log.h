@@ -20,6 +20,7 @@
 #include <unordered_map>
 
 #include "load_status.h"
+#include "resource_usage.h"
 #include "timestamp.h"
 #include "util.h"  // uint64_t
 
@@ -40,6 +41,7 @@ struct BuildLogUser {
 ///    when we need to rebuild due to the command changing
 /// 2) timing information, perhaps for generating reports
 /// 3) restat information
+/// 4) resources used by the commands, to plan the next builds
 struct BuildLog {
   BuildLog();
   ~BuildLog();
@@ -47,7 +49,8 @@ struct BuildLog {
   bool OpenForWrite(const std::string& path, const BuildLogUser& user,
                     std::string* err);
   bool RecordCommand(Edge* edge, int start_time, int end_time,
-                     TimeStamp mtime = 0);
+                     TimeStamp mtime = 0,
+                     const ResourceUsage& usage = ResourceUsage());
   void Close();
 
   /// Load the on-disk log.
@@ -59,6 +62,7 @@ struct BuildLog {
     int start_time;
     int end_time;
     TimeStamp mtime;
+    ResourceUsage usage;
 
     static uint64_t Hash(std::string_view command);
 
@@ -66,7 +70,7 @@ struct BuildLog {
     bool operator==(const LogEntry& o) {
       return output == o.output && command_hash == o.command_hash &&
              start_time == o.start_time && end_time == o.end_time &&
-             mtime == o.mtime;
+             mtime == o.mtime && usage == o.usage;
     }
 
     explicit LogEntry(std::string output);
@@ -26,6 +26,7 @@
 #include <unistd.h>
 #endif
 #include <cassert>
+#include <cinttypes>
 #include <cstring>
 
 namespace {
@@ -69,6 +70,50 @@ TEST_F(BuildLogTest, WriteRead) {
   ASSERT_EQ("out", e1->output);
 }
 
+TEST_F(BuildLogTest, ResourceUsage) {
+  AssertParse(&state_, "build out: cat in\n");
+
+  BuildLog log1;
+  std::string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  ResourceUsage usage;
+  usage.max_rss_kb = 123456;
+  usage.user_time_ms = 2;
+  usage.system_time_ms = 1;
+  usage.blocks_read = 8;
+  usage.blocks_written = 16;
+  log1.RecordCommand(state_.edges_[0], 15, 18, 0, usage);
+  log1.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_TRUE(usage == e->usage);
+  EXPECT_EQ(18, e->end_time);
+}
+
+TEST_F(BuildLogTest, NoResourceUsageV5) {
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v5\n");
+  fprintf(f, "123\t456\t456\tout\t%" PRIx64 "\n",
+          BuildLog::LogEntry::Hash("command"));
+  fclose(f);
+
+  std::string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(456, e->end_time);
+  ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
+  EXPECT_EQ(0, e->usage.max_rss_kb);
+}
+
 TEST_F(BuildLogTest, FirstWriteAddsSignature) {
   const char kExpectedVersion[] = "# ninja log vX\n";
   const size_t kVersionPos = strlen(kExpectedVersion) - 2;  // Points at 'X'.
@@ -221,15 +266,29 @@ struct TestDiskInterface : public DiskInterface {
                  std::string* /*err*/) const override {
     return 4;
   }
-  uint64_t Hash(const std::string& path, std::string* err) const override {
+  ContentHash Hash(const std::string& path, std::string* err) const override {
     assert(false);
-    return 0;
+    return ContentHash();
   }
   bool WriteFile(const std::string& /*path*/,
                  const std::string& /*contents*/) override {
     assert(false);
     return true;
   }
+  bool ReplaceFile(const std::string& /*path*/,
+                   const std::string& /*contents*/,
+                   bool /*executable*/) override {
+    assert(false);
+    return true;
+  }
+  bool IsExecutable(const std::string& /*path*/) const override {
+    assert(false);
+    return false;
+  }
+  bool SetMtime(const std::string& /*path*/, TimeStamp /*mtime*/) override {
+    assert(false);
+    return false;
+  }
   bool MakeDir(const std::string& /*path*/) override {
     assert(false);
     return false;
@@ -16,8 +16,11 @@
 
 #include <algorithm>
 #include <cassert>
+#include <memory>
+#include <thread>
 
 #include "build_log.h"
+#include "daemon.h"
 #include "deps_log.h"
 #include "graph.h"
 #include "test.h"
@@ -60,6 +63,7 @@ TEST_F(PlanTest, Basic) {
   std::string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue();
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = plan_.FindWork();
@@ -97,6 +101,7 @@ TEST_F(PlanTest, DoubleOutputDirect) {
   std::string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue();
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge;
@@ -129,6 +134,7 @@ TEST_F(PlanTest, DoubleOutputIndirect) {
   std::string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue();
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge;
@@ -171,6 +177,7 @@ TEST_F(PlanTest, DoubleDependent) {
   std::string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue();
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge;
@@ -207,6 +214,7 @@ void PlanTest::TestPoolWithDepthOne(const char* test_case) {
   ASSERT_EQ("", err);
   EXPECT_TRUE(plan_.AddTarget(GetNode("out2"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue();
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = plan_.FindWork();
@@ -286,6 +294,7 @@ TEST_F(PlanTest, PoolsWithDepthTwo) {
   std::string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("allTheThings"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue();
 
   std::deque<Edge*> edges;
   FindWorkSorted(&edges, 5);
@@ -366,6 +375,7 @@ TEST_F(PlanTest, PoolWithRedundantEdges) {
   std::string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue();
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = nullptr;
@@ -439,6 +449,7 @@ TEST_F(PlanTest, PoolWithFailingEdge) {
   ASSERT_EQ("", err);
   EXPECT_TRUE(plan_.AddTarget(GetNode("out2"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue();
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = plan_.FindWork();
@@ -467,6 +478,34 @@ TEST_F(PlanTest, PoolWithFailingEdge) {
   ASSERT_EQ(nullptr, edge);
 }
 
+TEST_F(PlanTest, PriorityToLongestChain) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "build a: cat in\n"
+                                      "build b: cat in\n"
+                                      "build c: cat b\n"
+                                      "build all: phony a c\n"));
+  GetNode("a")->MarkDirty();
+  GetNode("b")->MarkDirty();
+  GetNode("c")->MarkDirty();
+  GetNode("all")->MarkDirty();
+
+  std::string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue();
+
+  // Without any history, every edge is expected to take as long, so the one
+  // starting the longest chain goes first.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a", edge->outputs_[0]->path());
+  EXPECT_GT(GetNode("b")->in_edge()->critical_path_weight(),
+            GetNode("a")->in_edge()->critical_path_weight());
+}
+
 /// Fake implementation of CommandRunner, useful for tests.
 struct FakeCommandRunner : public CommandRunner {
   explicit FakeCommandRunner(VirtualFileSystem* fs)
@@ -474,6 +513,7 @@ struct FakeCommandRunner : public CommandRunner {
 
   // CommandRunner impl
   bool CanRunMore() const override;
+  bool CanRunEdge(const Edge* edge) const override;
   bool StartCommand(Edge* edge) override;
   bool WaitForCommand(Result* result) override;
   std::vector<Edge*> GetActiveEdges() override;
@@ -483,6 +523,11 @@ struct FakeCommandRunner : public CommandRunner {
   std::vector<Edge*> active_edges_;
   size_t max_active_edges_;
   VirtualFileSystem* fs_;
+
+  /// Memory the commands may use, if any limit was set, and the most the
+  /// running ones were predicted to use at once.
+  std::unique_ptr<MemoryBudget> memory_;
+  int64_t peak_memory_kb_{ 0 };
 };
 
 struct BuildTest : public StateTestWithBuiltinRules, public BuildLogUser {
@@ -577,6 +622,10 @@ bool FakeCommandRunner::CanRunMore() const {
   return active_edges_.size() < max_active_edges_;
 }
 
+bool FakeCommandRunner::CanRunEdge(const Edge* edge) const {
+  return !memory_ || memory_->Fits(edge);
+}
+
 bool FakeCommandRunner::StartCommand(Edge* edge) {
   assert(active_edges_.size() < max_active_edges_);
   assert(find(active_edges_.begin(), active_edges_.end(), edge) ==
@@ -609,6 +658,10 @@ bool FakeCommandRunner::StartCommand(Edge* edge) {
   }
 
   active_edges_.push_back(edge);
+  if (memory_) {
+    memory_->Started(edge);
+    peak_memory_kb_ = std::max(peak_memory_kb_, memory_->running_kb());
+  }
 
   // Allow tests to control the order by the name of the first output.
   sort(active_edges_.begin(), active_edges_.end(), CompareEdgesByOutput::cmp);
@@ -640,6 +693,8 @@ bool FakeCommandRunner::WaitForCommand(Result* result) {
     else
       result->status = ExitFailure;
     active_edges_.erase(edge_iter);
+    if (memory_)
+      memory_->Finished(edge);
     return true;
   }
 
@@ -673,6 +728,8 @@ bool FakeCommandRunner::WaitForCommand(Result* result) {
   }
 
   active_edges_.erase(edge_iter);
+  if (memory_)
+    memory_->Finished(edge);
   return true;
 }
 
@@ -883,6 +940,23 @@ TEST_F(BuildTest, MakeDirs) {
   EXPECT_EQ("subdir/dir2", fs_.directories_made_[1]);
 }
 
+TEST_F(BuildTest, MakeDirsOnce) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "build subdir/out1: cat in1\n"
+                                      "build subdir/out2: cat in1\n"));
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("subdir/out1", &err));
+  EXPECT_TRUE(builder_.AddTarget("subdir/out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  // fs_ doesn't list the directories it makes, so without remembering it
+  // was made, "subdir" would be made again.
+  ASSERT_EQ(1u, fs_.directories_made_.size());
+  EXPECT_EQ("subdir", fs_.directories_made_[0]);
+}
+
 TEST_F(BuildTest, DepFileMissing) {
   std::string err;
   ASSERT_NO_FATAL_FAILURE(
@@ -1188,6 +1262,29 @@ TEST_F(BuildTest, SwallowFailures) {
   ASSERT_EQ("subcommands failed", err);
 }
 
+/// Commands examined on other threads don't let more commands start after
+/// a failure than allowed.
+TEST_F(BuildTest, FailureStopsBuildWithCompletionThreads) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule fail\n"
+                                      "  command = fail\n"
+                                      "build out1: fail\n"
+                                      "build out2: fail\n"
+                                      "build out3: fail\n"
+                                      "build all: phony out1 out2 out3\n"));
+  config_.io_threads = 2;
+  Builder builder(&state_, config_, nullptr, nullptr, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+
+  std::string err;
+  EXPECT_TRUE(builder.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder.Build(&err));
+  builder.command_runner_.release();
+  EXPECT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("subcommand failed", err);
+}
+
 TEST_F(BuildTest, SwallowFailuresLimit) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
                                       "rule fail\n"
@@ -1289,6 +1386,45 @@ TEST_F(BuildWithLogTest, NotInLogButOnDisk) {
   EXPECT_TRUE(builder_.AlreadyUpToDate());
 }
 
+/// A command that used too much memory last time waits for the others to
+/// finish, and the less urgent commands wait behind it.
+TEST_F(BuildWithLogTest, MemoryBudgetHoldsEdgesBack) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule touch\n"
+                                      "  command = touch $out\n"
+                                      "build a: touch\n"
+                                      "build b: touch\n"
+                                      "build c: touch\n"));
+  // The longest commands start first.
+  const char* outputs[] = { "a", "b", "c" };
+  const int64_t durations[] = { 3000, 2000, 1000 };
+  const int64_t rss_kb[] = { 60 << 10, 60 << 10, 10 << 10 };
+  for (int i = 0; i < 3; ++i) {
+    ResourceUsage usage;
+    usage.max_rss_kb = rss_kb[i];
+    ASSERT_TRUE(build_log_.RecordCommand(GetNode(outputs[i])->in_edge(), 0,
+                                         durations[i], 0, usage));
+  }
+  command_runner_.max_active_edges_ = 3;
+  command_runner_.memory_ =
+      std::make_unique<MemoryBudget>(100 << 10, &build_log_);
+
+  std::string err;
+  for (const char* output : outputs)
+    EXPECT_TRUE(builder_.AddTarget(output, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("touch a", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch b", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("touch c", command_runner_.commands_ran_[2]);
+  // b only started once a was done, and c then fit next to it.
+  EXPECT_EQ(70 << 10, command_runner_.peak_memory_kb_);
+  EXPECT_EQ(0, command_runner_.memory_->running_kb());
+}
+
 TEST_F(BuildWithLogTest, RebuildAfterFailure) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
                                       "rule touch-fail-tick2\n"
@@ -1365,6 +1501,32 @@ TEST_F(BuildWithLogTest, RebuildWithNoInputs) {
   EXPECT_EQ(1u, command_runner_.commands_ran_.size());
 }
 
+TEST_F(BuildWithLogTest, PriorityFromPreviousDurations) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "build a: cat in\n"
+                                      "build b: cat in\n"
+                                      "build c: cat b\n"
+                                      "build all: phony a c\n"));
+  fs_.Create("in", "");
+
+  // b starts a longer chain of edges than a, but a took longer than the
+  // whole chain last time.
+  build_log_.RecordCommand(GetNode("a")->in_edge(), 0, 1000, 0);
+  build_log_.RecordCommand(GetNode("b")->in_edge(), 0, 10, 0);
+  build_log_.RecordCommand(GetNode("c")->in_edge(), 10, 20, 0);
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat in > a", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("cat in > b", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("cat b > c", command_runner_.commands_ran_[2]);
+}
+
 TEST_F(BuildWithLogTest, RestatTest) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
                                       "rule true\n"
@@ -1510,6 +1672,57 @@ TEST_F(BuildWithLogTest, RestatSingleDependentOutputDirty) {
   ASSERT_EQ(3u, command_runner_.commands_ran_.size());
 }
 
+TEST_F(BuildWithLogTest, RestatByHash) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cp\n"
+                                      "  command = cp $in $out\n"
+                                      "  restat = hash\n"
+                                      "build mid: cp in\n"
+                                      "build out: cat mid\n"));
+
+  fs_.Create("in", "contents");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  TimeStamp mid_mtime = fs_.files_["mid"].mtime;
+
+  // "cp" rewrites mid with the same contents, so out needn't be rebuilt,
+  // and mid gets its previous mtime back.
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  fs_.Tick();
+  fs_.Create("in", "contents");
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp in mid", command_runner_.commands_ran_[0]);
+  EXPECT_EQ(mid_mtime, fs_.files_["mid"].mtime);
+
+  // The build log remembers that mid is up to date with in.
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+
+  // Different contents propagate as usual.
+  fs_.Tick();
+  fs_.Create("in", "other contents");
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_LT(mid_mtime, fs_.files_["mid"].mtime);
+}
+
 // Test scenario, in which an input file is removed, but output isn't changed
 // https://github.com/ninja-build/ninja/issues/295
 TEST_F(BuildWithLogTest, RestatMissingInput) {
@@ -1689,6 +1902,41 @@ TEST_F(BuildTest, RspFileFailure) {
   ASSERT_EQ("Another very long command", fs_.files_["out.rsp"].contents);
 }
 
+/// The response files written ahead for commands that don't start after all
+/// are removed, unlike those of the commands that failed.
+TEST_F(BuildTest, RspFileOfEdgeNeverStarted) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule fail\n"
+                                      "  command = fail $out\n"
+                                      "  rspfile = $out.rsp\n"
+                                      "  rspfile_content = $in\n"
+                                      "build out1: fail in\n"
+                                      "build out2: fail in\n"));
+  fs_.Create("in", "");
+  config_.io_threads = 2;
+  std::string err;
+  {
+    Builder builder(&state_, config_, nullptr, nullptr, &fs_);
+    builder.command_runner_.reset(&command_runner_);
+    EXPECT_TRUE(builder.AddTarget("out1", &err));
+    EXPECT_TRUE(builder.AddTarget("out2", &err));
+    ASSERT_EQ("", err);
+    EXPECT_FALSE(builder.Build(&err));
+    builder.command_runner_.release();
+  }
+  EXPECT_EQ("subcommand failed", err);
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+
+  // The other edge was prepared while the first one ran.
+  EXPECT_EQ(1u, fs_.files_created_.count("out1.rsp"));
+  EXPECT_EQ(1u, fs_.files_created_.count("out2.rsp"));
+  const std::string ran = command_runner_.commands_ran_[0] == "fail out1"
+                              ? "out1.rsp" : "out2.rsp";
+  const std::string never_ran = ran == "out1.rsp" ? "out2.rsp" : "out1.rsp";
+  EXPECT_EQ(1u, fs_.files_.count(ran));
+  EXPECT_EQ(0u, fs_.files_.count(never_ran));
+}
+
 // Test that contents of the RSP file behaves like a regular part of
 // command line, i.e. triggers a rebuild if changed
 TEST_F(BuildWithLogTest, RspFileCmdLineChange) {
@@ -2096,6 +2344,402 @@ TEST_F(BuildWithQueryDepsLogTest, TwoOutputsDepFileGCCOnlySecondaryOutput) {
   EXPECT_EQ("in2", out2_deps->nodes[1]->path());
 }
 
+/// Builds whose edges may be restored from a distributed cache served by a
+/// daemon running in-process.
+struct BuildWithCacheTest : public BuildTest {
+  BuildWithCacheTest() : BuildTest(&deps_log_) {
+    builder_.SetBuildLog(&build_log_);
+  }
+
+  ~BuildWithCacheTest() override { deps_log_.Close(); }
+
+  void SetUp() override {
+    BuildTest::SetUp();
+
+    temp_dir_.CreateAndEnter("BuildWithCacheTest");
+
+    std::string err;
+    ASSERT_TRUE(deps_log_.OpenForWrite("ninja_deps", &err));
+    ASSERT_EQ("", err);
+
+    DaemonConfig config;
+    config.address = "127.0.0.1";
+    config.port = 0;
+    config.allow_put = true;
+    daemon_ = std::make_unique<Daemon>(config, ".");
+    server_thread_ = std::thread{ [this]() { daemon_->Run(); } };
+    builder_.dcache_.Init(
+        { { "127.0.0.1", std::to_string(daemon_->port()) } });
+  }
+
+  void TearDown() override {
+    daemon_->Stop();
+    server_thread_.join();
+    temp_dir_.Cleanup();
+  }
+
+  /// Key of the edge building |output| in the cache.
+  std::string Key(const std::string& output) {
+    std::string key;
+    EXPECT_TRUE(builder_.CacheKey(GetNode(output)->in_edge(), &key));
+    return key;
+  }
+
+  /// Stores a file under a key of the cache.
+  void AddToCache(const std::string& key, const std::string& name,
+                  const std::string& contents) {
+    const std::string path = key + "/" + name;
+    ASSERT_TRUE(disk_interface_.MakeDirs(path));
+    ASSERT_TRUE(disk_interface_.WriteFile(path, contents));
+  }
+
+  /// Stores the only output of an edge under its key in the cache.
+  void AddOutputToCache(const std::string& key, const std::string& output,
+                        const std::string& contents, bool executable = false) {
+    ASSERT_NO_FATAL_FAILURE(AddToCache(key, output, contents));
+    ASSERT_NO_FATAL_FAILURE(
+        AddToCache(key, ".executables", executable ? output + "\n" : ""));
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_interface_;
+  BuildLog build_log_;
+  DepsLog deps_log_;
+  std::unique_ptr<Daemon> daemon_;
+  std::thread server_thread_;
+};
+
+TEST_F(BuildWithCacheTest, RestoresOutputs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cc\n"
+                                      "  command = cc\n"
+                                      "build out1: cc in\n"
+                                      "build out2: cat out1\n"));
+  fs_.Create("in", "source");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  ASSERT_NO_FATAL_FAILURE(
+      AddOutputToCache(Key("out1"), "out1", "object\ncode"));
+
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat out1 > out2", command_runner_.commands_ran_[0]);
+  std::string contents;
+  EXPECT_EQ(DiskInterface::Okay, fs_.ReadFile("out1", &contents, &err));
+  EXPECT_EQ("object\ncode", contents);
+  EXPECT_TRUE(build_log_.LookupByOutput("out1"));
+
+  // The restored output must not look dirty to the next build.
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+}
+
+/// What running the command takes stays logged across a restore, for the
+/// critical path and the memory budget of the next builds to use.
+TEST_F(BuildWithCacheTest, RestoreKeepsLoggedUsage) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cc\n"
+                                      "  command = cc\n"
+                                      "build out: cc in\n"));
+  fs_.Create("in", "source");
+  ResourceUsage usage;
+  usage.max_rss_kb = 4096;
+  usage.user_time_ms = 4000;
+  ASSERT_TRUE(build_log_.RecordCommand(GetNode("out")->in_edge(), 10, 5010,
+                                       0, usage));
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  ASSERT_NO_FATAL_FAILURE(AddOutputToCache(Key("out"), "out", "object"));
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, command_runner_.commands_ran_.size());
+
+  const BuildLog::LogEntry* entry = build_log_.LookupByOutput("out");
+  ASSERT_TRUE(entry);
+  EXPECT_TRUE(entry->usage == usage);
+  EXPECT_EQ(5000, entry->end_time - entry->start_time);
+  EXPECT_GT(entry->mtime, 0);
+}
+
+TEST_F(BuildWithCacheTest, RestatKeepsIdenticalOutputs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cc\n"
+                                      "  command = cc\n"
+                                      "  restat = 1\n"
+                                      "build out1: cc in\n"
+                                      "build out2: cat out1\n"));
+  fs_.Create("in", "");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(2u, command_runner_.commands_ran_.size());
+
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  fs_.Tick();
+  fs_.Create("in", "");
+
+  // The cached out1 is identical to the one on disk, so it is left alone
+  // and out2 doesn't need to be rebuilt.
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  ASSERT_NO_FATAL_FAILURE(AddOutputToCache(Key("out1"), "out1", ""));
+  TimeStamp out1_mtime = fs_.Stat("out1", &err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, command_runner_.commands_ran_.size());
+  EXPECT_EQ(out1_mtime, fs_.Stat("out1", &err));
+}
+
+TEST_F(BuildWithCacheTest, RestoresDeps) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cc\n"
+                                      "  command = cc\n"
+                                      "  deps = gcc\n"
+                                      "  depfile = $out.d\n"
+                                      "build out: cc in1\n"));
+  fs_.Create("in3", "");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+
+  // The dependencies are listed under the key of the edge, and the output
+  // depends on them.
+  const std::string key = Key("out");
+  std::string outputs_key;
+  ASSERT_TRUE(builder_.DepsCacheKey(key, { GetNode("in2"), GetNode("in3") },
+                                    &outputs_key));
+  ASSERT_NO_FATAL_FAILURE(AddToCache(key, ".deps", "in2\nin3\n"));
+  ASSERT_NO_FATAL_FAILURE(AddOutputToCache(outputs_key, "out", "object"));
+
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, command_runner_.commands_ran_.size());
+
+  DepsLog::Deps* deps = deps_log_.GetDeps(GetNode("out"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("in2", deps->nodes[0]->path());
+  EXPECT_EQ("in3", deps->nodes[1]->path());
+
+  // The output is left alone when one of them changes.
+  fs_.Tick();
+  fs_.Create("in3", "changed");
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  fs_.Create("out.d", "out: in2 in3");
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, command_runner_.commands_ran_.size());
+}
+
+TEST_F(BuildWithCacheTest, StoresOutputsAndDeps) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cc\n"
+                                      "  command = cc\n"
+                                      "  deps = gcc\n"
+                                      "  depfile = $out.d\n"
+                                      "build out: cc in1\n"));
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  fs_.Create("out.d", "out: in2");
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, command_runner_.commands_ran_.size());
+
+  std::string contents;
+  EXPECT_EQ(DiskInterface::Okay,
+            disk_interface_.ReadFile(Key("out") + "/.deps", &contents, &err));
+  EXPECT_EQ("in2\n", contents);
+
+  // Another checkout gets the output from the cache, along with its deps.
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  fs_.RemoveFile("out");
+  deps_log_.Close();
+  DepsLog deps_log;
+  ASSERT_TRUE(deps_log.OpenForWrite("other_deps", &err));
+  Builder builder(&state_, config_, nullptr, &deps_log, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  builder.dcache_.Init({ { "127.0.0.1", std::to_string(daemon_->port()) } });
+
+  EXPECT_TRUE(builder.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, command_runner_.commands_ran_.size());
+  EXPECT_GT(fs_.Stat("out", &err), 0);
+
+  // Which keeps it incremental: changing the header rebuilds it.
+  state_.Reset();
+  fs_.Tick();
+  fs_.Create("in2", "changed");
+  EXPECT_TRUE(builder.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  fs_.Create("out.d", "out: in2");
+  EXPECT_TRUE(builder.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, command_runner_.commands_ran_.size());
+
+  builder.command_runner_.release();
+  deps_log.Close();
+}
+
+/// Builds "out", which the command makes executable.
+struct ExecutableCommandRunner : public FakeCommandRunner {
+  using FakeCommandRunner::FakeCommandRunner;
+
+  bool StartCommand(Edge* edge) override {
+    bool started = FakeCommandRunner::StartCommand(edge);
+    fs_->files_["out"].executable = true;
+    return started;
+  }
+};
+
+TEST_F(BuildWithCacheTest, KeepsOutputsExecutable) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cc\n"
+                                      "  command = cc\n"
+                                      "build out: cc in\n"));
+  fs_.Create("in", "source");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  ExecutableCommandRunner runner(&fs_);
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&runner);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, runner.commands_ran_.size());
+  std::string executables;
+  EXPECT_EQ(DiskInterface::Okay,
+            disk_interface_.ReadFile(Key("out") + "/.executables",
+                                     &executables, &err));
+  EXPECT_EQ("out\n", executables);
+
+  // The output comes back from the cache executable.
+  runner.commands_ran_.clear();
+  state_.Reset();
+  fs_.RemoveFile("out");
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  builder_.command_runner_.release();
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, runner.commands_ran_.size());
+  EXPECT_TRUE(fs_.IsExecutable("out"));
+}
+
+/// Edges looked up on other threads are finished by the main loop, or run
+/// once the lookup misses.
+TEST_F(BuildWithCacheTest, RestoresOnThreads) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cc\n"
+                                      "  command = cc\n"
+                                      "build out1: cc in\n"
+                                      "build out2: cat out1\n"));
+  fs_.Create("in", "source");
+  config_.io_threads = 2;
+  Builder builder(&state_, config_, nullptr, &deps_log_, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  builder.dcache_.Init({ { "127.0.0.1", std::to_string(daemon_->port()) } });
+
+  std::string err;
+  EXPECT_TRUE(builder.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  std::string key;
+  ASSERT_TRUE(builder.CacheKey(GetNode("out1")->in_edge(), &key));
+  ASSERT_NO_FATAL_FAILURE(AddOutputToCache(key, "out1", "object"));
+  EXPECT_TRUE(builder.Build(&err));
+  builder.command_runner_.release();
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat out1 > out2", command_runner_.commands_ran_[0]);
+  std::string contents;
+  EXPECT_EQ(DiskInterface::Okay, fs_.ReadFile("out1", &contents, &err));
+  EXPECT_EQ("object", contents);
+}
+
+/// Outputs stored on other threads are all in the cache once the build ends.
+TEST_F(BuildWithCacheTest, StoresOnThreads) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cc\n"
+                                      "  command = cc\n"
+                                      "build out: cc in\n"));
+  fs_.Create("in", "source");
+  config_.io_threads = 2;
+  Builder builder(&state_, config_, nullptr, &deps_log_, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  builder.dcache_.Init({ { "127.0.0.1", std::to_string(daemon_->port()) } });
+
+  std::string err;
+  EXPECT_TRUE(builder.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  std::string key;
+  ASSERT_TRUE(builder.CacheKey(GetNode("out")->in_edge(), &key));
+  EXPECT_TRUE(builder.Build(&err));
+  builder.command_runner_.release();
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_GT(disk_interface_.Stat(key + "/out", &err), 0);
+}
+
+/// Edits a file as the first command starts, like a user saving a file
+/// while the build runs.
+struct EditingCommandRunner : public FakeCommandRunner {
+  EditingCommandRunner(VirtualFileSystem* fs, std::string path)
+      : FakeCommandRunner(fs), path_(std::move(path)) {}
+
+  bool StartCommand(Edge* edge) override {
+    bool started = FakeCommandRunner::StartCommand(edge);
+    fs_->Create(path_, "edited");
+    return started;
+  }
+
+  std::string path_;
+};
+
+TEST_F(BuildWithCacheTest, StoresUnderKeyFromBeforeCommand) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cc\n"
+                                      "  command = cc\n"
+                                      "build out: cc in\n"));
+  fs_.Create("in", "source");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  const std::string key = Key("out");
+  EditingCommandRunner runner(&fs_, "in");
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&runner);
+  EXPECT_TRUE(builder_.Build(&err));
+  builder_.command_runner_.release();
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, runner.commands_ran_.size());
+
+  // The output was built from the source as it was before the edit.
+  EXPECT_GT(disk_interface_.Stat(key + "/out", &err), 0);
+  EXPECT_EQ(0, disk_interface_.Stat(Key("out") + "/out", &err));
+}
+
 /// Tests of builds involving deps logs necessarily must span
 /// multiple builds.  We reuse methods on BuildTest but not the
 /// builder_ it std::sets up, because we want pristine objects for
@@ -2181,6 +2825,127 @@ TEST_F(BuildWithDepsLogTest, Straightforward) {
   }
 }
 
+/// Verify that commands examined on other threads are finished just the same.
+TEST_F(BuildWithDepsLogTest, CompletionThreads) {
+  std::string err;
+  // Each command depends on the previous one, so the examination of one
+  // never races with the fake commands writing to fs_.
+  const char* manifest =
+      "build mid: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = in1.d\n"
+      "build out: cat mid\n";
+  config_.io_threads = 2;
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+  DepsLog deps_log;
+  ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+  ASSERT_EQ("", err);
+
+  Builder builder(&state, config_, nullptr, &deps_log, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  EXPECT_TRUE(builder.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  fs_.Create("in1.d", "mid: in2");
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  builder.command_runner_.release();
+
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat in1 > mid", command_runner_.commands_ran_[0]);
+  EXPECT_EQ(0, fs_.Stat("in1.d", &err));
+  DepsLog::Deps* deps = deps_log.GetDeps(state.LookupNode("mid"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(1, deps->node_count);
+  EXPECT_EQ("in2", deps->nodes[0]->path());
+  deps_log.Close();
+}
+
+// Nodes stat'ed ahead on several threads, including the dependencies found
+// in the deps log, give the same result as stat'ing them one at a time.
+TEST_F(BuildWithDepsLogTest, StatAhead) {
+  std::string err;
+  const char* manifest =
+      "build out: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = in1.d\n";
+  {
+    fs_.Create("in1.d", "out: in2");
+    fs_.Create("in2", "");
+
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+    DepsLog deps_log;
+    ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+    ASSERT_EQ("", err);
+
+    Builder builder(&state, config_, nullptr, &deps_log, &fs_);
+    builder.command_runner_.reset(&command_runner_);
+    EXPECT_TRUE(builder.AddTarget("out", &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(builder.Build(&err));
+    EXPECT_EQ("", err);
+    deps_log.Close();
+    builder.command_runner_.release();
+  }
+
+  config_.io_threads = 2;
+  for (bool touch_in2 : { false, true }) {
+    if (touch_in2) {
+      fs_.Tick();
+      fs_.Create("in2", "");
+    }
+
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+    DepsLog deps_log;
+    ASSERT_TRUE(deps_log.Load("ninja_deps", &state, &err));
+
+    Builder builder(&state, config_, nullptr, &deps_log, &fs_);
+    builder.StatAhead({ state.LookupNode("out") });
+    EXPECT_TRUE(state.LookupNode("in2")->status_known());
+    EXPECT_TRUE(builder.AddTarget("out", &err));
+    ASSERT_EQ("", err);
+    EXPECT_EQ(!touch_in2, builder.AlreadyUpToDate());
+  }
+}
+
+/// A file system stat'ing only some files in a batch, like a disk that
+/// knows some mtimes from a watcher but can't batch the stats of the rest.
+struct PartlyBatchedFileSystem : public VirtualFileSystem {
+  bool StatMany(const std::vector<const std::string*>& paths,
+                TimeStamp* mtimes) const override {
+    for (size_t i = 0; i < paths.size(); ++i) {
+      std::string err;
+      mtimes[i] = paths[i]->compare(0, 5, "known") == 0 ? Stat(*paths[i], &err)
+                                                       : -1;
+    }
+    return true;
+  }
+};
+
+TEST_F(BuildTest, StatAheadStatsWhatBatchLeavesOut) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, "build out: cat known in\n"));
+  PartlyBatchedFileSystem fs;
+  fs.Create("known", "");
+  fs.Create("in", "");
+  config_.io_threads = 2;
+  Builder builder(&state_, config_, nullptr, nullptr, &fs);
+
+  builder.StatAhead({ GetNode("out") });
+  EXPECT_TRUE(GetNode("known")->status_known());
+  EXPECT_TRUE(GetNode("in")->status_known());
+  EXPECT_TRUE(GetNode("out")->status_known());
+  EXPECT_FALSE(GetNode("out")->exists());
+}
+
 /// Verify that obsolete dependency info causes a rebuild.
 /// 1) Run a successful build where everything has time t, record deps.
 /// 2) Move input/output to time t+1 -- despite files in alignment,
@@ -2893,6 +3658,42 @@ TEST_F(BuildTest, DyndepBuildDiscoverNewInput) {
   EXPECT_EQ("touch out", command_runner_.commands_ran_[2]);
 }
 
+TEST_F(BuildTest, DyndepBuildDiscoverNewInputWeighed) {
+  // Verify that the edges a dyndep file brings into the plan get a critical
+  // path weight accounting for the edges depending on them.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule touch\n"
+                                      "  command = touch $out\n"
+                                      "rule cp\n"
+                                      "  command = cp $in $out\n"
+                                      "build dd: cp dd-in\n"
+                                      "build in2: cp src\n"
+                                      "build in: cp in2\n"
+                                      "build out: touch || dd\n"
+                                      "  dyndep = dd\n"));
+  fs_.Create("dd-in",
+             "ninja_dyndep_version = 1\n"
+             "build out: dyndep | in\n");
+  fs_.Create("in", "");
+  fs_.Create("in2", "");
+  fs_.Tick();
+  fs_.Create("src", "");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(4u, command_runner_.commands_ran_.size());
+  const Edge* out = GetNode("out")->in_edge();
+  const Edge* in = GetNode("in")->in_edge();
+  const Edge* in2 = GetNode("in2")->in_edge();
+  EXPECT_EQ(1, out->critical_path_weight());
+  EXPECT_EQ(2, in->critical_path_weight());
+  EXPECT_EQ(3, in2->critical_path_weight());
+}
+
 TEST_F(BuildTest, DyndepBuildDiscoverImplicitConnection) {
   // Verify that a dyndep file can be built and loaded to discover
   // that one edge has an implicit output that is also an implicit
@@ -2983,6 +3784,42 @@ TEST_F(BuildTest, DyndepBuildDiscoverNowWantEdgeAndDependent) {
   EXPECT_EQ("touch out out.imp", command_runner_.commands_ran_[2]);
 }
 
+TEST_F(BuildTest, DyndepBuildDiscoverFromOneEdge) {
+  // Verify that dyndep files built by the same edge are loaded together
+  // and discover that edges and their shared dependent are wanted.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule touch\n"
+                                      "  command = touch $out $out.imp\n"
+                                      "rule true\n"
+                                      "  command = true\n"
+                                      "build dd1 dd2: true dd-in\n"
+                                      "build tmp1: touch || dd1\n"
+                                      "  dyndep = dd1\n"
+                                      "build tmp2: touch || dd2\n"
+                                      "  dyndep = dd2\n"
+                                      "build out: touch tmp1 tmp2\n"));
+  fs_.Create("dd1",
+             "ninja_dyndep_version = 1\n"
+             "build tmp1 | tmp1.imp: dyndep\n");
+  fs_.Create("dd2",
+             "ninja_dyndep_version = 1\n"
+             "build tmp2 | tmp2.imp: dyndep\n");
+  fs_.Create("tmp1", "");
+  fs_.Create("tmp2", "");
+  fs_.Create("out", "");
+  fs_.Tick();
+  fs_.Create("dd-in", "");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(4u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("true", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch out out.imp", command_runner_.commands_ran_[3]);
+}
+
 TEST_F(BuildTest, DyndepBuildDiscoverCircular) {
   // Verify that a dyndep file can be built and loaded to discover
   // and reject a circular dependency.
@@ -0,0 +1,315 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "content_hash.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define USE_AVX2_HASHER
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#elif (defined(_M_X64) || defined(_M_IX86)) && defined(__AVX2__)
+#define USE_AVX2_HASHER
+#define TARGET_AVX2
+#endif
+
+#if (defined(__aarch64__) && defined(__ARM_NEON) &&   \
+     (!defined(__BYTE_ORDER__) ||                     \
+      __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)) ||  \
+    defined(_M_ARM64)
+#define USE_NEON_HASHER
+#endif
+
+#ifdef USE_AVX2_HASHER
+#include <immintrin.h>
+#endif
+#ifdef USE_NEON_HASHER
+#include <arm_neon.h>
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+namespace {
+
+/// The data is hashed by stripes of 64 bytes, each made of 8 lanes of 64
+/// bits which are mixed into as many accumulators.  Every 16 stripes, the
+/// accumulators are scrambled.
+const size_t kLanes = 8;
+const size_t kStripeLen = kLanes * 8;
+const size_t kStripesPerBlock = 16;
+const size_t kBlockLen = kStripeLen * kStripesPerBlock;
+
+const uint64_t kPrime32_1 = 0x9E3779B1U;
+const uint64_t kPrime32_2 = 0x85EBCA77U;
+const uint64_t kPrime32_3 = 0xC2B2AE3DU;
+const uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+const uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+
+/// Pseudo-random keys mixed with the data and the accumulators.
+struct Secret {
+  /// Keys of the lanes of a stripe, starting one lane further than those of
+  /// the previous stripe.  The last stripe of the data starts after those
+  /// of a block.
+  uint64_t stripes[kStripesPerBlock + kLanes];
+  uint64_t scramble[kLanes];
+  /// Keys of the accumulators when merging them into each half of the
+  /// digest.
+  uint64_t low[kLanes];
+  uint64_t high[kLanes];
+};
+
+constexpr uint64_t SplitMix64(uint64_t& state) {
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+constexpr Secret MakeSecret() {
+  Secret secret{};
+  uint64_t state = 0xDECAFBADDECAFBADULL;
+  for (uint64_t& key : secret.stripes)
+    key = SplitMix64(state);
+  for (uint64_t& key : secret.scramble)
+    key = SplitMix64(state);
+  for (uint64_t& key : secret.low)
+    key = SplitMix64(state);
+  for (uint64_t& key : secret.high)
+    key = SplitMix64(state);
+  return secret;
+}
+
+constexpr Secret kSecret = MakeSecret();
+
+inline uint64_t ReadLE64(const unsigned char* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
+
+/// Multiply |a| and |b| into 128 bits, and fold them into 64.
+inline uint64_t Mul128Fold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 product = (unsigned __int128)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  uint64_t high;
+  uint64_t low = _umul128(a, b, &high);
+  return low ^ high;
+#else
+  uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+  uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+  uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+  uint64_t hi_hi = (a >> 32) * (b >> 32);
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+  uint64_t high = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+  uint64_t low = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+  return low ^ high;
+#endif
+}
+
+inline uint64_t Avalanche(uint64_t h) {
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t MergeAccumulators(const uint64_t* acc, const uint64_t* keys,
+                           uint64_t start) {
+  uint64_t result = start;
+  for (size_t i = 0; i < kLanes; i += 2)
+    result += Mul128Fold64(acc[i] ^ keys[i], acc[i + 1] ^ keys[i + 1]);
+  return Avalanche(result);
+}
+
+/// Mix |stripes| stripes of |data| into the accumulators |acc|.  Each lane
+/// of the data is added to the accumulator of the neighbouring lane, and
+/// the product of the two halves of the lane xored with its key to its own.
+void AccumulateScalar(uint64_t* acc, const unsigned char* data,
+                      size_t stripes, const uint64_t* keys) {
+  for (size_t s = 0; s < stripes; ++s) {
+    const unsigned char* stripe = data + s * kStripeLen;
+    for (size_t i = 0; i < kLanes; ++i) {
+      uint64_t lane = ReadLE64(stripe + i * 8);
+      uint64_t keyed = lane ^ keys[s + i];
+      acc[i ^ 1] += lane;
+      acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+    }
+  }
+}
+
+/// Spread the high bits of the accumulators over their low bits, which the
+/// products of halves would otherwise lose.
+void ScrambleScalar(uint64_t* acc) {
+  for (size_t i = 0; i < kLanes; ++i) {
+    uint64_t a = acc[i];
+    a ^= a >> 47;
+    a ^= kSecret.scramble[i];
+    acc[i] = a * kPrime32_1;
+  }
+}
+
+#ifdef USE_AVX2_HASHER
+TARGET_AVX2 void AccumulateAvx2(uint64_t* acc, const unsigned char* data,
+                                size_t stripes, const uint64_t* keys) {
+  __m256i acc0 = _mm256_loadu_si256((const __m256i*)acc);
+  __m256i acc1 = _mm256_loadu_si256((const __m256i*)(acc + 4));
+  for (size_t s = 0; s < stripes; ++s) {
+    const unsigned char* stripe = data + s * kStripeLen;
+    __m256i data0 = _mm256_loadu_si256((const __m256i*)stripe);
+    __m256i data1 = _mm256_loadu_si256((const __m256i*)(stripe + 32));
+    __m256i keyed0 = _mm256_xor_si256(
+        data0, _mm256_loadu_si256((const __m256i*)(keys + s)));
+    __m256i keyed1 = _mm256_xor_si256(
+        data1, _mm256_loadu_si256((const __m256i*)(keys + s + 4)));
+    __m256i product0 = _mm256_mul_epu32(keyed0, _mm256_srli_epi64(keyed0, 32));
+    __m256i product1 = _mm256_mul_epu32(keyed1, _mm256_srli_epi64(keyed1, 32));
+    // Swap the lanes of each pair.
+    __m256i swapped0 = _mm256_shuffle_epi32(data0, _MM_SHUFFLE(1, 0, 3, 2));
+    __m256i swapped1 = _mm256_shuffle_epi32(data1, _MM_SHUFFLE(1, 0, 3, 2));
+    acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(product0, swapped0));
+    acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(product1, swapped1));
+  }
+  _mm256_storeu_si256((__m256i*)acc, acc0);
+  _mm256_storeu_si256((__m256i*)(acc + 4), acc1);
+}
+
+TARGET_AVX2 void ScrambleAvx2(uint64_t* acc) {
+  const __m256i prime = _mm256_set1_epi32((int)kPrime32_1);
+  for (size_t i = 0; i < kLanes; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(acc + i));
+    a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+    a = _mm256_xor_si256(
+        a, _mm256_loadu_si256((const __m256i*)(kSecret.scramble + i)));
+    __m256i low = _mm256_mul_epu32(a, prime);
+    __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+    a = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    _mm256_storeu_si256((__m256i*)(acc + i), a);
+  }
+}
+
+bool CpuHasAvx2() {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_cpu_supports("avx2");
+#else
+  return true;  // Compiled for AVX2.
+#endif
+}
+#endif  // USE_AVX2_HASHER
+
+#ifdef USE_NEON_HASHER
+void AccumulateNeon(uint64_t* acc, const unsigned char* data, size_t stripes,
+                    const uint64_t* keys) {
+  uint64x2_t lanes[kLanes / 2];
+  for (size_t i = 0; i < kLanes / 2; ++i)
+    lanes[i] = vld1q_u64(acc + 2 * i);
+  for (size_t s = 0; s < stripes; ++s) {
+    const unsigned char* stripe = data + s * kStripeLen;
+    for (size_t i = 0; i < kLanes / 2; ++i) {
+      uint64x2_t lane = vreinterpretq_u64_u8(vld1q_u8(stripe + 16 * i));
+      uint64x2_t keyed = veorq_u64(lane, vld1q_u64(keys + s + 2 * i));
+      uint64x2_t product = vmull_u32(vmovn_u64(keyed), vshrn_n_u64(keyed, 32));
+      // Swap the lanes of the pair.
+      uint64x2_t swapped = vextq_u64(lane, lane, 1);
+      lanes[i] = vaddq_u64(lanes[i], vaddq_u64(product, swapped));
+    }
+  }
+  for (size_t i = 0; i < kLanes / 2; ++i)
+    vst1q_u64(acc + 2 * i, lanes[i]);
+}
+
+void ScrambleNeon(uint64_t* acc) {
+  const uint32x2_t prime = vdup_n_u32((uint32_t)kPrime32_1);
+  for (size_t i = 0; i < kLanes; i += 2) {
+    uint64x2_t a = vld1q_u64(acc + i);
+    a = veorq_u64(a, vshrq_n_u64(a, 47));
+    a = veorq_u64(a, vld1q_u64(kSecret.scramble + i));
+    uint64x2_t low = vmull_u32(vmovn_u64(a), prime);
+    uint64x2_t high = vmull_u32(vshrn_n_u64(a, 32), prime);
+    vst1q_u64(acc + i, vaddq_u64(low, vshlq_n_u64(high, 32)));
+  }
+}
+#endif  // USE_NEON_HASHER
+
+using AccumulateFunc = void (*)(uint64_t* acc, const unsigned char* data,
+                                size_t stripes, const uint64_t* keys);
+using ScrambleFunc = void (*)(uint64_t* acc);
+
+template <AccumulateFunc Accumulate, ScrambleFunc Scramble>
+ContentHash HashWith(const void* data, size_t len) {
+  uint64_t acc[kLanes] = { kPrime32_3, kPrime64_1, kPrime64_2, kPrime64_3,
+                           kPrime64_4, kPrime32_2, kPrime64_5, kPrime32_1 };
+  const auto* bytes = static_cast<const unsigned char*>(data);
+  const uint64_t* last_keys = kSecret.stripes + kStripesPerBlock;
+  if (len >= kStripeLen) {
+    // The last stripe is hashed on its own, overlapping the previous one
+    // unless the length is a multiple of the stripe.
+    size_t blocks = (len - 1) / kBlockLen;
+    for (size_t b = 0; b < blocks; ++b) {
+      Accumulate(acc, bytes + b * kBlockLen, kStripesPerBlock,
+                 kSecret.stripes);
+      Scramble(acc);
+    }
+    size_t stripes = (len - 1 - blocks * kBlockLen) / kStripeLen;
+    Accumulate(acc, bytes + blocks * kBlockLen, stripes, kSecret.stripes);
+    Accumulate(acc, bytes + len - kStripeLen, 1, last_keys);
+  } else {
+    unsigned char last[kStripeLen] = {};
+    if (len > 0)
+      memcpy(last, bytes, len);
+    Accumulate(acc, last, 1, last_keys);
+  }
+
+  ContentHash hash;
+  hash.low = MergeAccumulators(acc, kSecret.low, len * kPrime64_1);
+  hash.high = MergeAccumulators(acc, kSecret.high, ~(len * kPrime64_2));
+  return hash;
+}
+
+}  // namespace
+
+std::string ContentHash::ToHex() const {
+  char buf[33];
+  snprintf(buf, sizeof(buf), "%016" PRIx64 "%016" PRIx64, high, low);
+  return buf;
+}
+
+std::vector<ContentHasher> AvailableContentHashers() {
+  std::vector<ContentHasher> hashers;
+#ifdef USE_AVX2_HASHER
+  if (CpuHasAvx2())
+    hashers.push_back({ "avx2", HashWith<AccumulateAvx2, ScrambleAvx2> });
+#endif
+#ifdef USE_NEON_HASHER
+  hashers.push_back({ "neon", HashWith<AccumulateNeon, ScrambleNeon> });
+#endif
+  hashers.push_back({ "scalar", HashWith<AccumulateScalar, ScrambleScalar> });
+  return hashers;
+}
+
+ContentHash HashContents(const void* data, size_t len) {
+  static const auto hash = AvailableContentHashers().front().hash;
+  return hash(data, len);
+}
@@ -0,0 +1,60 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_CONTENT_HASH_H_
+#define NINJA_CONTENT_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// 128-bit digest of the contents of a file.  All zeros stands for no
+/// digest, e.g. because the file couldn't be read.
+struct ContentHash {
+  uint64_t low{ 0 };
+  uint64_t high{ 0 };
+
+  /// Whether this is an actual digest.
+  explicit operator bool() const { return low != 0 || high != 0; }
+
+  bool operator==(const ContentHash& o) const {
+    return low == o.low && high == o.high;
+  }
+  bool operator!=(const ContentHash& o) const { return !(*this == o); }
+
+  /// The digest as 32 lowercase hexadecimal digits.
+  std::string ToHex() const;
+};
+
+/// Hash |len| bytes of |data|, e.g. the contents of a file.
+///
+/// The hash works on stripes of 64 bytes in 8 independent 64-bit lanes, so
+/// that it may be vectorised, and it runs with the widest instructions the
+/// CPU supports.  Every implementation computes the same digests, on every
+/// platform, so that they may be shared between machines.  It isn't a
+/// cryptographic hash.  MurmurHash64A() remains faster for short strings.
+ContentHash HashContents(const void* data, size_t len);
+
+/// An implementation of HashContents() for an instruction set.
+struct ContentHasher {
+  const char* name;
+  ContentHash (*hash)(const void* data, size_t len);
+};
+
+/// The implementations which can run on this CPU, the one HashContents()
+/// uses first.
+std::vector<ContentHasher> AvailableContentHashers();
+
+#endif  // NINJA_CONTENT_HASH_H_
@@ -0,0 +1,88 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "content_hash.h"
+
+#include <string>
+
+#include "test.h"
+
+namespace {
+
+std::string MakeContents(size_t len) {
+  std::string contents(len, '\0');
+  uint32_t state = 1;
+  for (char& c : contents) {
+    state = state * 1103515245 + 12345;
+    c = (char)(state >> 16);
+  }
+  return contents;
+}
+
+TEST(ContentHashTest, ImplementationsAgree) {
+  std::vector<ContentHasher> hashers = AvailableContentHashers();
+  ASSERT_FALSE(hashers.empty());
+
+  // Cover the short input path, partial stripes, whole and partial blocks,
+  // at every alignment of the data.
+  const std::string contents = MakeContents(3000);
+  const size_t kLengths[] = { 0,   1,   7,   16,   63,   64,   65,  127,
+                              128, 240, 512, 1023, 1024, 1025, 2048, 2900 };
+  for (size_t len : kLengths) {
+    for (size_t offset = 0; offset < 8; ++offset) {
+      const char* data = contents.data() + offset;
+      ContentHash expected = HashContents(data, len);
+      EXPECT_TRUE(expected);
+      for (const ContentHasher& hasher : hashers)
+        EXPECT_EQ(expected, hasher.hash(data, len));
+    }
+  }
+}
+
+TEST(ContentHashTest, Distinguishes) {
+  std::string contents = MakeContents(2000);
+  ContentHash hash = HashContents(contents.data(), contents.size());
+
+  // Trailing zeros aren't confused with padding.
+  EXPECT_NE(HashContents(contents.data(), 10),
+            HashContents((contents.substr(0, 10) + '\0').data(), 11));
+  EXPECT_NE(hash, HashContents(contents.data(), contents.size() - 1));
+
+  // Each byte counts, wherever it is.
+  for (size_t i : { 0, 1, 63, 64, 1000, 1023, 1024, 1999 }) {
+    std::string changed = contents;
+    changed[i] ^= 1;
+    EXPECT_NE(hash, HashContents(changed.data(), changed.size()));
+  }
+}
+
+TEST(ContentHashTest, Stable) {
+  // Digests are shared between machines through the caches, so they must not
+  // change from one platform or version to the next.
+  const char kContents[] = "int main() { return 0; }\n";
+  EXPECT_EQ("d27c1d2b980830c062eaa42d69831fd0",
+            HashContents(kContents, sizeof(kContents) - 1).ToHex());
+  std::string contents = MakeContents(1500);
+  EXPECT_EQ("b9fe66024f74e3d716d53813a699df69",
+            HashContents(contents.data(), contents.size()).ToHex());
+}
+
+TEST(ContentHashTest, ToHex) {
+  EXPECT_EQ("00000000000000020000000000000001",
+            (ContentHash{ 1, 2 }.ToHex()));
+  EXPECT_EQ("ffffffffffffffff0123456789abcdef",
+            (ContentHash{ 0x0123456789abcdef, ~0ULL }.ToHex()));
+}
+
+}  // anonymous namespace
@@ -14,29 +14,218 @@
 
 #include "daemon.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <list>
 #include <string>
-#include <thread>
+#include <unordered_map>
 #include <vector>
 
 /// Message delimiter
 static const char delim{ '\n' };
 
+/// Longest request line accepted, delimiter included.  Paths are far
+/// shorter; this keeps a client that never ends its line from growing the
+/// buffer of its connection without bound.
+static const size_t kMaxRequestSize{ 16 << 10 };
+
+/// Verb of the requests for a file's contents
+static const char kGetVerb[] = "GET ";
+
+/// Verb of the requests to store a file
+static const char kPutVerb[] = "PUT ";
+
+/// Header of the response to a request for an unavailable file, or to a
+/// request to store a file which failed
+static const char kMissing[] = "-\n";
+
+/// Response to a request to store a file which succeeded
+static const char kStored[] = "+\n";
+
+/// Tells if a path stays within the daemon's root.
+static bool IsSafePath(const std::string& path) {
+  if (path.empty() || path[0] == '/' || path[0] == '\\')
+    return false;
+  for (size_t start = 0, end; start <= path.size(); start = end + 1) {
+    end = path.find_first_of("/\\", start);
+    if (end == std::string::npos)
+      end = path.size();
+    if (path.compare(start, end - start, "..") == 0)
+      return false;
+  }
+  return true;
+}
+
+/// Contents of a file, shared between the cache and in-flight responses.
+using FileContents = std::shared_ptr<const std::string>;
+
+/// Least recently used cache of file contents bounded by a size budget.
+/// Entries are revalidated against the file's size and mtime on every
+/// lookup so that files updated on disk are never served stale.
+class Daemon::FileCache {
+ public:
+  /// Ctor
+  explicit FileCache(size_t budget) : budget_{ budget } {}
+
+  /// Gets the contents of a file, from memory if possible.  Returns null
+  /// if the file can't be read.
+  FileContents Get(const std::string& path);
+
+  /// Atomically replaces the contents of a file, creating it and its
+  /// directories if needed.  Returns false if the file can't be written.
+  bool Put(const std::string& path, const std::string& contents);
+
+ private:
+  struct Entry {
+    FileContents contents;
+    std::filesystem::file_time_type mtime;
+    std::list<std::string>::iterator lru;
+  };
+
+  /// Reads a whole file from disk
+  static FileContents Read(const std::string& path);
+
+  /// Drops least recently used entries until the cache fits its budget
+  void Evict();
+
+  /// Maximum number of bytes of file contents to keep around
+  const size_t budget_;
+
+  /// Number of bytes of file contents currently kept around
+  size_t size_{ 0 };
+
+  /// Number of files written so far, to name temporary files uniquely
+  std::atomic<unsigned> puts_{ 0 };
+
+  /// Cached files, by path
+  std::unordered_map<std::string, Entry> entries_;
+
+  /// Paths of the cached files, most recently used first
+  std::list<std::string> lru_;
+
+  /// Protects the cache from the concurrent workers
+  std::mutex mutex_;
+};
+
+FileContents Daemon::FileCache::Read(const std::string& path) {
+  std::ifstream stream{ path.c_str(), std::ios::binary };
+  if (!stream)
+    return nullptr;
+  return std::make_shared<const std::string>(
+      std::istreambuf_iterator<char>{ stream },
+      std::istreambuf_iterator<char>{});
+}
+
+FileContents Daemon::FileCache::Get(const std::string& path) {
+  if (budget_ == 0)
+    return Read(path);
+
+  std::error_code ec;
+  const auto mtime = std::filesystem::last_write_time(path, ec);
+  if (ec)
+    return Read(path);
+  const auto size = std::filesystem::file_size(path, ec);
+  if (ec)
+    return Read(path);
+
+  {
+    std::lock_guard<std::mutex> lock{ mutex_ };
+    auto it = entries_.find(path);
+    if (it != entries_.end()) {
+      Entry& entry = it->second;
+      if (entry.mtime == mtime && entry.contents->size() == size) {
+        lru_.splice(lru_.begin(), lru_, entry.lru);
+        return entry.contents;
+      }
+      // The file changed on disk since we cached it.
+      size_ -= entry.contents->size();
+      lru_.erase(entry.lru);
+      entries_.erase(it);
+    }
+  }
+
+  // Read outside of the lock so workers can serve other files meanwhile.
+  FileContents contents = Read(path);
+  if (!contents || contents->size() != size || contents->size() > budget_)
+    return contents;
+
+  std::lock_guard<std::mutex> lock{ mutex_ };
+  if (entries_.find(path) == entries_.end()) {
+    lru_.push_front(path);
+    entries_.emplace(path, Entry{ contents, mtime, lru_.begin() });
+    size_ += contents->size();
+    Evict();
+  }
+  return contents;
+}
+
+bool Daemon::FileCache::Put(const std::string& path,
+                            const std::string& contents) {
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  const fs::path target{ path };
+  fs::create_directories(target.parent_path(), ec);
+  if (ec)
+    return false;
+
+  // Readers must never see a partially written file, so write it next to
+  // its final location first.
+  const std::string temp{ path + ".tmp" + std::to_string(puts_++) };
+  {
+    std::ofstream stream{ temp.c_str(), std::ios::binary };
+    stream.write(contents.data(), contents.size());
+    if (!stream) {
+      stream.close();
+      fs::remove(temp, ec);
+      return false;
+    }
+  }
+  fs::rename(temp, target, ec);
+  if (ec) {
+    fs::remove(temp, ec);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock{ mutex_ };
+  auto it = entries_.find(path);
+  if (it != entries_.end()) {
+    size_ -= it->second.contents->size();
+    lru_.erase(it->second.lru);
+    entries_.erase(it);
+  }
+  return true;
+}
+
+void Daemon::FileCache::Evict() {
+  while (size_ > budget_ && !lru_.empty()) {
+    auto it = entries_.find(lru_.back());
+    size_ -= it->second.contents->size();
+    entries_.erase(it);
+    lru_.pop_back();
+  }
+}
+
 ///
 class Daemon::Connection : public std::enable_shared_from_this<Connection> {
  public:
   /// Ctor
   Connection(Daemon& daemon);
 
-  /// Starts the connection's worker thread which will process any and all
-  /// incoming request
+  /// Starts processing any and all incoming request
   void Start();
 
-  /// Completely closes this connection
+  /// Completely closes this connection.  Must run on the connection's strand.
   void Shutdown();
 
+  /// Closes this connection from any thread
+  void Close();
+
   /// Gives read/write access to the socket with which the connection operate
   tcp::socket& GetSocket();
 
@@ -44,24 +233,46 @@ class Daemon::Connection : public std::enable_shared_from_this<Connection> {
   /// Gets the next request to process
   void FetchRequest();
 
-  /// Prepares a response i.e. prepares a file stream buffer to send over the
-  /// network
-  void ProcessRequest(const std::string& path);
+  /// Prepares a response i.e. gets a file's contents to send over the
+  /// network, or stores the file that comes with the request
+  void ProcessRequest(const std::string& request);
+
+  /// Receives the contents of a file to store and stores them
+  void ReceiveFile(const std::string& path, size_t size);
+
+  /// Reads and drops the |size| bytes of contents of a file which won't be
+  /// stored, then says so
+  void SkipFile(size_t size);
 
-  /// Sends the response (a file's raw contents) to a previously made request
-  void SendResponse(std::ifstream& stream);
+  /// Sends the response (a file's size followed by its raw contents) to a
+  /// previously made request.  Null contents mean the file is unavailable.
+  void SendResponse(FileContents contents);
+
+  /// Sends the response to a request to store a file
+  void SendStatus(bool stored);
+
+  /// Writes a response and goes on with the next request
+  void Write(std::shared_ptr<const std::string> header, FileContents contents);
 
   /// Daemon which spawned this connection
   Daemon& daemon_;
 
-  /// Incoming request buffer
+  /// Incoming request buffer, holding at most kMaxRequestSize bytes.  The
+  /// contents of stored files are read elsewhere.
   net::streambuf buf_in_;
 
+  /// Where the contents of files which won't be stored are read to
+  std::array<char, 64 << 10> skip_buffer_;
+
   /// Is the connection currently closed?
   std::atomic<bool> closed_{ false };
 
-  /// Timer counting down the time left to send back a response
-  net::deadline_timer write_timer_;
+  /// Serializes the handlers of this connection when the daemon runs on
+  /// several threads
+  net::strand<net::io_context::executor_type> strand_;
+
+  /// Timer counting down the time left to answer a request
+  net::deadline_timer request_timer_;
 
   /// Socket through which this Connection communicate
   tcp::socket socket_;
@@ -74,14 +285,18 @@ class Daemon::Connection : public std::enable_shared_from_this<Connection> {
   }
 
 Daemon::Connection::Connection(Daemon& daemon)
-    : daemon_{ daemon }, write_timer_{ daemon.io_context_ }, socket_{
-        daemon.io_context_
-      } {}
+    : daemon_{ daemon }, buf_in_{ kMaxRequestSize },
+      strand_{ net::make_strand(daemon.io_context_) },
+      request_timer_{ strand_ }, socket_{ strand_ } {}
 
 void Daemon::Connection::Start() {
-  socket_.set_option(tcp::no_delay(true));
-  // Immediatly start fetching request
-  FetchRequest();
+  net::dispatch(strand_, [this, self = shared_from_this()]() {
+    ErrorCode ec;
+    socket_.set_option(tcp::no_delay(true), ec);
+    SHUTDOWN_IF(ec);
+    // Immediatly start fetching request
+    FetchRequest();
+  });
 }
 
 void Daemon::Connection::Shutdown() {
@@ -94,17 +309,30 @@ void Daemon::Connection::Shutdown() {
                                       desiredClosedValue)) {
     boost::system::error_code ec;
     socket_.shutdown(tcp::socket::shutdown_both, ec);
-    socket_.close();
-    write_timer_.cancel(ec);
-    daemon_.active_connections_.erase(shared_from_this());
+    socket_.close(ec);
+    request_timer_.cancel(ec);
+    daemon_.RemoveConnection(shared_from_this());
   }
 }
 
+void Daemon::Connection::Close() {
+  net::post(strand_, [self = shared_from_this()]() { self->Shutdown(); });
+}
+
 tcp::socket& Daemon::Connection::GetSocket() {
   return socket_;
 }
 
 void Daemon::Connection::FetchRequest() {
+  // The time allowed starts with the wait for the request, so that a client
+  // which stays idle, or never ends its request, doesn't keep its
+  // connection forever.
+  request_timer_.expires_from_now(daemon_.config_.request_timeout);
+  request_timer_.async_wait(
+      [this, self = shared_from_this()](const boost::system::error_code& ec) {
+        SHUTDOWN_IF(!ec);
+      });
+
   net::async_read_until(
       socket_, buf_in_, delim,
       [this, self = shared_from_this()](const ErrorCode& ec,
@@ -121,77 +349,230 @@ void Daemon::Connection::FetchRequest() {
       });
 }
 
-void Daemon::Connection::ProcessRequest(const std::string& path) {
-  // For better throughput, each request will be handled in its own thread.
-  // Just before dying, when all processing is done, the thread will post
-  // a message on the io_context to make the Connection fetch another request.
-  std::thread t([this, self = shared_from_this(), path] {
-    std::ifstream stream{ (daemon_.root_ + "/" + path).c_str() };
+void Daemon::Connection::ProcessRequest(const std::string& request) {
+  if (request.compare(0, sizeof(kPutVerb) - 1, kPutVerb) == 0) {
+    // "PUT <path> <size>", where the path may contain spaces.
+    const size_t path_start = sizeof(kPutVerb) - 1;
+    const size_t separator = request.rfind(' ');
+    char* end = nullptr;
+    const char* size = request.c_str() + separator + 1;
+    const size_t file_size = strtoull(size, &end, 10);
+    // Without a valid size, there is no telling where the next request
+    // starts.
+    SHUTDOWN_IF(separator < path_start || end == size || *end);
+
+    // Refuse what we won't store before its contents come in, so that none
+    // of them are kept around.
+    const std::string path{ request.substr(path_start,
+                                           separator - path_start) };
+    size_t max_size = daemon_.config_.max_object_size;
+    if (daemon_.config_.cache_size != 0)
+      max_size = std::min(max_size, daemon_.config_.cache_size);
+    if (!daemon_.config_.allow_put || file_size > max_size ||
+        !IsSafePath(path)) {
+      SkipFile(file_size);
+      return;
+    }
+    ReceiveFile(path, file_size);
+    return;
+  }
 
-    SendResponse(stream);
-    daemon_.io_context_.post([this, self]() { FetchRequest(); });
+  if (request.compare(0, sizeof(kGetVerb) - 1, kGetVerb) != 0 ||
+      !IsSafePath(request.substr(sizeof(kGetVerb) - 1))) {
+    // Nothing we know how to answer.
+    SendResponse(nullptr);
+    return;
+  }
+  const std::string path{ request.substr(sizeof(kGetVerb) - 1) };
+
+  // Reading the file is left to the worker threads so that the event loop
+  // stays available to other connections.  Once the contents are ready, the
+  // worker posts a message on the connection's strand to send them back.
+  net::post(daemon_.workers_, [this, self = shared_from_this(), path] {
+    FileContents contents =
+        daemon_.file_cache_->Get(daemon_.root_ + "/" + path);
+    net::post(strand_, [this, self, contents]() { SendResponse(contents); });
   });
-  t.detach();
 }
 
-void Daemon::Connection::SendResponse(std::ifstream& stream) {
-  write_timer_.expires_from_now(daemon_.write_timeout_);
-  write_timer_.async_wait(
-      [this](const boost::system::error_code& ec) { SHUTDOWN_IF(!ec); });
+void Daemon::Connection::ReceiveFile(const std::string& path, size_t size) {
+  // Part of the file may have come in along with the request.
+  auto contents = std::make_shared<std::string>(size, '\0');
+  const size_t buffered = std::min(buf_in_.size(), size);
+  net::buffer_copy(net::buffer(*contents), buf_in_.data(), buffered);
+  buf_in_.consume(buffered);
+  net::async_read(
+      socket_, net::buffer(&(*contents)[buffered], size - buffered),
+      [this, self = shared_from_this(), path, contents](const ErrorCode& ec,
+                                                        std::size_t) {
+        SHUTDOWN_IF(ec);
+
+        // Like reads, writes are left to the worker threads.
+        net::post(daemon_.workers_, [this, self, path, contents] {
+          const bool stored =
+              daemon_.file_cache_->Put(daemon_.root_ + "/" + path, *contents);
+          net::post(strand_, [this, self, stored]() { SendStatus(stored); });
+        });
+      });
+}
+
+void Daemon::Connection::SkipFile(size_t size) {
+  const size_t buffered = std::min(buf_in_.size(), size);
+  buf_in_.consume(buffered);
+  size -= buffered;
+  if (size == 0) {
+    SendStatus(false);
+    return;
+  }
 
-  net::streambuf streambuf;
-  std::ostream os{ &streambuf };
-  os << stream.rdbuf() << delim;
+  // Read what's left a chunk at a time, into a buffer bounded no matter how
+  // large the file claims to be.  The request timer cuts off clients taking
+  // too long about it.
+  const size_t chunk = std::min(size, skip_buffer_.size());
+  net::async_read(socket_, net::buffer(skip_buffer_.data(), chunk),
+                  [this, self = shared_from_this(), size, chunk](
+                      const ErrorCode& ec, std::size_t) {
+                    SHUTDOWN_IF(ec);
+                    SkipFile(size - chunk);
+                  });
+}
+
+void Daemon::Connection::SendResponse(FileContents contents) {
+  Write(std::make_shared<const std::string>(
+            contents ? std::to_string(contents->size()) + delim : kMissing),
+        contents);
+}
 
-  net::async_write(socket_, streambuf, net::transfer_all(),
-                   [this, self = shared_from_this()](const ErrorCode& ec,
-                                                     size_t bytes_transferred) {
-                     write_timer_.cancel();
+void Daemon::Connection::SendStatus(bool stored) {
+  Write(std::make_shared<const std::string>(stored ? kStored : kMissing),
+        nullptr);
+}
+
+void Daemon::Connection::Write(std::shared_ptr<const std::string> header,
+                               FileContents contents) {
+  if (closed_)
+    return;
+
+  // Both the header and the contents must outlive the asynchronous write.
+  std::array<net::const_buffer, 2> buffers{ net::buffer(*header),
+                                            net::const_buffer{} };
+  if (contents)
+    buffers[1] = net::buffer(*contents);
+  net::async_write(socket_, buffers, net::transfer_all(),
+                   [this, self = shared_from_this(), header, contents](
+                       const ErrorCode& ec, size_t bytes_transferred) {
+                     ErrorCode ignored;
+                     request_timer_.cancel(ignored);
                      SHUTDOWN_IF(ec);
+                     FetchRequest();
                    });
 }
 
 #undef SHUTDOWN_IF
 
+namespace {
+
+DaemonConfig ConfigForPort(unsigned short port) {
+  DaemonConfig config;
+  config.port = port;
+  return config;
+}
+
+}  // namespace
+
+Daemon::Daemon(const DaemonConfig& config, std::string root)
+    : config_{ config }, acceptor_{ net::make_strand(io_context_),
+                                    tcp::endpoint{
+                                        net::ip::make_address(config.address),
+                                        config.port } },
+      work_{ net::make_work_guard(io_context_) },
+      workers_{ static_cast<size_t>(std::max(config.worker_threads, 1)) },
+      root_{ std::move(root) },
+      file_cache_{ std::make_unique<FileCache>(config.cache_size) } {}
+
 Daemon::Daemon(unsigned short port, std::string root)
-    : acceptor_{ io_context_, tcp::endpoint{ tcp::v6(), port }, false },
-      work_{ net::make_work_guard(io_context_) }, root_{ std::move(root) } {}
+    : Daemon(ConfigForPort(port), std::move(root)) {}
+
+Daemon::~Daemon() {
+  // Workers might still be busy with requests that will never be answered.
+  workers_.join();
+}
 
 ErrorCode Daemon::Run() {
   DoAccept();
+
+  std::vector<std::thread> io_threads;
+  for (int i = 1; i < config_.io_threads; ++i)
+    io_threads.emplace_back([this]() { io_context_.run(); });
+
   ErrorCode err;
   io_context_.run(err);
+
+  for (auto& thread : io_threads)
+    thread.join();
   return err;
 }
 
 void Daemon::Stop() {
-  acceptor_.close();
+  // The acceptor and the connections are only ever touched from the threads
+  // running the io_context, so hand the actual shutdown over to them.
+  net::post(acceptor_.get_executor(), [this]() { DoStop(); });
+}
+
+unsigned short Daemon::port() const {
+  ErrorCode ec;
+  return acceptor_.local_endpoint(ec).port();
+}
+
+void Daemon::DoStop() {
+  ErrorCode ec;
+  acceptor_.close(ec);
 
   // Since we have a multithreaded daemon, we have to participate in the sharing
   // of the connections' pointers here otherwise they might disappear before our
   // eyes!
   std::vector<ConnectionPtr> sessions_to_close;
-  std::copy(active_connections_.begin(), active_connections_.end(),
-            back_inserter(sessions_to_close));
+  {
+    std::lock_guard<std::mutex> lock{ connections_mutex_ };
+    std::copy(active_connections_.begin(), active_connections_.end(),
+              back_inserter(sessions_to_close));
+  }
 
   for (auto& session : sessions_to_close) {
-    session->Shutdown();
+    session->Close();
   }
 
-  active_connections_.clear();
-  io_context_.stop();
+  // Let the context run until the connections are all closed.
+  work_.reset();
+}
+
+void Daemon::RemoveConnection(const ConnectionPtr& connection) {
+  std::lock_guard<std::mutex> lock{ connections_mutex_ };
+  active_connections_.erase(connection);
 }
 
 void Daemon::DoAccept() {
   if (acceptor_.is_open()) {
     auto session = std::make_shared<Connection>(*this);
-    acceptor_.async_accept(session->GetSocket(),
-                           [this, session](const ErrorCode& ec) {
-                             if (!ec) {
-                               active_connections_.insert(session);
-                               session->Start();
-                             }
-                             DoAccept();
-                           });
+    acceptor_.async_accept(session->GetSocket(), [this, session](
+                                                     const ErrorCode& ec) {
+      if (!ec) {
+        bool accepted = false;
+        {
+          std::lock_guard<std::mutex> lock{ connections_mutex_ };
+          if (config_.max_connections == 0 ||
+              active_connections_.size() < config_.max_connections) {
+            active_connections_.insert(session);
+            accepted = true;
+          }
+        }
+
+        if (accepted)
+          session->Start();
+        else
+          session->Close();  // Too many connections already.
+      }
+      DoAccept();
+    });
   }
 }
@@ -12,24 +12,81 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#ifndef NINJA_DAEMON_H_
+#define NINJA_DAEMON_H_
+
 #include <boost/asio.hpp>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_set>
+#include <vector>
 
 namespace net = boost::asio;
 
 using tcp = net::ip::tcp;
 using ErrorCode = boost::system::error_code;
 
+/// Options (e.g. listening endpoint, parallelism, limits) of a Daemon.
+struct DaemonConfig {
+  /// Address on which to listen for connections.
+  std::string address{ "::" };
+
+  /// Port on which to listen for connections.  0 picks any free port.
+  unsigned short port{ 8082 };
+
+  /// Number of threads running the network event loop.
+  int io_threads{ 1 };
+
+  /// Number of threads reading files to answer requests.
+  int worker_threads{ 4 };
+
+  /// Maximum number of simultaneous connections.  0 means no limit.
+  size_t max_connections{ 0 };
+
+  /// Delay allowed for receiving and processing a single request.  Idle
+  /// connections are closed once it expires.
+  boost::posix_time::time_duration request_timeout{
+    boost::posix_time::seconds(30)
+  };
+
+  /// Number of bytes of recently served files kept in memory.  0 disables
+  /// the in-memory cache.
+  size_t cache_size{ 0 };
+
+  /// Whether clients may store files.  Anyone who can reach the daemon can
+  /// then write under its root, so this is off unless asked for.
+  bool allow_put{ false };
+
+  /// Largest file clients may store, in bytes.  With an in-memory cache,
+  /// files may not be larger than the cache either.
+  size_t max_object_size{ 64 << 20 };
+};
+
 /// Multithreaded FTP server that must be run on any machine that
 /// whishes to be part of the distributed cache system.
+///
+/// Clients ask for a file relative to the daemon's root with a
+/// "GET <path>\n" request.  The response is the file's size in decimal and
+/// a newline followed by its raw contents, or "-\n" if the file can't be
+/// served.  Clients store a file with a "PUT <path> <size>\n" request
+/// followed by the file's raw contents, to which the response is "+\n" once
+/// the file is stored or "-\n" if it can't be.  Paths escaping the root are
+/// refused, as are files too large or stored while storing isn't allowed:
+/// their contents are then skipped without being kept.
 class Daemon {
   class Connection;
+  class FileCache;
   using ConnectionPtr = std::shared_ptr<Connection>;
 
  public:
-  /// Ctor
+  /// Ctor.  The daemon is listening, and thus ready to be connected to, as
+  /// soon as it is constructed.  Throws boost::system::system_error if the
+  /// endpoint can't be bound.
+  Daemon(const DaemonConfig& config, std::string root);
   Daemon(unsigned short port, std::string root);
+  ~Daemon();
 
   /// Starts the daemon execution. The thread calling this method will be
   /// blocked until someone explicitly stops the daemon. When the run is done,
@@ -40,10 +97,23 @@ class Daemon {
   /// one running the daemon
   void Stop();
 
+  /// Port on which the daemon is actually listening.
+  unsigned short port() const;
+
  private:
   /// Accepts an incoming connection request
   void DoAccept();
 
+  /// Closes the acceptor and every active connection, then lets the
+  /// context run out of work.  Must run on a thread running the daemon.
+  void DoStop();
+
+  /// Forgets about a connection that has been shut down
+  void RemoveConnection(const ConnectionPtr& connection);
+
+  /// Options with which the daemon was started
+  const DaemonConfig config_;
+
   /// Context of the network messaging
   net::io_context io_context_;
 
@@ -53,13 +123,21 @@ class Daemon {
   /// Guard to make sure the context doesn't shutdown when no work is queued
   net::executor_work_guard<net::io_context::executor_type> work_;
 
+  /// Threads reading the requested files, keeping the event loop free to
+  /// serve other connections.
+  net::thread_pool workers_;
+
   /// Root of the directory from which to select files for responses
   std::string root_;
 
+  /// Recently served files
+  std::unique_ptr<FileCache> file_cache_;
+
   /// List of active connections
   std::unordered_set<ConnectionPtr> active_connections_;
 
-  /// Delay allowed for processing a single request
-  const boost::posix_time::time_duration write_timeout_ =
-      boost::posix_time::seconds(30);
+  /// Protects active_connections_ when running on several threads
+  std::mutex connections_mutex_;
 };
+
+#endif  // NINJA_DAEMON_H_
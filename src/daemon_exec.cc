@@ -12,19 +12,236 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+
+#ifdef _WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#endif
 
 #include "daemon.h"
 
+namespace {
+
+/// Print usage information.
+void Usage() {
+  std::cerr
+      << "usage: daemon_exec [options] <root_dir>\n"
+         "\n"
+         "options:\n"
+         "  -a, --listen ADDR        address to listen on [default=::]\n"
+         "  -p, --port PORT          port to listen on, 0 picks a free one "
+         "[default=8082]\n"
+         "  --io-threads N           threads running the network event loop "
+         "[default=1]\n"
+         "  --workers N              threads reading files for requests "
+         "[default=4]\n"
+         "  --max-connections N      simultaneous connections, 0 means no "
+         "limit [default=0]\n"
+         "  --timeout SECONDS        time allowed to answer a request "
+         "[default=30]\n"
+         "  --cache-size SIZE        bytes of served files kept in memory, "
+         "with an\n"
+         "                           optional K, M or G suffix [default=0]\n"
+         "  --allow-put              let clients store files under the "
+         "root\n"
+         "  --max-object-size SIZE   largest file clients may store, with an "
+         "optional\n"
+         "                           K, M or G suffix [default=64M]\n"
+         "  --ready-file PATH        write the listening port to PATH once "
+         "ready\n";
+}
+
+/// Parses a non-negative integer, with an optional K/M/G size suffix when
+/// |allow_suffix| is set.  Returns false if |arg| isn't such a number.
+bool ParseNumber(const char* arg, bool allow_suffix, size_t* value) {
+  char* end;
+  unsigned long long number = strtoull(arg, &end, 10);
+  if (end == arg || *arg == '-')
+    return false;
+
+  if (allow_suffix && *end != '\0' && end[1] == '\0') {
+    switch (*end) {
+    case 'K':
+    case 'k':
+      number <<= 10;
+      ++end;
+      break;
+    case 'M':
+    case 'm':
+      number <<= 20;
+      ++end;
+      break;
+    case 'G':
+    case 'g':
+      number <<= 30;
+      ++end;
+      break;
+    }
+  }
+  if (*end != '\0')
+    return false;
+
+  *value = static_cast<size_t>(number);
+  return true;
+}
+
+/// Parse argv for command-line options.
+/// Returns an exit code, or -1 if the daemon should run.
+int ReadFlags(int argc, char** argv, DaemonConfig* config,
+              std::string* ready_file, std::string* root) {
+  enum {
+    OPT_IO_THREADS = 1,
+    OPT_WORKERS,
+    OPT_MAX_CONNECTIONS,
+    OPT_TIMEOUT,
+    OPT_CACHE_SIZE,
+    OPT_ALLOW_PUT,
+    OPT_MAX_OBJECT_SIZE,
+    OPT_READY_FILE,
+  };
+  const option kLongOptions[] = {
+    { "help", no_argument, nullptr, 'h' },
+    { "listen", required_argument, nullptr, 'a' },
+    { "port", required_argument, nullptr, 'p' },
+    { "io-threads", required_argument, nullptr, OPT_IO_THREADS },
+    { "workers", required_argument, nullptr, OPT_WORKERS },
+    { "max-connections", required_argument, nullptr, OPT_MAX_CONNECTIONS },
+    { "timeout", required_argument, nullptr, OPT_TIMEOUT },
+    { "cache-size", required_argument, nullptr, OPT_CACHE_SIZE },
+    { "allow-put", no_argument, nullptr, OPT_ALLOW_PUT },
+    { "max-object-size", required_argument, nullptr, OPT_MAX_OBJECT_SIZE },
+    { "ready-file", required_argument, nullptr, OPT_READY_FILE },
+    { nullptr, 0, nullptr, 0 }
+  };
+
+  int opt;
+  size_t value;
+  while ((opt = getopt_long(argc, argv, "a:p:h", kLongOptions, nullptr)) !=
+         -1) {
+    switch (opt) {
+    case 'a':
+      config->address = optarg;
+      break;
+    case 'p':
+      if (!ParseNumber(optarg, false, &value) || value > 65535) {
+        std::cerr << "invalid port '" << optarg << "'\n";
+        return 1;
+      }
+      config->port = static_cast<unsigned short>(value);
+      break;
+    case OPT_IO_THREADS:
+    case OPT_WORKERS:
+      if (!ParseNumber(optarg, false, &value) || value == 0) {
+        std::cerr << "invalid number of threads '" << optarg << "'\n";
+        return 1;
+      }
+      (opt == OPT_IO_THREADS ? config->io_threads : config->worker_threads) =
+          static_cast<int>(value);
+      break;
+    case OPT_MAX_CONNECTIONS:
+      if (!ParseNumber(optarg, false, &config->max_connections)) {
+        std::cerr << "invalid number of connections '" << optarg << "'\n";
+        return 1;
+      }
+      break;
+    case OPT_TIMEOUT:
+      if (!ParseNumber(optarg, false, &value) || value == 0) {
+        std::cerr << "invalid timeout '" << optarg << "'\n";
+        return 1;
+      }
+      config->request_timeout =
+          boost::posix_time::seconds(static_cast<long>(value));
+      break;
+    case OPT_CACHE_SIZE:
+      if (!ParseNumber(optarg, true, &config->cache_size)) {
+        std::cerr << "invalid cache size '" << optarg << "'\n";
+        return 1;
+      }
+      break;
+    case OPT_ALLOW_PUT:
+      config->allow_put = true;
+      break;
+    case OPT_MAX_OBJECT_SIZE:
+      if (!ParseNumber(optarg, true, &config->max_object_size)) {
+        std::cerr << "invalid object size '" << optarg << "'\n";
+        return 1;
+      }
+      break;
+    case OPT_READY_FILE:
+      *ready_file = optarg;
+      break;
+    case 'h':
+    default:
+      Usage();
+      return 1;
+    }
+  }
+
+  if (optind + 1 != argc) {
+    Usage();
+    return 1;
+  }
+  *root = argv[optind];
+
+  return -1;
+}
+
+}  // namespace
+
 int main(int argc, char** argv) {
-  if (argc != 2) {
-    std::cout << "Usage: daemon <root_dir>\n";
+  DaemonConfig config;
+  std::string ready_file;
+  std::string root;
+  int exit_code = ReadFlags(argc, argv, &config, &ready_file, &root);
+  if (exit_code >= 0)
+    return exit_code;
+
+  std::unique_ptr<Daemon> daemon;
+  try {
+    daemon = std::make_unique<Daemon>(config, root);
+  } catch (const boost::system::system_error& e) {
+    std::cerr << "Error: listening on " << config.address << " port "
+              << config.port << ": " << e.what() << "\n";
+    return 1;
   }
 
-  Daemon daemon(8082, argv[1]);
-  auto err = daemon.Run();
+  // The daemon accepts connections from the moment it is constructed, so
+  // it's safe to let the world know about it before running it.
+  std::cout << "daemon: serving " << root << " on " << config.address
+            << " port " << daemon->port() << std::endl;
+  if (!ready_file.empty()) {
+    // Write it aside and rename it, so that whoever polls for the file never
+    // reads a partial port.
+    const std::string tmp_file = ready_file + ".tmp";
+    {
+      std::ofstream ready{ tmp_file.c_str() };
+      ready << daemon->port() << "\n";
+      ready.close();
+      if (!ready) {
+        std::cerr << "Error: writing " << tmp_file << "\n";
+        return 1;
+      }
+    }
+    if (rename(tmp_file.c_str(), ready_file.c_str()) != 0) {
+      std::cerr << "Error: renaming " << tmp_file << ": " << strerror(errno)
+                << "\n";
+      return 1;
+    }
+  }
 
-  std::cerr << "Error: " << err.message() << "\n";
+  auto err = daemon->Run();
+  if (err) {
+    std::cerr << "Error: " << err.message() << "\n";
+    return 1;
+  }
 
-  return 1;
-}
\ No newline at end of file
+  return 0;
+}
@@ -14,13 +14,22 @@
 
 #include "dcache.h"
 
+#include <array>
 #include <boost/asio.hpp>
+#include <cstdlib>
 #include <iostream>
 
 namespace net = boost::asio;
 
 static const char delim{ '\n' };
 
+/// Header of the response to a request for an unavailable file, or to a
+/// request to store a file which failed
+static const char kMissing{ '-' };
+
+/// Response to a request to store a file which succeeded
+static const char kStored{ '+' };
+
 #define RETURN_ON_ERROR(error, val)       \
   if (error) {                            \
     std::cerr << error.message() << '\n'; \
@@ -42,45 +51,136 @@ class Host {
     boost::system::error_code error;
     tcp::resolver::query query{ host, service,
                                 net::ip::resolver_query_base::numeric_service };
-    const auto endpoints = resolver.resolve(query, error);
+    endpoints_ = resolver.resolve(query, error);
     RETURN_ON_ERROR(error, false);
 
-    net::connect(socket_, endpoints, error);
+    net::connect(socket_, endpoints_, error);
     RETURN_ON_ERROR(error, false);
 
     return true;
   }
 
   /// Gets the content of a file whose relative path matches a relative path on
-  /// a host
-  std::vector<unsigned char> GetFileContents(const std::string& path) {
+  /// a host.  Returns false if the host doesn't have the file.
+  bool GetFile(const std::string& path, std::string* contents) {
+    boost::system::error_code error;
+    bool found = GetFile(path, contents, &error);
+    if (error && Reconnect())
+      found = GetFile(path, contents, &error);
+    RETURN_ON_ERROR(error, false);
+    return found;
+  }
+
+  /// Stores a file on the host, under a relative path
+  bool PutFile(const std::string& path, const std::string& contents) {
+    boost::system::error_code error;
+    bool stored = PutFile(path, contents, &error);
+    if (error && Reconnect())
+      stored = PutFile(path, contents, &error);
+    RETURN_ON_ERROR(error, false);
+    return stored;
+  }
+
+ private:
+  /// The daemon closes connections left idle for a while.  Connect again
+  /// once a request finds that out, rather than giving up on the host.
+  bool Reconnect() {
+    if (endpoints_.empty())
+      return false;
+    boost::system::error_code error;
+    socket_.close(error);
+    net::connect(socket_, endpoints_, error);
+    RETURN_ON_ERROR(error, false);
+    return true;
+  }
+
+  /// GetFile(), filling in |error| quietly if the connection failed.
+  bool GetFile(const std::string& path, std::string* contents,
+               boost::system::error_code* error_out) {
     if (!socket_.is_open()) {
       // Can't do anything with a closed socket.
-      return {};
+      return false;
     }
 
-    boost::system::error_code error;
+    boost::system::error_code& error = *error_out;
 
     // Synchronously request a file's content.
-    net::write(socket_, net::buffer(path + delim, path.size() + 1), error);
-    RETURN_ON_ERROR(error, {});
+    const std::string request{ "GET " + path + delim };
+    net::write(socket_, net::buffer(request), error);
+    if (error)
+      return false;
 
     net::streambuf response;
-    // Synchronously wait for a response to our request.
-    // Even if the file isn't there on the host, we're guaranteed to have a
-    // response.
-    net::read_until(socket_, response, delim, error);
-    RETURN_ON_ERROR(error, {});
-
-    // Send back the content in a non-Boost data format
-    auto buf = net::buffer_cast<const unsigned char*>(response.data());
-    return std::vector<unsigned char>{ buf, buf + response.size() - 1 };
+    // Synchronously wait for the header of our response, i.e. the size of
+    // the file.  Even if the file isn't there on the host, we're guaranteed
+    // to have a header.
+    const size_t header_size =
+        net::read_until(socket_, response, delim, error);
+    if (error)
+      return false;
+
+    const char* header = net::buffer_cast<const char*>(response.data());
+    if (header[0] == kMissing) {
+      response.consume(header_size);
+      return false;
+    }
+    char* end = nullptr;
+    const size_t size = strtoull(header, &end, 10);
+    if (end != header + header_size - 1) {
+      std::cerr << "malformed response to request for " << path << "\n";
+      socket_.close(error);
+      return false;
+    }
+    response.consume(header_size);
+
+    // The file's contents may contain anything, delimiters included, so
+    // read exactly as much as announced.
+    if (response.size() < size) {
+      net::read(socket_, response,
+                net::transfer_exactly(size - response.size()), error);
+      if (error)
+      return false;
+    }
+
+    const char* data = net::buffer_cast<const char*>(response.data());
+    contents->assign(data, size);
+    return true;
+  }
+
+  /// PutFile(), filling in |error| quietly if the connection failed.
+  bool PutFile(const std::string& path, const std::string& contents,
+               boost::system::error_code* error_out) {
+    if (!socket_.is_open()) {
+      return false;
+    }
+
+    boost::system::error_code& error = *error_out;
+
+    // Synchronously send the file, header first.
+    const std::string request{ "PUT " + path + " " +
+                               std::to_string(contents.size()) + delim };
+    const std::array<net::const_buffer, 2> buffers{ net::buffer(request),
+                                                    net::buffer(contents) };
+    net::write(socket_, buffers, error);
+    if (error)
+      return false;
+
+    net::streambuf response;
+    const size_t response_size =
+        net::read_until(socket_, response, delim, error);
+    if (error)
+      return false;
+
+    const char* data = net::buffer_cast<const char*>(response.data());
+    return response_size == 2 && data[0] == kStored;
   }
 
- private:
   /// Context of the network messaging
   net::io_context io_context_;
 
+  /// Where the host was found, to connect to it again
+  tcp::resolver::results_type endpoints_;
+
   /// Socket used to communicate with the host
   tcp::socket socket_;
 };
@@ -95,23 +195,41 @@ void DCache::Init(const HostInfos& infos) {
       continue;  // Too bad
     }
     hosts_.push_back(std::move(host));
+    infos_.emplace_back(addr, service);
   }
 }
 
 std::vector<unsigned char> DCache::GetFileContents(
     const std::string& path) const {
+  std::string contents;
+  if (!GetFile(path, &contents)) {
+    return {};
+  }
+  return std::vector<unsigned char>{ contents.cbegin(), contents.cend() };
+}
+
+bool DCache::GetFile(const std::string& path, std::string* contents) const {
   // Ask around to see if anyone has this file
   for (const auto& host : hosts_) {
     if (host == nullptr) {
       continue;
     }
 
-    std::vector<unsigned char> fileContents{ host->GetFileContents(path) };
-    if (!fileContents.empty()) {
-      return fileContents;
+    if (host->GetFile(path, contents)) {
+      return true;
     }
   }
 
   // No one has the file
-  return {};
+  return false;
+}
+
+bool DCache::PutFile(const std::string& path,
+                     const std::string& contents) const {
+  for (const auto& host : hosts_) {
+    if (host != nullptr && host->PutFile(path, contents)) {
+      return true;
+    }
+  }
+  return false;
 }
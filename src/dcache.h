@@ -37,6 +37,21 @@ class DCache {
   /// the file is not available on any hosts.
   std::vector<unsigned char> GetFileContents(const std::string& path) const;
 
+  /// Fetches the contents of a given file from the cache.  Unlike
+  /// GetFileContents, tells a missing file apart from an empty one.
+  /// @return false if the file is not available on any hosts.
+  bool GetFile(const std::string& path, std::string* contents) const;
+
+  /// Stores a file in the cache, on the first host that accepts it.
+  /// @return false if no host could store the file.
+  bool PutFile(const std::string& path, const std::string& contents) const;
+
+  /// Is there any host to ask for files?
+  bool empty() const { return hosts_.empty(); }
+
+  /// Addresses of the hosts connected to, to connect to them again.
+  const HostInfos& hosts() const { return infos_; }
+
   /// No copies allowed
   DCache(const DCache&) = delete;
   DCache& operator=(const DCache&) = delete;
@@ -44,6 +59,9 @@ class DCache {
  private:
   /// Hosts making up the distributed cache
   std::vector<std::unique_ptr<Host>> hosts_;
+
+  /// Addresses of the hosts in hosts_
+  HostInfos infos_;
 };
 
 #endif  // NINJA_DCACHE_H_
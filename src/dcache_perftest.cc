@@ -0,0 +1,299 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Load generator for the distributed cache: starts an in-process Daemon on a
+// temporary root filled with synthetic objects and drives concurrent DCache
+// clients at it over loopback.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#include <sys/resource.h>
+#endif
+
+#include "daemon.h"
+#include "dcache.h"
+#include "disk_interface.h"
+#include "util.h"
+
+namespace {
+
+const char kTestRoot[] = "DCachePerfTest-root";
+
+/// Knobs of a benchmark run.
+struct Config {
+  unsigned short port{ 8083 };
+  int objects{ 1000 };
+  size_t min_size{ 1 << 10 };
+  size_t max_size{ 1 << 20 };
+  bool log_sizes{ true };
+  int clients{ 8 };
+  int requests{ 1000 };
+  unsigned seed{ 42 };
+};
+
+void Usage() {
+  printf(
+      "usage: dcache_perftest [options]\n"
+      "\n"
+      "options:\n"
+      "  -p PORT  port the in-process daemon listens on [default=8083]\n"
+      "  -n N     number of synthetic objects in the cache [default=1000]\n"
+      "  -s SIZE  smallest object size in bytes [default=1024]\n"
+      "  -S SIZE  largest object size in bytes [default=1048576]\n"
+      "  -D DIST  object size distribution, 'log' or 'uniform' "
+      "[default=log]\n"
+      "  -c N     number of concurrent client connections [default=8]\n"
+      "  -r N     number of requests issued by each client [default=1000]\n"
+      "  -x SEED  seed of the random generator [default=42]\n");
+}
+
+/// Returns the CPU time (user + system) consumed by this process so far,
+/// in microseconds.
+int64_t ProcessCpuMicros() {
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return 0;
+  return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+std::string ObjectName(int i) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "obj%d", i);
+  return buf;
+}
+
+/// Fills the test root with synthetic objects whose sizes follow the
+/// requested distribution.  Returns the size of every object.
+bool WriteObjects(const Config& config, RealDiskInterface* disk_interface,
+                  std::vector<size_t>* sizes) {
+  if (!disk_interface->MakeDir(kTestRoot))
+    return false;
+
+  std::mt19937 rng(config.seed);
+  std::uniform_real_distribution<double> log_dist(
+      std::log((double)config.min_size), std::log((double)config.max_size));
+  std::uniform_int_distribution<size_t> uniform_dist(config.min_size,
+                                                     config.max_size);
+
+  std::string pattern;
+  for (char c = 'a'; c <= 'z'; ++c)
+    pattern.push_back(c);
+  pattern.push_back('\n');
+
+  for (int i = 0; i < config.objects; ++i) {
+    size_t size = config.log_sizes ? (size_t)std::exp(log_dist(rng))
+                                   : uniform_dist(rng);
+    std::string contents;
+    contents.reserve(size);
+    while (contents.size() < size)
+      contents.append(pattern, 0,
+                      std::min(pattern.size(), size - contents.size()));
+    if (!disk_interface->WriteFile(std::string(kTestRoot) + "/" +
+                                       ObjectName(i),
+                                   contents))
+      return false;
+    sizes->push_back(size);
+  }
+  return true;
+}
+
+void RemoveObjects(const Config& config, RealDiskInterface* disk_interface) {
+  for (int i = 0; i < config.objects; ++i)
+    disk_interface->RemoveFile(std::string(kTestRoot) + "/" + ObjectName(i));
+  disk_interface->RemoveDir(kTestRoot);
+}
+
+/// Outcome of a single client's run.
+struct ClientResult {
+  std::vector<int64_t> latencies;  // In microseconds.
+  uint64_t bytes{ 0 };
+  int failures{ 0 };
+};
+
+void RunClient(const Config& config, const std::vector<size_t>& sizes,
+               int index, ClientResult* result) {
+  DCache cache;
+  cache.Init({ { "localhost", std::to_string(config.port) } });
+
+  std::mt19937 rng(config.seed + index + 1);
+  std::uniform_int_distribution<int> pick(0, config.objects - 1);
+
+  result->latencies.reserve(config.requests);
+  for (int i = 0; i < config.requests; ++i) {
+    int object = pick(rng);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<unsigned char> contents =
+        cache.GetFileContents(ObjectName(object));
+    auto end = std::chrono::steady_clock::now();
+
+    if (contents.size() != sizes[object]) {
+      ++result->failures;
+      continue;
+    }
+    result->bytes += contents.size();
+    result->latencies.push_back(
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+            .count());
+  }
+}
+
+int64_t Percentile(const std::vector<int64_t>& sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+bool ParseFlags(int argc, char** argv, Config* config) {
+  int opt;
+  while ((opt = getopt(argc, argv, "p:n:s:S:D:c:r:x:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      config->port = (unsigned short)atoi(optarg);
+      break;
+    case 'n':
+      config->objects = atoi(optarg);
+      break;
+    case 's':
+      config->min_size = strtoul(optarg, nullptr, 10);
+      break;
+    case 'S':
+      config->max_size = strtoul(optarg, nullptr, 10);
+      break;
+    case 'D':
+      if (std::string(optarg) == "log") {
+        config->log_sizes = true;
+      } else if (std::string(optarg) == "uniform") {
+        config->log_sizes = false;
+      } else {
+        Error("unknown size distribution '%s'", optarg);
+        return false;
+      }
+      break;
+    case 'c':
+      config->clients = atoi(optarg);
+      break;
+    case 'r':
+      config->requests = atoi(optarg);
+      break;
+    case 'x':
+      config->seed = (unsigned)strtoul(optarg, nullptr, 10);
+      break;
+    case 'h':
+    default:
+      Usage();
+      return false;
+    }
+  }
+
+  if (config->objects <= 0 || config->clients <= 0 || config->requests <= 0 ||
+      config->min_size == 0 || config->min_size > config->max_size) {
+    Usage();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Config config;
+  if (!ParseFlags(argc, argv, &config))
+    return 1;
+
+  RealDiskInterface disk_interface;
+  std::vector<size_t> sizes;
+  if (!WriteObjects(config, &disk_interface, &sizes)) {
+    fprintf(stderr, "Failed to write test objects\n");
+    RemoveObjects(config, &disk_interface);
+    return 1;
+  }
+
+  // The daemon listens as soon as it is constructed; only its event loop
+  // needs a thread of its own.
+  Daemon daemon(config.port, kTestRoot);
+  std::thread server_thread{ [&daemon]() {
+    const ErrorCode run_error = daemon.Run();
+    if (run_error)
+      fprintf(stderr, "daemon: %s\n", run_error.message().c_str());
+  } };
+
+  std::vector<ClientResult> results(config.clients);
+  std::vector<std::thread> clients;
+
+  const int64_t cpu_start = ProcessCpuMicros();
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < config.clients; ++i)
+    clients.emplace_back(RunClient, std::cref(config), std::cref(sizes), i,
+                         &results[i]);
+  for (auto& client : clients)
+    client.join();
+  const auto end = std::chrono::steady_clock::now();
+  const int64_t cpu_end = ProcessCpuMicros();
+
+  daemon.Stop();
+  server_thread.join();
+  RemoveObjects(config, &disk_interface);
+
+  std::vector<int64_t> latencies;
+  uint64_t bytes = 0;
+  int failures = 0;
+  for (const auto& result : results) {
+    latencies.insert(latencies.end(), result.latencies.begin(),
+                     result.latencies.end());
+    bytes += result.bytes;
+    failures += result.failures;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  const size_t completed = latencies.size();
+
+  printf("%d objects, %d clients x %d requests\n", config.objects,
+         config.clients, config.requests);
+  printf("completed %zu requests (%d failed) in %.3fs\n", completed, failures,
+         seconds);
+  if (completed == 0)
+    return 1;
+
+  printf("throughput %.1f req/s  %.1f MB/s\n", completed / seconds,
+         bytes / seconds / (1024 * 1024));
+  printf("latency p50 %" PRId64 "us  p99 %" PRId64 "us  max %" PRId64 "us\n",
+         Percentile(latencies, 0.50), Percentile(latencies, 0.99),
+         latencies.back());
+  // Both the daemon and the clients live in this process, so this accounts
+  // for the CPU spent on both ends of the connection.
+  printf("cpu %.1fus/req\n", (cpu_end - cpu_start) / (double)completed);
+
+  return failures ? 1 : 0;
+}
@@ -14,6 +14,7 @@
 
 #include "dcache.h"
 
+#include <chrono>
 #include <iostream>
 #include <thread>
 
@@ -48,10 +49,16 @@ struct TestFixture : public testing::Test {
       return;
     }
 
+    // The daemon starts listening as soon as it is constructed, so build it
+    // here to make sure it is ready before any client tries to connect.
+    DaemonConfig config;
+    config.port = 8082;
+    config.allow_put = true;
+    daemon_ = std::make_unique<Daemon>(config, test_dir_);
+
     // A server will block the thread it runs on until it's stopped.
     // Thus, we need a separate thread for it.
     server_thread_ = std::thread{ [this]() {
-      daemon_ = std::make_unique<Daemon>(8082, test_dir_);
       const ErrorCode run_error = daemon_->Run();
 
       if (run_error) {
@@ -65,14 +72,26 @@ struct TestFixture : public testing::Test {
     daemon_->Stop();
     server_thread_.join();
     disk_interface_.RemoveFile(GetTestFilePath());
+    for (const auto& name : extra_files_) {
+      disk_interface_.RemoveFile(test_dir_ + "/" + name);
+    }
     disk_interface_.RemoveDir(test_dir_);
   }
 
   const std::string& GetTestFileName() const { return test_file_; }
 
- private:
   std::string GetTestFilePath() const { return test_dir_ + "/" + test_file_; }
 
+  /// Adds a file to those served by the daemon
+  bool WriteTestFile(const std::string& name, const std::string& contents) {
+    extra_files_.push_back(name);
+    return disk_interface_.WriteFile(test_dir_ + "/" + name, contents);
+  }
+
+  /// Files written by the tests themselves
+  std::vector<std::string> extra_files_;
+
+ private:
   /// Daemon used for testing
   std::unique_ptr<Daemon> daemon_;
 
@@ -101,3 +120,186 @@ TEST_F(TestFixture, Example) {
   const std::string contents{ raw_contents.cbegin(), raw_contents.cend() };
   ASSERT_EQ(litany, contents);
 }
+
+/// A daemon serving from memory must still notice files changing on disk.
+TEST(DaemonTest, ConfiguredDaemonServesUpdatedFiles) {
+  const std::string dir{ "TEST_CONFIG_DIR" };
+  const std::string file{ dir + "/litany" };
+  RealDiskInterface disk_interface;
+  ASSERT_TRUE(disk_interface.MakeDir(dir));
+  ASSERT_TRUE(disk_interface.WriteFile(file, litany));
+
+  DaemonConfig config;
+  config.address = "127.0.0.1";
+  config.port = 0;
+  config.io_threads = 2;
+  config.worker_threads = 2;
+  config.cache_size = 1 << 20;
+  Daemon daemon{ config, dir };
+  std::thread server_thread{ [&daemon]() { daemon.Run(); } };
+
+  DCache cache;
+  cache.Init({ { "127.0.0.1", std::to_string(daemon.port()) } });
+
+  std::vector<unsigned char> raw_contents{ cache.GetFileContents("litany") };
+  EXPECT_EQ(litany, std::string(raw_contents.begin(), raw_contents.end()));
+
+  // Served from memory this time.
+  raw_contents = cache.GetFileContents("litany");
+  EXPECT_EQ(litany, std::string(raw_contents.begin(), raw_contents.end()));
+
+  const std::string shorter{ "I must not fear." };
+  ASSERT_TRUE(disk_interface.WriteFile(file, shorter));
+  raw_contents = cache.GetFileContents("litany");
+  EXPECT_EQ(shorter, std::string(raw_contents.begin(), raw_contents.end()));
+
+  daemon.Stop();
+  server_thread.join();
+  disk_interface.RemoveFile(file);
+  disk_interface.RemoveDir(dir);
+}
+
+/// Files may contain anything, including the protocol's delimiters, and an
+/// empty file isn't the same as a missing one.
+TEST_F(TestFixture, BinaryAndEmptyFiles) {
+  const HostInfos infos{ { "localhost", "8082" } };
+  DCache cache;
+  cache.Init(infos);
+
+  const std::string binary{ "line\n\0-\n12\n", 12 };
+  ASSERT_TRUE(WriteTestFile("binary", binary));
+  ASSERT_TRUE(WriteTestFile("empty", ""));
+
+  std::string contents;
+  ASSERT_TRUE(cache.GetFile("binary", &contents));
+  EXPECT_EQ(binary, contents);
+  ASSERT_TRUE(cache.GetFile("empty", &contents));
+  EXPECT_EQ("", contents);
+  EXPECT_FALSE(cache.GetFile("missing", &contents));
+
+  // The connection is still usable after all of that.
+  ASSERT_TRUE(cache.GetFile(GetTestFileName(), &contents));
+  EXPECT_EQ(litany, contents);
+}
+
+/// Files stored through the cache are served back as they were stored.
+TEST_F(TestFixture, PutFile) {
+  const HostInfos infos{ { "localhost", "8082" } };
+  DCache cache;
+  cache.Init(infos);
+
+  const std::string binary{ "+\n\0PUT x 1\n", 11 };
+  extra_files_.push_back("stored");
+  ASSERT_TRUE(cache.PutFile("stored", binary));
+  std::string contents;
+  ASSERT_TRUE(cache.GetFile("stored", &contents));
+  EXPECT_EQ(binary, contents);
+
+  // Nothing may be written outside of the daemon's root.
+  EXPECT_FALSE(cache.PutFile("../escaped", binary));
+  EXPECT_FALSE(cache.GetFile("../" + GetTestFilePath(), &contents));
+}
+
+/// Files are only stored when the daemon allows it, and up to a size.
+/// Refused files are skipped without breaking the connection.
+TEST(DaemonTest, RefusesPuts) {
+  const std::string dir{ "TEST_PUT_DIR" };
+  RealDiskInterface disk_interface;
+  ASSERT_TRUE(disk_interface.MakeDir(dir));
+  ASSERT_TRUE(disk_interface.WriteFile(dir + "/litany", litany));
+
+  DaemonConfig config;
+  config.address = "127.0.0.1";
+  config.port = 0;
+  config.max_object_size = 16;
+  std::string contents;
+  {
+    Daemon daemon{ config, dir };
+    std::thread server_thread{ [&daemon]() { daemon.Run(); } };
+    DCache cache;
+    cache.Init({ { "127.0.0.1", std::to_string(daemon.port()) } });
+
+    EXPECT_FALSE(cache.PutFile("small", "contents"));
+    EXPECT_TRUE(cache.GetFile("litany", &contents));
+    EXPECT_FALSE(cache.GetFile("small", &contents));
+
+    daemon.Stop();
+    server_thread.join();
+  }
+
+  config.allow_put = true;
+  {
+    Daemon daemon{ config, dir };
+    std::thread server_thread{ [&daemon]() { daemon.Run(); } };
+    DCache cache;
+    cache.Init({ { "127.0.0.1", std::to_string(daemon.port()) } });
+
+    // Large enough to take several reads to skip.
+    EXPECT_FALSE(cache.PutFile("large", std::string(1 << 20, 'x')));
+    EXPECT_FALSE(cache.GetFile("large", &contents));
+    EXPECT_TRUE(cache.PutFile("small", "contents"));
+    EXPECT_TRUE(cache.GetFile("small", &contents));
+    EXPECT_EQ("contents", contents);
+    EXPECT_TRUE(cache.GetFile("litany", &contents));
+    EXPECT_EQ(litany, contents);
+
+    daemon.Stop();
+    server_thread.join();
+  }
+
+  disk_interface.RemoveFile(dir + "/small");
+  disk_interface.RemoveFile(dir + "/litany");
+  disk_interface.RemoveDir(dir);
+}
+
+/// Clients can't hold on to a connection, or fill the daemon's memory with a
+/// request that never ends, but the cache can always connect again.
+TEST(DaemonTest, BoundsRequests) {
+  namespace net = boost::asio;
+  using tcp = net::ip::tcp;
+  const std::string dir{ "TEST_BOUND_DIR" };
+  RealDiskInterface disk_interface;
+  ASSERT_TRUE(disk_interface.MakeDir(dir));
+  ASSERT_TRUE(disk_interface.WriteFile(dir + "/litany", litany));
+
+  DaemonConfig config;
+  config.address = "127.0.0.1";
+  config.port = 0;
+  config.request_timeout = boost::posix_time::milliseconds(100);
+  Daemon daemon{ config, dir };
+  std::thread server_thread{ [&daemon]() { daemon.Run(); } };
+  const tcp::endpoint endpoint{ net::ip::make_address("127.0.0.1"),
+                                daemon.port() };
+
+  net::io_context io_context;
+  char byte;
+  ErrorCode error;
+
+  // Never sending anything.
+  tcp::socket idle{ io_context };
+  idle.connect(endpoint);
+  net::read(idle, net::buffer(&byte, 1), error);
+  EXPECT_EQ(net::error::eof, error);
+
+  // Sending a request line without an end.
+  tcp::socket endless{ io_context };
+  endless.connect(endpoint);
+  const std::string request{ "GET " + std::string(64 << 10, 'x') };
+  net::write(endless, net::buffer(request), error);
+  net::read(endless, net::buffer(&byte, 1), error);
+  EXPECT_TRUE(error);
+
+  DCache cache;
+  cache.Init({ { "127.0.0.1", std::to_string(daemon.port()) } });
+  std::string contents;
+  EXPECT_TRUE(cache.GetFile("litany", &contents));
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  contents.clear();
+  EXPECT_TRUE(cache.GetFile("litany", &contents));
+  EXPECT_EQ(litany, contents);
+
+  daemon.Stop();
+  server_thread.join();
+  disk_interface.RemoveFile(dir + "/litany");
+  disk_interface.RemoveDir(dir);
+}
@@ -0,0 +1,131 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+/// A disk on which every file exists, all of the same age, so that the
+/// whole graph is up to date.
+struct UpToDateDisk : public DiskInterface {
+  TimeStamp Stat(const std::string& /*path*/,
+                 std::string* /*err*/) const override {
+    return 1;
+  }
+  ContentHash Hash(const std::string& /*path*/,
+                   std::string* /*err*/) const override {
+    return ContentHash();
+  }
+  bool MakeDir(const std::string& /*path*/) override { return true; }
+  bool RemoveDir(const std::string& /*path*/) override { return true; }
+  bool WriteFile(const std::string& /*path*/,
+                 const std::string& /*contents*/) override {
+    return true;
+  }
+  bool ReplaceFile(const std::string& /*path*/,
+                   const std::string& /*contents*/,
+                   bool /*executable*/) override {
+    return true;
+  }
+  bool IsExecutable(const std::string& /*path*/) const override {
+    return false;
+  }
+  bool SetMtime(const std::string& /*path*/, TimeStamp /*mtime*/) override {
+    return true;
+  }
+  int RemoveFile(const std::string& /*path*/) override { return 1; }
+  Status ReadFile(const std::string& /*path*/, std::string* /*contents*/,
+                  std::string* err) const override {
+    *err = "No such file or directory";
+    return NotFound;
+  }
+};
+
+/// Builds a chain of |depth| generated files, each generated from the
+/// previous one and a source of its own.
+bool CreateGraph(State* state, DiskInterface* disk, int depth,
+                 std::string* err) {
+  std::string manifest =
+      "rule gen\n"
+      "  command = gen $in > $out\n"
+      "build gen/0: gen src/0\n";
+  char buf[80];
+  for (int i = 1; i <= depth; ++i) {
+    snprintf(buf, sizeof(buf), "build gen/%d: gen gen/%d src/%d\n", i, i - 1,
+             i);
+    manifest += buf;
+  }
+
+  ManifestParser parser(state, disk);
+  return parser.ParseTest(manifest, err);
+}
+
+int main(int argc, char** argv) {
+  int depth = 10000;
+  if (argc > 1)
+    depth = atoi(argv[1]);
+  if (depth <= 0) {
+    fprintf(stderr, "usage: depth_perftest [depth of the chain]\n");
+    return 1;
+  }
+
+  std::string err;
+  State state;
+  UpToDateDisk disk;
+  if (!CreateGraph(&state, &disk, depth, &err)) {
+    fprintf(stderr, "Failed to create graph: %s\n", err.c_str());
+    return 1;
+  }
+  Node* top = state.LookupNode("gen/" + std::to_string(depth));
+
+  std::vector<int> times;
+  const int kNumRepetitions = 5;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    state.Reset();
+    DependencyScan scan(&state, nullptr, nullptr, &disk, nullptr);
+
+    int64_t start = GetTimeMillis();
+    if (!scan.RecomputeDirty(top, &err)) {
+      fprintf(stderr, "Failed to scan: %s\n", err.c_str());
+      return 1;
+    }
+    int delta = (int)(GetTimeMillis() - start);
+    printf("%d levels scanned in %dms%s\n", depth, delta,
+           top->dirty() ? " (dirty)" : "");
+    times.push_back(delta);
+  }
+
+  int min = times[0];
+  int max = times[0];
+  float total = 0;
+  for (int time : times) {
+    total += time;
+    if (time < min)
+      min = time;
+    else if (time > max)
+      max = time;
+  }
+
+  printf("min %dms  max %dms  avg %.1fms\n", min, max, total / times.size());
+
+  return 0;
+}
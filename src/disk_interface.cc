@@ -18,11 +18,35 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#endif
 
 #include <algorithm>
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// io_uring can stat files since Linux 5.6.
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0) && !defined(USE_IO_URING)
+#define USE_IO_URING
+#endif
+#endif
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 #ifdef _WIN32
 #include <direct.h>  // _mkdir
@@ -31,12 +55,25 @@
 #include <sstream>
 #endif
 
-#include "hash.h"
+#include "hash_cache.h"
+#include "mapped_file.h"
 #include "metrics.h"
 #include "util.h"
 
 namespace {
 
+/// Hash |contents| into |hash|.  Returns false and fills in |err| if the
+/// file was truncated while hashed, as happens to a file being written.
+bool HashMappedFile(const MappedFile& contents, ContentHash* hash,
+                    std::string* err) {
+  if (contents.Read([hash](std::string_view data) {
+        *hash = HashContents(data.data(), data.size());
+      }))
+    return true;
+  *err = "truncated while being hashed";
+  return false;
+}
+
 std::string DirName(const std::string& path) {
 #ifdef _WIN32
   static const char kPathSeparators[] = "\\/";
@@ -105,7 +142,7 @@ bool IsWindows7OrLater() {
 }
 
 bool StatAllFilesInDir(const std::string& dir,
-                       std::map<std::string, TimeStamp>* stamps,
+                       std::unordered_map<std::string, TimeStamp>* stamps,
                        std::string* err) {
   // FindExInfoBasic is 30% faster than FindExInfoStandard.
   static bool can_use_basic_info = IsWindows7OrLater();
@@ -139,8 +176,293 @@ bool StatAllFilesInDir(const std::string& dir,
   FindClose(find_handle);
   return true;
 }
+#else
+TimeStamp TimeStampFromStat(const struct stat& st) {
+  // Some users (Flatpak) std::set mtime to 0, this should be harmless
+  // and avoids conflicting with our return value of 0 meaning
+  // that it doesn't exist.
+  if (st.st_mtime == 0)
+    return 1;
+#if defined(_AIX)
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
+#elif defined(__APPLE__)
+  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
+          st.st_mtimespec.tv_nsec);
+#elif defined(st_mtime)  // A macro, so we're likely on modern POSIX.
+  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
+#endif
+}
+
+TimeStamp StatSingleFile(const std::string& path, std::string* err) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return 0;
+    *err = "stat(" + path + "): " + strerror(errno);
+    return -1;
+  }
+  return TimeStampFromStat(st);
+}
+
+/// Read |dir| once, and stat its files relative to it, which spares the
+/// kernel from resolving the whole path of each.  Returns false if the
+/// directory can't be read, e.g. without the permission to list it.
+bool StatAllFilesInDir(const std::string& dir,
+                       std::unordered_map<std::string, TimeStamp>* stamps) {
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return errno == ENOENT || errno == ENOTDIR;
+  int fd = dirfd(d);
+  while (struct dirent* entry = readdir(d)) {
+    struct stat st;
+    if (fstatat(fd, entry->d_name, &st, 0) == 0)
+      stamps->emplace(entry->d_name, TimeStampFromStat(st));
+    else if (errno != ENOENT)
+      stamps->emplace(entry->d_name, -1);  // Left to StatSingleFile().
+  }
+  closedir(d);
+  return true;
+}
+
+/// How long after its last modification a file is hashed before its hash
+/// is remembered.  A file modified again within the granularity of the
+/// mtimes of its file system could otherwise keep the same size and mtime
+/// with different contents.
+const TimeStamp kHashCacheDelay = 2000000000LL;
+
+/// Hash the contents of |path|, unless |hash_cache| knows them already.
+ContentHash HashThroughCache(HashCache* hash_cache, const std::string& path,
+                             std::string* err) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    *err = strerror(errno);
+    return ContentHash();
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    *err = strerror(errno);
+    close(fd);
+    return ContentHash();
+  }
+
+  HashCache::FileId id{ (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+                        (int64_t)st.st_size, TimeStampFromStat(st) };
+  ContentHash hash = hash_cache->Lookup(id);
+  if (hash) {
+    close(fd);
+    return hash;
+  }
+
+  MappedFile contents;
+  int ret = contents.Open(fd, st, err);
+  close(fd);
+  if (ret < 0 || !HashMappedFile(contents, &hash, err))
+    return ContentHash();
+
+  // Files whose mtime is pinned, as TimeStampFromStat() reports with 1,
+  // can't be told apart over time.
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  TimeStamp now_stamp = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+  if (id.mtime > 1 && id.mtime < now_stamp - kHashCacheDelay)
+    hash_cache->Record(id, hash);
+  return hash;
+}
 #endif  // _WIN32
 
+#ifdef USE_IO_URING
+/// An io_uring instance through which to stat files, without a syscall for
+/// each.  The kernel runs the stats on its own threads.
+class StatRing {
+ public:
+  /// Number of stats in flight at once.
+  static const unsigned kEntries = 1024;
+
+  StatRing() {
+    io_uring_params params = {};
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, kEntries, &params));
+    if (fd_ < 0)
+      return;  // E.g. an older kernel, or forbidden by seccomp.
+    if (!SupportsStatx()) {
+      close(fd_);
+      fd_ = -1;
+      return;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(__u32);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    sq_ring_ = Map(sq_size, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap ? sq_ring_ : Map(cq_size, IORING_OFF_CQ_RING);
+    sqes_ = Map(params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+    if (!sq_ring_.addr || !cq_ring_.addr || !sqes_.addr) {
+      close(fd_);
+      fd_ = -1;
+      return;
+    }
+    sq_entries_ = params.sq_entries;
+
+    char* sq = static_cast<char*>(sq_ring_.addr);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ring_.addr);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+
+  ~StatRing() {
+    if (sqes_.addr)
+      munmap(sqes_.addr, sqes_.size);
+    if (cq_ring_.addr && cq_ring_.addr != sq_ring_.addr)
+      munmap(cq_ring_.addr, cq_ring_.size);
+    if (sq_ring_.addr)
+      munmap(sq_ring_.addr, sq_ring_.size);
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  bool ok() const { return fd_ >= 0; }
+
+  /// Stat all of |paths|, keeping the ring full until they are done.
+  /// Returns false if the ring failed, for them to be stat'ed some other
+  /// way.
+  bool StatAll(const std::vector<const std::string*>& paths,
+               TimeStamp* mtimes) {
+    std::vector<struct statx> buffers(sq_entries_);
+    std::vector<size_t> path_of_buffer(sq_entries_);
+    std::vector<unsigned> free_buffers;
+    for (unsigned i = 0; i < sq_entries_; ++i)
+      free_buffers.push_back(i);
+
+    size_t next = 0;
+    unsigned in_flight = 0;
+    unsigned unsubmitted = 0;
+    while (next < paths.size() || in_flight > 0) {
+      unsigned tail = *sq_tail_;
+      unsigned queued = 0;
+      for (; next < paths.size() && !free_buffers.empty(); ++next) {
+        unsigned buffer = free_buffers.back();
+        free_buffers.pop_back();
+        path_of_buffer[buffer] = next;
+        unsigned index = (tail + queued) & sq_mask_;
+        io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_.addr) + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uintptr_t>(paths[next]->c_str());
+        sqe->len = STATX_MTIME;
+        sqe->off = reinterpret_cast<uintptr_t>(&buffers[buffer]);
+        sqe->user_data = buffer;
+        sq_array_[index] = index;
+        ++queued;
+      }
+      __atomic_store_n(sq_tail_, tail + queued, __ATOMIC_RELEASE);
+      in_flight += queued;
+      unsubmitted += queued;
+
+      // At most as many stats as there are entries are in flight, and the
+      // completion queue is larger than that: it can't overflow.
+      long submitted = syscall(__NR_io_uring_enter, fd_, unsubmitted, 1,
+                               IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (submitted < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+          // The stats the kernel took still write to |buffers|.
+          WaitForCompletions(in_flight - unsubmitted);
+          return false;
+        }
+        submitted = 0;
+      }
+      unsubmitted -= static_cast<unsigned>(submitted);
+
+      unsigned head = *cq_head_;
+      unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != cq_tail; ++head) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        unsigned buffer = static_cast<unsigned>(cqe.user_data);
+        mtimes[path_of_buffer[buffer]] = TimeStampFromStatx(
+            cqe.res, buffers[buffer]);
+        free_buffers.push_back(buffer);
+        --in_flight;
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+    return true;
+  }
+
+ private:
+  /// Whether the kernel supports IORING_OP_STATX.  Kernels too old to be
+  /// probed don't support it either.
+  bool SupportsStatx() const {
+    const unsigned kOps = 256;
+    std::vector<uint64_t> buffer(
+        (sizeof(io_uring_probe) + kOps * sizeof(io_uring_probe_op) + 7) / 8);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                kOps) < 0)
+      return false;
+    return probe->last_op >= IORING_OP_STATX &&
+           IORING_OP_STATX < probe->ops_len &&
+           (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+  }
+
+  /// Wait for |count| stats to complete, without submitting any.  The
+  /// kernel runs them on its own threads, whether it's entered or not.
+  void WaitForCompletions(unsigned count) {
+    while (count > 0) {
+      unsigned head = *cq_head_;
+      unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      count -= std::min(count, cq_tail - head);
+      __atomic_store_n(cq_head_, cq_tail, __ATOMIC_RELEASE);
+      if (count > 0)
+        sched_yield();
+    }
+  }
+
+  struct Mapping {
+    void* addr{ nullptr };
+    size_t size{ 0 };
+  };
+
+  Mapping Map(size_t size, off_t offset) const {
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, offset);
+    if (addr == MAP_FAILED)
+      return Mapping();
+    return Mapping{ addr, size };
+  }
+
+  /// What Stat() returns for a stat that returned |res| and filled |st|.
+  static TimeStamp TimeStampFromStatx(int res, const struct statx& st) {
+    if (res < 0)
+      return res == -ENOENT || res == -ENOTDIR ? 0 : -1;
+    // See TimeStampFromStat().
+    if (st.stx_mtime.tv_sec == 0)
+      return 1;
+    return (int64_t)st.stx_mtime.tv_sec * 1000000000LL + st.stx_mtime.tv_nsec;
+  }
+
+  int fd_{ -1 };
+  Mapping sq_ring_;
+  Mapping cq_ring_;
+  Mapping sqes_;
+  unsigned sq_entries_{ 0 };
+  unsigned* sq_tail_{ nullptr };
+  unsigned sq_mask_{ 0 };
+  unsigned* sq_array_{ nullptr };
+  unsigned* cq_head_{ nullptr };
+  unsigned* cq_tail_{ nullptr };
+  unsigned cq_mask_{ 0 };
+  io_uring_cqe* cqes_{ nullptr };
+};
+#endif  // USE_IO_URING
+
 }  // namespace
 
 // DiskInterface ---------------------------------------------------------------
@@ -165,6 +487,41 @@ bool DiskInterface::MakeDirs(const std::string& path) {
   return MakeDir(dir);
 }
 
+// DirectoryMaker --------------------------------------------------------------
+
+bool DirectoryMaker::MakeDirs(const std::string& path) {
+  // Directories not known to exist yet, from the deepest one up.
+  std::vector<std::string> unknown;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::string dir = DirName(path);
+         !dir.empty() && known_dirs_.count(dir) == 0; dir = DirName(dir))
+      unknown.push_back(dir);
+  }
+  if (unknown.empty())
+    return true;
+
+  size_t missing = 0;
+  for (; missing < unknown.size(); ++missing) {
+    std::string err;
+    TimeStamp mtime = disk_interface_->Stat(unknown[missing], &err);
+    if (mtime < 0) {
+      Error("%s", err.c_str());
+      return false;
+    }
+    if (mtime > 0)
+      break;  // Exists already, and so do its parents.
+  }
+  while (missing > 0) {
+    if (!disk_interface_->MakeDir(unknown[--missing]))
+      return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  known_dirs_.insert(unknown.begin(), unknown.end());
+  return true;
+}
+
 // RealDiskInterface -----------------------------------------------------------
 
 TimeStamp RealDiskInterface::Stat(const std::string& path,
@@ -180,11 +537,18 @@ TimeStamp RealDiskInterface::Stat(const std::string& path,
     *err = err_stream.str();
     return -1;
   }
+#endif
   if (!use_cache_)
     return StatSingleFile(path, err);
+  if (!known_mtimes_.empty()) {
+    auto known = known_mtimes_.find(path);
+    if (known != known_mtimes_.end())
+      return known->second;
+  }
 
   std::string dir = DirName(path);
   std::string base(path.substr(dir.size() ? dir.size() + 1 : 0));
+#ifdef _WIN32
   if (base == "..") {
     // StatAllFilesInDir does not report any information for base = "..".
     base = ".";
@@ -193,50 +557,87 @@ TimeStamp RealDiskInterface::Stat(const std::string& path,
 
   std::transform(dir.begin(), dir.end(), dir.begin(), ::tolower);
   std::transform(base.begin(), base.end(), base.begin(), ::tolower);
+#else
+  // A directory's listing has no entry for "dir/", and no name too long to
+  // be in it has its error reported.
+  if (base.empty() || base.size() > NAME_MAX)
+    return StatSingleFile(path, err);
+#endif
 
+  std::unique_lock<std::mutex> lock(cache_mutex_);
   Cache::iterator ci = cache_.find(dir);
   if (ci == cache_.end()) {
-    ci = cache_.emplace(dir, DirCache()).first;
-    if (!StatAllFilesInDir(dir.empty() ? "." : dir, &ci->second, err)) {
-      cache_.erase(ci);
+    // Don't hold up the other threads while reading the directory.  If one
+    // of them reads it meanwhile, either listing will do.
+    lock.unlock();
+    DirCache stamps;
+#ifdef _WIN32
+    if (!StatAllFilesInDir(dir.empty() ? "." : dir, &stamps, err))
       return -1;
-    }
+#else
+    if (!StatAllFilesInDir(dir.empty() ? "." : dir, &stamps))
+      return StatSingleFile(path, err);
+#endif
+    lock.lock();
+    ci = cache_.emplace(dir, std::move(stamps)).first;
   }
   DirCache::iterator di = ci->second.find(base);
-  return di != ci->second.end() ? di->second : 0;
-#else
-  struct stat st;
-  if (stat(path.c_str(), &st) < 0) {
-    if (errno == ENOENT || errno == ENOTDIR)
-      return 0;
-    *err = "stat(" + path + "): " + strerror(errno);
-    return -1;
+  if (di == ci->second.end())
+    return 0;
+  TimeStamp mtime = di->second;
+  lock.unlock();
+  // A file that couldn't be stat'ed with the others has its error reported
+  // on its own.
+  return mtime != -1 ? mtime : StatSingleFile(path, err);
+}
+
+bool RealDiskInterface::StatMany(const std::vector<const std::string*>& paths,
+                                 TimeStamp* mtimes) const {
+  METRIC_RECORD("node stat batch");
+  // Only stat the paths whose mtime isn't known already.
+  std::vector<const std::string*> unknown_paths;
+  std::vector<size_t> unknown_indices;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    auto known = use_cache_ ? known_mtimes_.find(*paths[i])
+                            : known_mtimes_.end();
+    if (known != known_mtimes_.end()) {
+      mtimes[i] = known->second;
+    } else {
+      unknown_paths.push_back(paths[i]);
+      unknown_indices.push_back(i);
+    }
   }
-  // Some users (Flatpak) std::set mtime to 0, this should be harmless
-  // and avoids conflicting with our return value of 0 meaning
-  // that it doesn't exist.
-  if (st.st_mtime == 0)
-    return 1;
-#if defined(_AIX)
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
-#elif defined(__APPLE__)
-  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
-          st.st_mtimespec.tv_nsec);
-#elif defined(st_mtime)  // A macro, so we're likely on modern POSIX.
-  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
-#else
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
-#endif
+  if (unknown_paths.empty())
+    return true;
+
+  std::vector<TimeStamp> unknown_mtimes(unknown_paths.size());
+#ifdef USE_IO_URING
+  StatRing ring;
+  if (!ring.ok() || !ring.StatAll(unknown_paths, unknown_mtimes.data()))
 #endif
+  {
+    // Nothing is gained from stat'ing the other paths at once; leave them to
+    // the caller, unless that's all of them.
+    if (unknown_paths.size() == paths.size())
+      return false;
+    std::fill(unknown_mtimes.begin(), unknown_mtimes.end(), -1);
+  }
+  for (size_t i = 0; i < unknown_indices.size(); ++i)
+    mtimes[unknown_indices[i]] = unknown_mtimes[i];
+  return true;
 }
 
-uint64_t RealDiskInterface::Hash(const std::string& path,
-                                 std::string* err) const {
-  std::string contents;
-  if (ReadFile(path, &contents, err) != Status::Okay) {
-    return 0;
-  }
-  return MurmurHash64A(contents.data(), contents.size());
+ContentHash RealDiskInterface::Hash(const std::string& path,
+                                    std::string* err) const {
+#ifndef _WIN32
+  if (hash_cache_)
+    return HashThroughCache(hash_cache_, path, err);
+#endif
+  MappedFile contents;
+  ContentHash hash;
+  if (contents.Open(path, err) < 0 || !HashMappedFile(contents, &hash, err))
+    return ContentHash();
+  return hash;
 }
 
 bool RealDiskInterface::WriteFile(const std::string& path,
@@ -264,6 +665,98 @@ bool RealDiskInterface::WriteFile(const std::string& path,
   return true;
 }
 
+bool RealDiskInterface::ReplaceFile(const std::string& path,
+                                    const std::string& contents,
+                                    bool executable) {
+  const std::string temp_path = path + ".ninja_tmp";
+#ifdef _WIN32
+  (void)executable;
+  if (!WriteFile(temp_path, contents))
+    return false;
+  if (!MoveFileExA(temp_path.c_str(), path.c_str(),
+                   MOVEFILE_REPLACE_EXISTING)) {
+    Error("MoveFileEx(%s): %s", path.c_str(), GetLastErrorString().c_str());
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+#else
+  // Start from a new file, whose permissions are those asked for, rather
+  // than one left over by an interrupted write.
+  unlink(temp_path.c_str());
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                executable ? 0777 : 0666);
+  if (fd < 0) {
+    Error("open(%s): %s", temp_path.c_str(), strerror(errno));
+    return false;
+  }
+  for (size_t written = 0; written < contents.size();) {
+    ssize_t len =
+        write(fd, contents.data() + written, contents.size() - written);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      Error("write(%s): %s", temp_path.c_str(), strerror(errno));
+      close(fd);
+      unlink(temp_path.c_str());
+      return false;
+    }
+    written += len;
+  }
+  if (close(fd) < 0 || rename(temp_path.c_str(), path.c_str()) < 0) {
+    Error("ReplaceFile(%s): %s", path.c_str(), strerror(errno));
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+#endif
+}
+
+bool RealDiskInterface::IsExecutable(const std::string& path) const {
+#ifdef _WIN32
+  (void)path;
+  return false;
+#else
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 &&
+         (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+#endif
+}
+
+bool RealDiskInterface::SetMtime(const std::string& path, TimeStamp mtime) {
+#ifdef _WIN32
+  // The reverse of TimeStampFromFileTime().
+  uint64_t ticks = mtime + 12622770400LL * (1000000000LL / 100);
+  FILETIME filetime;
+  filetime.dwLowDateTime = (DWORD)ticks;
+  filetime.dwHighDateTime = (DWORD)(ticks >> 32);
+  HANDLE file = CreateFileA(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                FILE_SHARE_DELETE,
+                            nullptr, OPEN_EXISTING, 0, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    Error("CreateFile(%s): %s", path.c_str(), GetLastErrorString().c_str());
+    return false;
+  }
+  bool success = SetFileTime(file, nullptr, nullptr, &filetime);
+  if (!success)
+    Error("SetFileTime(%s): %s", path.c_str(), GetLastErrorString().c_str());
+  CloseHandle(file);
+  return success;
+#else
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;  // Leave the access time alone.
+  times[1].tv_sec = mtime / 1000000000;
+  times[1].tv_nsec = mtime % 1000000000;
+  if (utimensat(AT_FDCWD, path.c_str(), times, 0) < 0) {
+    Error("utimensat(%s): %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+#endif
+}
+
 bool RealDiskInterface::MakeDir(const std::string& path) {
   if (::MakeDir(path) < 0) {
     if (errno == EEXIST) {
@@ -311,9 +804,15 @@ int RealDiskInterface::RemoveFile(const std::string& path) {
 }
 
 void RealDiskInterface::AllowStatCache(bool allow) {
-#ifdef _WIN32
   use_cache_ = allow;
-  if (!use_cache_)
+  if (!use_cache_) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
     cache_.clear();
-#endif
+    known_mtimes_.clear();
+  }
+}
+
+void RealDiskInterface::SetKnownMtimes(
+    std::unordered_map<std::string, TimeStamp> mtimes) {
+  known_mtimes_ = std::move(mtimes);
 }
@@ -17,11 +17,17 @@
 
 #include <bits/stdint-uintn.h>
 
-#include <map>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "content_hash.h"
 #include "timestamp.h"
 
+struct HashCache;
+
 /// Interface for reading files from disk.  See DiskInterface for details.
 /// This base offers the minimum interface needed just to read files.
 struct FileReader {
@@ -45,8 +51,20 @@ struct DiskInterface : public FileReader {
   /// other errors.
   virtual TimeStamp Stat(const std::string& path, std::string* err) const = 0;
 
-  /// Hash the contents of a file. Returns 0 in case an error happens.
-  virtual uint64_t Hash(const std::string& path, std::string* err) const = 0;
+  /// stat() at once those of |paths| for which that is faster than one path
+  /// at a time, storing in |mtimes| what Stat() would return for each, but
+  /// without describing errors.  Paths left out, like those that can't be
+  /// stat'ed, get -1: Stat() them to know more.  Returns false, having stored
+  /// nothing, when none of them is faster to stat this way.
+  virtual bool StatMany(const std::vector<const std::string*>& /*paths*/,
+                        TimeStamp* /*mtimes*/) const {
+    return false;
+  }
+
+  /// Hash the contents of a file. Returns no digest in case an error
+  /// happens.
+  virtual ContentHash Hash(const std::string& path,
+                           std::string* err) const = 0;
 
   /// Create a directory, returning false on failure.
   virtual bool MakeDir(const std::string& path) = 0;
@@ -59,6 +77,21 @@ struct DiskInterface : public FileReader {
   virtual bool WriteFile(const std::string& path,
                          const std::string& contents) = 0;
 
+  /// Replace a file with one holding |contents|, with the permission to be
+  /// executed if |executable|.  The contents go to a temporary file renamed
+  /// over |path|, so that an interrupted write never leaves part of them.
+  /// Returns false on failure.
+  virtual bool ReplaceFile(const std::string& path,
+                           const std::string& contents, bool executable) = 0;
+
+  /// Whether a file has the permission to be executed.  Returns false if it
+  /// can't be stat'ed.
+  virtual bool IsExecutable(const std::string& path) const = 0;
+
+  /// Set the modification time of an existing file, as Stat() returns it.
+  /// Returns false on failure.
+  virtual bool SetMtime(const std::string& path, TimeStamp mtime) = 0;
+
   /// Remove the file named @a path. It behaves like 'rm -f path' so no errors
   /// are reported if it does not exists.
   /// @returns 0 if the file has been removed,
@@ -71,39 +104,73 @@ struct DiskInterface : public FileReader {
   bool MakeDirs(const std::string& path);
 };
 
+/// Creates directories like DiskInterface::MakeDirs, but remembers those
+/// known to exist so that they are never stat'ed again.  May be used from
+/// several threads if the DiskInterface may.
+struct DirectoryMaker {
+  explicit DirectoryMaker(DiskInterface* disk_interface)
+      : disk_interface_(disk_interface) {}
+
+  /// Create all the parent directories for path; like mkdir -p
+  /// `basename path`.
+  bool MakeDirs(const std::string& path);
+
+ private:
+  DiskInterface* disk_interface_;
+  std::mutex mutex_;
+  std::unordered_set<std::string> known_dirs_;
+};
+
 /// Implementation of DiskInterface that actually hits the disk.
 struct RealDiskInterface : public DiskInterface {
-  RealDiskInterface()
-#ifdef _WIN32
-      : use_cache_(false)
-#endif
-  {
-  }
+  RealDiskInterface() = default;
 
   ~RealDiskInterface() override = default;
   TimeStamp Stat(const std::string& path, std::string* err) const override;
-  uint64_t Hash(const std::string& path, std::string* err) const override;
+  /// Submits the stats in batches through io_uring on Linux 5.6 and later.
+  bool StatMany(const std::vector<const std::string*>& paths,
+                TimeStamp* mtimes) const override;
+  ContentHash Hash(const std::string& path, std::string* err) const override;
   bool MakeDir(const std::string& path) override;
   bool RemoveDir(const std::string& path) override;
   bool WriteFile(const std::string& path, const std::string& contents) override;
+  bool ReplaceFile(const std::string& path, const std::string& contents,
+                   bool executable) override;
+  bool IsExecutable(const std::string& path) const override;
+  bool SetMtime(const std::string& path, TimeStamp mtime) override;
   Status ReadFile(const std::string& path, std::string* contents,
                   std::string* err) const override;
   int RemoveFile(const std::string& path) override;
 
-  /// Whether stat information can be cached.  Only has an effect on Windows.
+  /// Whether stat information can be cached.  When it can, the first Stat()
+  /// of a file in a directory stats all the files in it, and the others are
+  /// answered from the cache.  Stat() may still be used from several
+  /// threads.
   void AllowStatCache(bool allow);
 
+  /// While stat information can be cached, answer Stat() for the paths of
+  /// |mtimes| with their mtime, e.g. as known by a Watcher.
+  void SetKnownMtimes(std::unordered_map<std::string, TimeStamp> mtimes);
+
+  /// Look up the hashes of files in |hash_cache| before reading them, and
+  /// remember those of the files read there.  Files are only known by their
+  /// identity on POSIX systems; elsewhere, Hash() always reads them.
+  void SetHashCache(HashCache* hash_cache) { hash_cache_ = hash_cache; }
+
  private:
-#ifdef _WIN32
   /// Whether stat information can be cached.
-  bool use_cache_;
+  bool use_cache_{ false };
 
-  using DirCache = std::map<std::string, TimeStamp>;
-  // TODO: Neither a std::map nor a hashstd::map seems ideal here.  If the
-  // statcache works out, come up with a better data structure.
-  using Cache = std::map<std::string, DirCache>;
+  /// Mtimes of the files in a directory, by name.
+  using DirCache = std::unordered_map<std::string, TimeStamp>;
+  using Cache = std::unordered_map<std::string, DirCache>;
   mutable Cache cache_;
-#endif
+  mutable std::mutex cache_mutex_;
+
+  /// Only read while the cache is allowed, so not guarded by cache_mutex_.
+  std::unordered_map<std::string, TimeStamp> known_mtimes_;
+
+  HashCache* hash_cache_{ nullptr };
 };
 
 #endif  // NINJA_DISK_INTERFACE_H_
@@ -23,6 +23,7 @@
 
 #include "disk_interface.h"
 #include "graph.h"
+#include "hash_cache.h"
 #include "test.h"
 
 namespace {
@@ -167,6 +168,69 @@ TEST_F(DiskInterfaceTest, StatCache) {
 }
 #endif
 
+#ifndef _WIN32
+TEST_F(DiskInterfaceTest, StatCache) {
+  std::string err;
+
+  ASSERT_TRUE(Touch("file1"));
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(disk_.MakeDir("subdir/subsubdir"));
+  ASSERT_TRUE(Touch("subdir/subfile1"));
+
+  disk_.AllowStatCache(false);
+  TimeStamp file1_uncached = disk_.Stat("file1", &err);
+  TimeStamp parent_uncached = disk_.Stat("..", &err);
+  disk_.AllowStatCache(true);
+
+  EXPECT_EQ(file1_uncached, disk_.Stat("file1", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(parent_uncached, disk_.Stat("..", &err));
+  EXPECT_EQ("", err);
+  EXPECT_GT(disk_.Stat("subdir/subfile1", &err), 1);
+  EXPECT_EQ("", err);
+  EXPECT_EQ(disk_.Stat("subdir", &err), disk_.Stat("subdir/.", &err));
+  EXPECT_EQ(disk_.Stat("subdir", &err),
+            disk_.Stat("subdir/subsubdir/..", &err));
+  EXPECT_EQ(disk_.Stat("subdir", &err), disk_.Stat("subdir/", &err));
+  EXPECT_EQ("", err);
+
+  // Files made after their directory was read aren't seen until the cache
+  // is dropped.
+  ASSERT_TRUE(Touch("subdir/subfile2"));
+  EXPECT_EQ(0, disk_.Stat("subdir/subfile2", &err));
+  disk_.AllowStatCache(false);
+  disk_.AllowStatCache(true);
+  EXPECT_GT(disk_.Stat("subdir/subfile2", &err), 1);
+  EXPECT_EQ("", err);
+
+  EXPECT_EQ(0, disk_.Stat("nosuchfile", &err));
+  EXPECT_EQ(0, disk_.Stat("nosuchdir/nosuchfile", &err));
+  EXPECT_EQ(0, disk_.Stat("file1/nosuchfile", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(-1, disk_.Stat(std::string(512, 'x'), &err));
+  EXPECT_NE("", err);
+}
+#endif
+
+TEST_F(DiskInterfaceTest, StatMany) {
+  ASSERT_TRUE(Touch("file"));
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  const std::string long_name(512, 'x');
+  const std::string paths[] = { "file", "subdir", "subdir/..", "nosuchfile",
+                                "file/nosuchfile", long_name };
+  std::vector<const std::string*> path_ptrs;
+  for (const std::string& path : paths)
+    path_ptrs.push_back(&path);
+
+  std::vector<TimeStamp> mtimes(path_ptrs.size());
+  if (!disk_.StatMany(path_ptrs, mtimes.data()))
+    return;  // Not supported here.
+  for (size_t i = 0; i < path_ptrs.size(); ++i) {
+    std::string err;
+    EXPECT_EQ(disk_.Stat(paths[i], &err), mtimes[i]);
+  }
+}
+
 TEST_F(DiskInterfaceTest, ReadFile) {
   std::string err;
   std::string content;
@@ -187,6 +251,57 @@ TEST_F(DiskInterfaceTest, ReadFile) {
   EXPECT_EQ("", err);
 }
 
+#ifndef _WIN32
+TEST_F(DiskInterfaceTest, HashCache) {
+  HashCache hash_cache;
+  disk_.SetHashCache(&hash_cache);
+  std::string err;
+
+  // Only the hashes of files which weren't just modified are remembered.
+  const TimeStamp kLongAgo = 1000000000LL * 1000000000LL;
+  ASSERT_TRUE(disk_.WriteFile("old", "contents"));
+  ASSERT_TRUE(disk_.SetMtime("old", kLongAgo));
+  ASSERT_TRUE(disk_.WriteFile("new", "contents"));
+  ContentHash hash = disk_.Hash("old", &err);
+  EXPECT_TRUE(hash);
+  EXPECT_EQ(hash, disk_.Hash("new", &err));
+  EXPECT_EQ(1u, hash_cache.size());
+
+  // A file which kept its size and mtime isn't read again...
+  ASSERT_TRUE(disk_.WriteFile("old", "CONTENTS"));
+  ASSERT_TRUE(disk_.SetMtime("old", kLongAgo));
+  EXPECT_EQ(hash, disk_.Hash("old", &err));
+  ASSERT_TRUE(disk_.WriteFile("new", "CONTENTS"));
+  EXPECT_NE(hash, disk_.Hash("new", &err));
+
+  // ...but one whose mtime changed is.
+  ASSERT_TRUE(disk_.SetMtime("old", kLongAgo + 1));
+  EXPECT_EQ(disk_.Hash("new", &err), disk_.Hash("old", &err));
+
+  EXPECT_FALSE(disk_.Hash("nosuchfile", &err));
+  EXPECT_NE("", err);
+}
+#endif
+
+TEST_F(DiskInterfaceTest, ReplaceFile) {
+  std::string err;
+  ASSERT_TRUE(disk_.WriteFile("file", "old contents"));
+  EXPECT_TRUE(disk_.ReplaceFile("file", "new", false));
+  std::string contents;
+  EXPECT_EQ(DiskInterface::Okay, disk_.ReadFile("file", &contents, &err));
+  EXPECT_EQ("new", contents);
+  EXPECT_FALSE(disk_.IsExecutable("file"));
+  EXPECT_EQ(0, disk_.Stat("file.ninja_tmp", &err));
+
+#ifndef _WIN32
+  EXPECT_TRUE(disk_.ReplaceFile("file", "#!/bin/sh\n", true));
+  EXPECT_TRUE(disk_.IsExecutable("file"));
+  EXPECT_TRUE(disk_.ReplaceFile("file", "data", false));
+  EXPECT_FALSE(disk_.IsExecutable("file"));
+#endif
+  EXPECT_FALSE(disk_.IsExecutable("nosuchfile"));
+}
+
 TEST_F(DiskInterfaceTest, MakeDirs) {
   std::string path = "path/with/double//slash/";
   EXPECT_TRUE(disk_.MakeDirs(path.c_str()));
@@ -227,15 +342,29 @@ struct StatTest : public StateTestWithBuiltinRules, public DiskInterface {
 
   // DiskInterface implementation.
   TimeStamp Stat(const std::string& path, std::string* err) const override;
-  uint64_t Hash(const std::string& path, std::string* err) const override {
+  ContentHash Hash(const std::string& path, std::string* err) const override {
     assert(false);
-    return 0;
+    return ContentHash();
   }
   bool WriteFile(const std::string& /*path*/,
                  const std::string& /*contents*/) override {
     assert(false);
     return true;
   }
+  bool ReplaceFile(const std::string& /*path*/,
+                   const std::string& /*contents*/,
+                   bool /*executable*/) override {
+    assert(false);
+    return true;
+  }
+  bool IsExecutable(const std::string& /*path*/) const override {
+    assert(false);
+    return false;
+  }
+  bool SetMtime(const std::string& /*path*/, TimeStamp /*mtime*/) override {
+    assert(false);
+    return false;
+  }
   bool MakeDir(const std::string& /*path*/) override {
     assert(false);
     return false;
@@ -0,0 +1,178 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "build.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+/// A disk holding the sources and the dyndep files of the build, as they
+/// are once scanned.  Nothing else exists.
+struct MemoryDisk : public DiskInterface {
+  TimeStamp Stat(const std::string& path, std::string* /*err*/) const override {
+    auto i = files_.find(path);
+    return i == files_.end() ? 0 : i->second.mtime;
+  }
+  ContentHash Hash(const std::string& /*path*/,
+                   std::string* /*err*/) const override {
+    return ContentHash();
+  }
+  bool MakeDir(const std::string& /*path*/) override { return true; }
+  bool RemoveDir(const std::string& /*path*/) override { return true; }
+  bool WriteFile(const std::string& path,
+                 const std::string& contents) override {
+    files_[path] = File{ contents, 1 };
+    return true;
+  }
+  bool ReplaceFile(const std::string& path, const std::string& contents,
+                   bool /*executable*/) override {
+    return WriteFile(path, contents);
+  }
+  bool IsExecutable(const std::string& /*path*/) const override {
+    return false;
+  }
+  bool SetMtime(const std::string& path, TimeStamp mtime) override {
+    files_[path].mtime = mtime;
+    return true;
+  }
+  int RemoveFile(const std::string& /*path*/) override { return 1; }
+  Status ReadFile(const std::string& path, std::string* contents,
+                  std::string* err) const override {
+    auto i = files_.find(path);
+    if (i == files_.end()) {
+      *err = "No such file or directory";
+      return NotFound;
+    }
+    *contents = i->second.contents;
+    return Okay;
+  }
+
+  struct File {
+    std::string contents;
+    TimeStamp mtime;
+  };
+  std::map<std::string, File> files_;
+};
+
+/// Builds a graph shaped like a project of Fortran modules: |num_units|
+/// sources, each scanned into a dyndep file telling the module its object
+/// provides, all linked into one program.  The dyndep files are out of date
+/// and loaded one by one during the build.
+bool CreateGraph(State* state, MemoryDisk* disk, int num_units,
+                 std::string* err) {
+  std::string manifest =
+      "rule scan\n"
+      "  command = scan $in > $out\n"
+      "rule fc\n"
+      "  command = fc -c $in -o $out\n"
+      "rule link\n"
+      "  command = link $in -o $out\n";
+  std::string link = "build app: link";
+  char buf[160];
+  for (int i = 0; i < num_units; ++i) {
+    snprintf(buf, sizeof(buf),
+             "build obj/%d.dd: scan src/%d.f90\n"
+             "build obj/%d.o: fc src/%d.f90 || obj/%d.dd\n"
+             "  dyndep = obj/%d.dd\n",
+             i, i, i, i, i, i);
+    manifest += buf;
+    snprintf(buf, sizeof(buf), " obj/%d.o", i);
+    link += buf;
+
+    snprintf(buf, sizeof(buf),
+             "ninja_dyndep_version = 1\n"
+             "build obj/%d.o | mod/%d.mod: dyndep | src/modules.inc\n",
+             i, i);
+    disk->WriteFile("obj/" + std::to_string(i) + ".dd", buf);
+    disk->WriteFile("src/" + std::to_string(i) + ".f90", "");
+    disk->SetMtime("src/" + std::to_string(i) + ".f90", 2);
+  }
+  manifest += link + "\n";
+  disk->WriteFile("src/modules.inc", "");
+
+  ManifestParser parser(state, disk);
+  return parser.ParseTest(manifest, err);
+}
+
+/// Plans and "runs" a dry-run build of the program.  Returns the number of
+/// commands of the plan, or -1 on error.
+int RunBuild(State* state, MemoryDisk* disk, std::string* err) {
+  BuildConfig config;
+  config.verbosity = BuildConfig::QUIET;
+  config.dry_run = true;
+  config.parallelism = 1000;
+
+  Builder builder(state, config, nullptr, nullptr, disk);
+  if (!builder.AddTarget("app", err))
+    return -1;
+  if (!builder.Build(err))
+    return -1;
+  return builder.plan_.command_edge_count();
+}
+
+int main(int argc, char** argv) {
+  int num_units = 20000;
+  if (argc > 1)
+    num_units = atoi(argv[1]);
+  if (num_units <= 0) {
+    fprintf(stderr, "usage: dyndep_perftest [number of units]\n");
+    return 1;
+  }
+
+  std::vector<int> times;
+  const int kNumRepetitions = 5;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    // Loading the dyndep files changes the graph: start from a fresh one.
+    std::string err;
+    State state;
+    MemoryDisk disk;
+    if (!CreateGraph(&state, &disk, num_units, &err)) {
+      fprintf(stderr, "Failed to create graph: %s\n", err.c_str());
+      return 1;
+    }
+
+    int64_t start = GetTimeMillis();
+    int commands = RunBuild(&state, &disk, &err);
+    if (commands < 0) {
+      fprintf(stderr, "Failed to build: %s\n", err.c_str());
+      return 1;
+    }
+    int delta = (int)(GetTimeMillis() - start);
+    printf("%d commands planned and run in %dms\n", commands, delta);
+    times.push_back(delta);
+  }
+
+  int min = times[0];
+  int max = times[0];
+  float total = 0;
+  for (int time : times) {
+    total += time;
+    if (time < min)
+      min = time;
+    else if (time > max)
+      max = time;
+  }
+
+  printf("min %dms  max %dms  avg %.1fms\n", min, max, total / times.size());
+
+  return 0;
+}
@@ -18,6 +18,7 @@
 #include <cassert>
 #include <cstddef>
 #include <cstdio>
+#include <unordered_set>
 
 #include "build_log.h"
 #include "debug_flags.h"
@@ -33,142 +34,233 @@ bool Node::Stat(DiskInterface* disk_interface, std::string* err) {
   return (mtime_ = disk_interface->Stat(path_, err)) != -1;
 }
 
+namespace {
+
+/// The visit of an edge by DependencyScan::RecomputeDirty(): first of its
+/// pending dyndep file, then of each of its inputs in turn.
+struct EdgeVisit {
+  explicit EdgeVisit(Edge* edge) : edge(edge) {}
+
+  enum Step { kDyndep, kDeps, kInputs };
+
+  Edge* edge;
+  Step step{ kDyndep };
+  /// Whether the dyndep file of the edge was pending.
+  bool load_dyndep{ false };
+  /// The input being visited, and whether its own visit was started.
+  size_t input{ 0 };
+  bool input_started{ false };
+  bool dirty{ false };
+  Node* most_recent_input{ nullptr };
+};
+
+}  // namespace
+
 bool DependencyScan::RecomputeDirty(Node* node, std::string* err) {
+  // Walk the graph depth-first with an explicit stack of edge visits rather
+  // than by recursion, which long chains of edges would exhaust.  |stack|
+  // holds the node through which each edge on it was reached, to report
+  // cycles.
+  std::vector<EdgeVisit> visits;
   std::vector<Node*> stack;
-  return RecomputeDirty(node, &stack, err);
-}
 
-bool DependencyScan::RecomputeDirty(Node* node, std::vector<Node*>* stack,
-                                    std::string* err) {
-  Edge* edge = node->in_edge();
-  if (!edge) {
-    // If we already visited this leaf node then we are done.
-    if (node->status_known())
+  // Settle |n| at once if it is a leaf or if its in-edge was visited
+  // already, or else start visiting its in-edge.
+  auto start_visit = [&](Node* n) {
+    Edge* edge = n->in_edge();
+    if (!edge) {
+      // If we already visited this leaf node then we are done.
+      if (n->status_known())
+        return true;
+      // This node has no in-edge; it is dirty if it is missing.
+      if (!n->StatIfNecessary(disk_interface_, err))
+        return false;
+      if (!n->exists())
+        EXPLAIN("%s has no in-edge and is missing", n->path().c_str());
+      n->set_dirty(!n->exists());
+      return true;
+    }
+
+    // If we already finished this edge then we are done.
+    if (edge->mark_ == Edge::VisitDone)
       return true;
-    // This node has no in-edge; it is dirty if it is missing.
-    if (!node->StatIfNecessary(disk_interface_, err))
+
+    // If we encountered this edge earlier in the stack we have a cycle.
+    if (!VerifyDAG(n, &stack, err))
       return false;
-    if (!node->exists())
-      EXPLAIN("%s has no in-edge and is missing", node->path().c_str());
-    node->set_dirty(!node->exists());
-    return true;
-  }
 
-  // If we already finished this edge then we are done.
-  if (edge->mark_ == Edge::VisitDone)
+    // Mark the edge temporarily while in the stack.
+    edge->mark_ = Edge::VisitInStack;
+    stack.push_back(n);
+    visits.emplace_back(edge);
+
+    edge->outputs_ready_ = true;
+    edge->deps_missing_ = false;
     return true;
+  };
 
-  // If we encountered this edge earlier in the call stack we have a cycle.
-  if (!VerifyDAG(node, stack, err))
+  if (!start_visit(node))
     return false;
 
-  // Mark the edge temporarily while in the call stack.
-  edge->mark_ = Edge::VisitInStack;
-  stack->push_back(node);
-
-  bool dirty = false;
-  edge->outputs_ready_ = true;
-  edge->deps_missing_ = false;
-
-  if (!edge->deps_loaded_) {
-    // This is our first encounter with this edge.
-    // If there is a pending dyndep file, visit it now:
-    // * If the dyndep file is ready then load it now to get any
-    //   additional inputs and outputs for this and other edges.
-    //   Once the dyndep file is loaded it will no longer be pending
-    //   if any other edges encounter it, but they will already have
-    //   been updated.
-    // * If the dyndep file is not ready then since is known to be an
-    //   input to this edge, the edge will not be considered ready below.
-    //   Later during the build the dyndep file will become ready and be
-    //   loaded to update this edge before it can possibly be scheduled.
-    if (edge->dyndep_ && edge->dyndep_->dyndep_pending()) {
-      if (!RecomputeDirty(edge->dyndep_, stack, err))
-        return false;
+  // Each pass resumes the visit on top of the stack, which may start the
+  // visit of another edge, and does so before the reference is used again.
+  while (!visits.empty()) {
+    EdgeVisit& visit = visits.back();
+    Edge* edge = visit.edge;
+
+    if (visit.step == EdgeVisit::kDyndep) {
+      visit.step = EdgeVisit::kDeps;
+      // If this is our first encounter with this edge and there is a
+      // pending dyndep file, visit it now:
+      // * If the dyndep file is ready then load it now to get any
+      //   additional inputs and outputs for this and other edges.
+      //   Once the dyndep file is loaded it will no longer be pending
+      //   if any other edges encounter it, but they will already have
+      //   been updated.
+      // * If the dyndep file is not ready then since is known to be an
+      //   input to this edge, the edge will not be considered ready below.
+      //   Later during the build the dyndep file will become ready and be
+      //   loaded to update this edge before it can possibly be scheduled.
+      if (!edge->deps_loaded_ && edge->dyndep_ &&
+          edge->dyndep_->dyndep_pending()) {
+        visit.load_dyndep = true;
+        if (!start_visit(edge->dyndep_))
+          return false;
+      }
+      continue;
+    }
 
-      if (!edge->dyndep_->in_edge() ||
-          edge->dyndep_->in_edge()->outputs_ready()) {
+    if (visit.step == EdgeVisit::kDeps) {
+      visit.step = EdgeVisit::kInputs;
+      if (visit.load_dyndep && (!edge->dyndep_->in_edge() ||
+                                edge->dyndep_->in_edge()->outputs_ready())) {
         // The dyndep file is ready, so load it now.
         if (!LoadDyndeps(edge->dyndep_, err))
           return false;
       }
-    }
-  }
 
-  // Load output mtimes so we can compare them to the most recent input below.
-  for (auto& output : edge->outputs_) {
-    if (!output->StatIfNecessary(disk_interface_, err))
-      return false;
-  }
+      // Load output mtimes so we can compare them to the most recent input
+      // below.
+      for (auto& output : edge->outputs_) {
+        if (!output->StatIfNecessary(disk_interface_, err))
+          return false;
+      }
 
-  if (!edge->deps_loaded_) {
-    // This is our first encounter with this edge.  Load discovered deps.
-    edge->deps_loaded_ = true;
-    if (!dep_loader_.LoadDeps(edge, err)) {
-      if (!err->empty())
-        return false;
-      // Failed to load dependency info: rebuild to regenerate it.
-      // LoadDeps() did EXPLAIN() already, no need to do it here.
-      dirty = edge->deps_missing_ = true;
+      if (!edge->deps_loaded_) {
+        // This is our first encounter with this edge.  Load discovered deps.
+        edge->deps_loaded_ = true;
+        if (!dep_loader_.LoadDeps(edge, err)) {
+          if (!err->empty())
+            return false;
+          // Failed to load dependency info: rebuild to regenerate it.
+          // LoadDeps() did EXPLAIN() already, no need to do it here.
+          visit.dirty = edge->deps_missing_ = true;
+        }
+      }
     }
-  }
 
-  // Visit all inputs; we're dirty if any of the inputs are dirty.
-  Node* most_recent_input = nullptr;
-  for (auto i = edge->inputs_.begin(); i != edge->inputs_.end(); ++i) {
-    // Visit this input.
-    if (!RecomputeDirty(*i, stack, err))
-      return false;
+    // Visit all inputs; we're dirty if any of the inputs are dirty.
+    if (visit.input < edge->inputs_.size()) {
+      Node* input = edge->inputs_[visit.input];
+      if (!visit.input_started) {
+        visit.input_started = true;
+        if (!start_visit(input))
+          return false;
+        continue;
+      }
+      visit.input_started = false;
 
-    // If an input is not ready, neither are our outputs.
-    if (Edge* in_edge = (*i)->in_edge()) {
-      if (!in_edge->outputs_ready_)
-        edge->outputs_ready_ = false;
-    }
+      // If an input is not ready, neither are our outputs.
+      if (Edge* in_edge = input->in_edge()) {
+        if (!in_edge->outputs_ready_)
+          edge->outputs_ready_ = false;
+      }
 
-    if (!edge->is_order_only(i - edge->inputs_.begin())) {
-      // If a regular input is dirty (or missing), we're dirty.
-      // Otherwise consider mtime.
-      if ((*i)->dirty()) {
-        EXPLAIN("%s is dirty", (*i)->path().c_str());
-        dirty = true;
-      } else {
-        if (!most_recent_input || (*i)->mtime() > most_recent_input->mtime()) {
-          most_recent_input = *i;
+      if (!edge->is_order_only(visit.input)) {
+        // If a regular input is dirty (or missing), we're dirty.
+        // Otherwise consider mtime.
+        if (input->dirty()) {
+          EXPLAIN("%s is dirty", input->path().c_str());
+          visit.dirty = true;
+        } else {
+          if (!visit.most_recent_input ||
+              input->mtime() > visit.most_recent_input->mtime()) {
+            visit.most_recent_input = input;
+          }
         }
       }
+      ++visit.input;
+      continue;
     }
-  }
 
-  // We may also be dirty due to output state: missing outputs, out of
-  // date outputs, etc.  Visit all outputs and determine whether they're dirty.
-  if (!dirty)
-    if (!RecomputeOutputsDirty(edge, most_recent_input, &dirty, err))
-      return false;
+    // We may also be dirty due to output state: missing outputs, out of
+    // date outputs, etc.  Visit all outputs and determine whether they're
+    // dirty.
+    bool dirty = visit.dirty;
+    if (!dirty)
+      if (!RecomputeOutputsDirty(edge, visit.most_recent_input, &dirty, err))
+        return false;
 
-  // Finally, visit each output and update their dirty state if necessary.
-  for (auto& output : edge->outputs_) {
-    if (dirty)
-      output->MarkDirty();
-  }
+    // Finally, visit each output and update their dirty state if necessary.
+    for (auto& output : edge->outputs_) {
+      if (dirty)
+        output->MarkDirty();
+    }
 
-  // If an edge is dirty, its outputs are normally not ready.  (It's
-  // possible to be clean but still not be ready in the presence of
-  // order-only inputs.)
-  // But phony edges with no inputs have nothing to do, so are always
-  // ready.
-  if (dirty && !(edge->is_phony() && edge->inputs_.empty()))
-    edge->outputs_ready_ = false;
+    // If an edge is dirty, its outputs are normally not ready.  (It's
+    // possible to be clean but still not be ready in the presence of
+    // order-only inputs.)
+    // But phony edges with no inputs have nothing to do, so are always
+    // ready.
+    if (dirty && !(edge->is_phony() && edge->inputs_.empty()))
+      edge->outputs_ready_ = false;
 
-  // Mark the edge as finished during this walk now that it will no longer
-  // be in the call stack.
-  edge->mark_ = Edge::VisitDone;
-  assert(stack->back() == node);
-  stack->pop_back();
+    // Mark the edge as finished during this walk now that it will no longer
+    // be in the stack.
+    edge->mark_ = Edge::VisitDone;
+    assert(stack.back()->in_edge() == edge);
+    stack.pop_back();
+    visits.pop_back();
+  }
 
   return true;
 }
 
+void DependencyScan::CollectNodesToStat(const std::vector<Node*>& targets,
+                                        std::vector<Node*>* nodes) const {
+  DepsLog* deps_log = dep_loader_.deps_log();
+  std::unordered_set<Node*> seen;
+  std::unordered_set<const Edge*> edges;
+  std::vector<Node*> stack;
+  auto visit = [&](Node* n) {
+    if (seen.insert(n).second)
+      stack.push_back(n);
+  };
+  for (Node* target : targets)
+    visit(target);
+  while (!stack.empty()) {
+    Node* n = stack.back();
+    stack.pop_back();
+    if (!n->status_known())
+      nodes->push_back(n);
+
+    // Edges RecomputeDirty() already went through have nothing left to stat.
+    Edge* edge = n->in_edge();
+    if (!edge || edge->mark_ == Edge::VisitDone || !edges.insert(edge).second)
+      continue;
+    for (Node* output : edge->outputs_)
+      visit(output);
+    for (Node* input : edge->inputs_)
+      visit(input);
+    if (deps_log && !edge->deps_loaded_) {
+      if (DepsLog::Deps* deps = deps_log->GetDeps(edge->outputs_[0])) {
+        for (int i = 0; i < deps->node_count; ++i)
+          visit(deps->nodes[i]);
+      }
+    }
+  }
+}
+
 bool DependencyScan::VerifyDAG(Node* node, std::vector<Node*>* stack,
                                std::string* err) {
   Edge* edge = node->in_edge();
@@ -466,6 +558,13 @@ bool Edge::maybe_phonycycle_diagnostic() const {
          implicit_deps_ == 0;
 }
 
+bool EdgePriorityLess::operator()(const Edge* e1, const Edge* e2) const {
+  if (e1->critical_path_weight() != e2->critical_path_weight())
+    return e1->critical_path_weight() < e2->critical_path_weight();
+  // Break ties by manifest order.
+  return e1->id_ > e2->id_;
+}
+
 // static
 std::string Node::PathDecanonicalized(const std::string& path,
                                       uint64_t slash_bits) {
@@ -17,10 +17,12 @@
 
 #include <bits/stdint-uintn.h>
 
+#include <queue>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "content_hash.h"
 #include "dyndep.h"
 #include "eval_env.h"
 #include "timestamp.h"
@@ -40,7 +42,8 @@ struct State;
 struct Node {
   Node(std::string path, uint64_t slash_bits)
       : path_(std::move(path)), slash_bits_(slash_bits), mtime_(-1),
-        dirty_(false), dyndep_pending_(false), in_edge_(nullptr), id_(-1) {}
+        dirty_(false), dyndep_pending_(false),
+        in_edge_(nullptr), id_(-1) {}
 
   /// Return false on error.
   bool Stat(DiskInterface* disk_interface, std::string* err);
@@ -56,12 +59,15 @@ struct Node {
   void ResetState() {
     mtime_ = -1;
     dirty_ = false;
-	contents_hash_ = 0;
+    contents_hash_ = ContentHash();
   }
 
   /// Mark the Node as already-stat()ed and missing.
   void MarkMissing() { mtime_ = 0; }
 
+  /// Record the mtime of the node, as stat()ed with others in a batch.
+  void set_mtime(TimeStamp mtime) { mtime_ = mtime; }
+
   bool exists() const { return mtime_ != 0; }
 
   bool status_known() const { return mtime_ != -1; }
@@ -77,7 +83,8 @@ struct Node {
 
   TimeStamp mtime() const { return mtime_; }
 
-  uint64_t contents_hash() const { return contents_hash_; }
+  const ContentHash& contents_hash() const { return contents_hash_; }
+  void set_contents_hash(const ContentHash& hash) { contents_hash_ = hash; }
 
   bool dirty() const { return dirty_; }
   void set_dirty(bool dirty) { dirty_ = dirty; }
@@ -110,8 +117,9 @@ struct Node {
   ///   >0: actual file's mtime
   TimeStamp mtime_;
 
-  /// Hash of the contents of the file.
-  uint64_t contents_hash_;
+  /// Hash of the contents of the file before its edge ran, when that edge
+  /// restats its outputs by hash, or no digest.
+  ContentHash contents_hash_;
 
   /// Dirty is true when the underlying file is out-of-date.
   /// But note that Edge::outputs_ready_ is also used in judging which
@@ -167,14 +175,26 @@ struct Edge {
   Node* dyndep_;
   BindingEnv* env_;
   VisitMark mark_{ VisitNone };
+  /// A dense integer id for the edge, assigned by State::AddEdge and used to
+  /// index per-edge bookkeeping such as the Plan's.
+  size_t id_{ 0 };
   bool outputs_ready_{ false };
   bool deps_loaded_{ false };
   bool deps_missing_{ false };
 
+  /// Length of the longest chain of work, in estimated milliseconds, from
+  /// the start of this edge to the end of the build.  Edges with heavier
+  /// weights are started first.  -1 until computed by the Plan.
+  int64_t critical_path_weight_{ -1 };
+
   const Rule& rule() const { return *rule_; }
   Pool* pool() const { return pool_; }
   static int weight() { return 1; }
   bool outputs_ready() const { return outputs_ready_; }
+  int64_t critical_path_weight() const { return critical_path_weight_; }
+  void set_critical_path_weight(int64_t weight) {
+    critical_path_weight_ = weight;
+  }
 
   // There are three types of inputs.
   // 1) explicit deps, which show up as $in on the command line;
@@ -209,6 +229,22 @@ struct Edge {
   bool maybe_phonycycle_diagnostic() const;
 };
 
+/// Orders edges by increasing priority: the edge starting the longest chain
+/// of remaining work comes last.
+struct EdgePriorityLess {
+  bool operator()(const Edge* e1, const Edge* e2) const;
+};
+
+/// Ready edges, the one at the top being the most urgent to start.
+struct EdgePriorityQueue
+    : public std::priority_queue<Edge*, std::vector<Edge*>, EdgePriorityLess> {
+  void clear() { c.clear(); }
+
+  /// The edges in heap order: the most urgent one first, and the next ones
+  /// mostly among the most urgent.
+  const std::vector<Edge*>& heap() const { return c; }
+};
+
 /// ImplicitDepLoader loads implicit dependencies, as referenced via the
 /// "depfile" attribute in build files.
 struct ImplicitDepLoader {
@@ -266,6 +302,14 @@ struct DependencyScan {
   /// Returns false on failure.
   bool RecomputeDirty(Node* node, std::string* err);
 
+  /// Append to |nodes|, once each, the nodes RecomputeDirty() would stat
+  /// for |targets|: those reachable from them, including through the
+  /// dependencies recorded in the deps log, whose status isn't known yet.
+  /// Stat'ing them ahead, e.g. on several threads, spares RecomputeDirty()
+  /// from doing it serially.
+  void CollectNodesToStat(const std::vector<Node*>& targets,
+                          std::vector<Node*>* nodes) const;
+
   /// Recompute whether any output of the edge is dirty, if so std::sets
   /// |*dirty|. Returns false on failure.
   bool RecomputeOutputsDirty(Edge* edge, Node* most_recent_input, bool* dirty,
@@ -284,7 +328,6 @@ struct DependencyScan {
   bool LoadDyndeps(Node* node, DyndepFile* ddf, std::string* err) const;
 
  private:
-  bool RecomputeDirty(Node* node, std::vector<Node*>* stack, std::string* err);
   static bool VerifyDAG(Node* node, std::vector<Node*>* stack,
                         std::string* err);
 
@@ -14,6 +14,8 @@
 
 #include "graph.h"
 
+#include <algorithm>
+
 #include "build.h"
 #include "test.h"
 
@@ -56,6 +58,35 @@ TEST_F(GraphTest, ModifiedImplicit) {
   EXPECT_TRUE(GetNode("out")->dirty());
 }
 
+TEST_F(GraphTest, CollectNodesToStat) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "build out: cat mid1 mid2\n"
+                                      "build mid1 mid1.extra: cat in\n"
+                                      "build mid2: cat in || mid1.extra\n"));
+  fs_.Create("in", "");
+
+  // Every node once, whichever target and path it's reached through.
+  std::vector<Node*> nodes;
+  scan_.CollectNodesToStat({ GetNode("out"), GetNode("mid2") }, &nodes);
+  std::sort(nodes.begin(), nodes.end(), [](Node* a, Node* b) {
+    return a->path() < b->path();
+  });
+  ASSERT_EQ(5u, nodes.size());
+  EXPECT_EQ("in", nodes[0]->path());
+  EXPECT_EQ("mid1", nodes[1]->path());
+  EXPECT_EQ("mid1.extra", nodes[2]->path());
+  EXPECT_EQ("mid2", nodes[3]->path());
+  EXPECT_EQ("out", nodes[4]->path());
+
+  // Nothing is left to stat once RecomputeDirty() went through them.
+  std::string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  nodes.clear();
+  scan_.CollectNodesToStat({ GetNode("out") }, &nodes);
+  EXPECT_TRUE(nodes.empty());
+}
+
 TEST_F(GraphTest, FunkyMakefilePath) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
                                       "rule catdep\n"
@@ -324,6 +355,31 @@ TEST_F(GraphTest, DependencyCycle) {
   ASSERT_EQ("dependency cycle: out -> mid -> in -> pre -> out", err);
 }
 
+TEST_F(GraphTest, DeepChain) {
+  // Far deeper than a recursive walk of the graph could go on the stack.
+  const int kDepth = 100000;
+  std::string manifest;
+  for (int i = 0; i < kDepth; ++i) {
+    manifest += "build n" + std::to_string(i + 1) + ": cat n" +
+                std::to_string(i) + "\n";
+    fs_.Create("n" + std::to_string(i + 1), "");
+  }
+  AssertParse(&state_, manifest.c_str());
+  fs_.Tick();
+  fs_.Create("n0", "");
+
+  std::string err;
+  Node* top = GetNode("n" + std::to_string(kDepth));
+  EXPECT_TRUE(scan_.RecomputeDirty(top, &err));
+  ASSERT_EQ("", err);
+
+  // The new source dirties the whole chain.
+  EXPECT_TRUE(top->dirty());
+  EXPECT_TRUE(GetNode("n1")->dirty());
+  EXPECT_FALSE(top->in_edge()->outputs_ready());
+  EXPECT_EQ(Edge::VisitDone, GetNode("n1")->in_edge()->mark_);
+}
+
 TEST_F(GraphTest, CycleInEdgesButNotInNodes1) {
   std::string err;
   AssertParse(&state_, "build a b: cat a\n");
@@ -0,0 +1,199 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash_cache.h"
+
+#include <cerrno>
+#include <cstring>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+#include "util.h"
+
+namespace {
+
+// The version is stored as 4 bytes after the signature and also serves as a
+// byte order mark.  Signature and version combined are 16 bytes long.
+const char kFileSignature[] = "# ninjahash\n";
+const int kCurrentVersion = 2;
+const size_t kHeaderSize = sizeof(kFileSignature) - 1 + 4;
+
+/// Number of 64-bit fields in a record.
+const size_t kRecordFields = 6;
+
+bool WriteHeader(FILE* f) {
+  return fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) == 1 &&
+         fwrite(&kCurrentVersion, 4, 1, f) == 1;
+}
+
+}  // namespace
+
+HashCache::~HashCache() {
+  Close();
+}
+
+LoadStatus HashCache::Load(const std::string& path, std::string* err) {
+  METRIC_RECORD(".ninja_hashes load");
+  Close();
+  entries_.clear();
+  needs_recompaction_ = false;
+
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) {
+    if (errno == ENOENT)
+      return LOAD_NOT_FOUND;
+    *err = strerror(errno);
+    return LOAD_ERROR;
+  }
+
+  char signature[sizeof(kFileSignature) - 1];
+  int version = 0;
+  if (fread(signature, sizeof(signature), 1, f) < 1 ||
+      fread(&version, 4, 1, f) < 1 ||
+      memcmp(signature, kFileSignature, sizeof(signature)) != 0 ||
+      version != kCurrentVersion) {
+    *err = "bad hash cache signature or version; starting over";
+    fclose(f);
+    unlink(path.c_str());
+    // Don't report this as a failure: files will be hashed again.
+    return LOAD_SUCCESS;
+  }
+
+  size_t record_count = 0;
+  uint64_t record[kRecordFields];
+  while (fread(record, sizeof(record), 1, f) == 1) {
+    ++record_count;
+    entries_[Key{ record[0], record[1] }] =
+        Entry{ (int64_t)record[2], (TimeStamp)record[3],
+               ContentHash{ record[4], record[5] } };
+  }
+
+  if (ferror(f)) {
+    *err = strerror(errno);
+    fclose(f);
+    return LOAD_ERROR;
+  }
+  long size = ftell(f);
+  fclose(f);
+
+  // A record may have been partially written by an interrupted build; drop
+  // it, so that the following records are aligned.
+  size_t valid_size = kHeaderSize + record_count * sizeof(record);
+  if (size != (long)valid_size && !Truncate(path, valid_size, err))
+    return LOAD_ERROR;
+
+  // Rebuild the cache if there are too many dead records.
+  const size_t kMinCompactionEntryCount = 1000;
+  const size_t kCompactionRatio = 3;
+  if (record_count > kMinCompactionEntryCount &&
+      record_count > entries_.size() * kCompactionRatio)
+    needs_recompaction_ = true;
+
+  return LOAD_SUCCESS;
+}
+
+bool HashCache::OpenForWrite(const std::string& path, std::string* err) {
+  if (needs_recompaction_) {
+    if (!Recompact(path, err))
+      return false;
+  }
+
+  file_ = fopen(path.c_str(), "ab");
+  if (!file_) {
+    *err = strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(fileno(file_));
+
+  // Opening a file in append mode doesn't set the file pointer to the
+  // file's end on Windows. Do that explicitly.
+  fseek(file_, 0, SEEK_END);
+
+  if (ftell(file_) == 0 && !WriteHeader(file_)) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void HashCache::Close() {
+  if (file_)
+    fclose(file_);
+  file_ = nullptr;
+}
+
+bool HashCache::Recompact(const std::string& path, std::string* err) {
+  METRIC_RECORD(".ninja_hashes recompact");
+
+  Close();
+  std::string temp_path = path + ".recompact";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  bool success = WriteHeader(f);
+  for (auto i = entries_.begin(); success && i != entries_.end(); ++i)
+    success = WriteRecord(f, i->first, i->second);
+  if (fclose(f) != 0)
+    success = false;
+  if (!success) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  needs_recompaction_ = false;
+  return true;
+}
+
+ContentHash HashCache::Lookup(const FileId& id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto i = entries_.find(Key{ id.device, id.inode });
+  if (i == entries_.end() || i->second.size != id.size ||
+      i->second.mtime != id.mtime)
+    return ContentHash();
+  return i->second.hash;
+}
+
+bool HashCache::Record(const FileId& id, ContentHash hash) {
+  Key key{ id.device, id.inode };
+  Entry entry{ id.size, id.mtime, hash };
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_[key] = entry;
+  return !file_ || WriteRecord(file_, key, entry);
+}
+
+// static
+bool HashCache::WriteRecord(FILE* f, const Key& key, const Entry& entry) {
+  const uint64_t record[kRecordFields] = { key.device,
+                                           key.inode,
+                                           (uint64_t)entry.size,
+                                           (uint64_t)entry.mtime,
+                                           entry.hash.low,
+                                           entry.hash.high };
+  return fwrite(record, sizeof(record), 1, f) == 1;
+}
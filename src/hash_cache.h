@@ -0,0 +1,101 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_HASH_CACHE_H_
+#define NINJA_HASH_CACHE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "content_hash.h"
+#include "load_status.h"
+#include "timestamp.h"
+
+/// Remembers the hash of the contents of files across builds, so that files
+/// which didn't change since they were last hashed aren't read again.
+///
+/// Files are known by their identity on the disk, i.e. their device and
+/// inode, rather than by path, and a hash is only trusted while the file
+/// still has the size and mtime it had when it was hashed.
+///
+/// The on-disk format is a version header followed by fixed-size records of
+/// six 64-bit integers: the device, inode, size and mtime of a file, then
+/// the low and high halves of its hash.
+/// If two records are about the same file, the latter one wins, so that
+/// updates are just appended to the file.
+struct HashCache {
+  /// What identifies a file and its version on the disk.
+  struct FileId {
+    uint64_t device;
+    uint64_t inode;
+    int64_t size;
+    TimeStamp mtime;
+  };
+
+  HashCache() = default;
+  ~HashCache();
+
+  /// Load the on-disk cache, forgetting about what was known before.
+  LoadStatus Load(const std::string& path, std::string* err);
+
+  /// Open the on-disk cache to append the hashes recorded from now on.
+  bool OpenForWrite(const std::string& path, std::string* err);
+  void Close();
+
+  /// Rewrite the known hashes, throwing away old records.
+  bool Recompact(const std::string& path, std::string* err);
+
+  /// The hash recorded for the file |id|, or no digest if it's unknown or if
+  /// the file changed since.  May be called from several threads.
+  ContentHash Lookup(const FileId& id) const;
+
+  /// Remember that the file |id| hashes to |hash|.  May be called from
+  /// several threads.
+  /// @return false if the record couldn't be written.
+  bool Record(const FileId& id, ContentHash hash);
+
+  /// Number of files whose hash is known.
+  size_t size() const { return entries_.size(); }
+
+ private:
+  struct Key {
+    uint64_t device;
+    uint64_t inode;
+    bool operator==(const Key& o) const {
+      return device == o.device && inode == o.inode;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return std::hash<uint64_t>()(key.inode ^ (key.device << 32));
+    }
+  };
+  struct Entry {
+    int64_t size;
+    TimeStamp mtime;
+    ContentHash hash;
+  };
+
+  static bool WriteRecord(FILE* f, const Key& key, const Entry& entry);
+
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+  mutable std::mutex mutex_;
+  FILE* file_{ nullptr };
+  bool needs_recompaction_{ false };
+};
+
+#endif  // NINJA_HASH_CACHE_H_
@@ -0,0 +1,141 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash_cache.h"
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "test.h"
+#include "util.h"
+
+namespace {
+
+const char kTestFilename[] = "HashCacheTest-tempfile";
+
+struct HashCacheTest : public testing::Test {
+  void SetUp() override {
+    // In case a crashing test left a stale file behind.
+    unlink(kTestFilename);
+  }
+  void TearDown() override { unlink(kTestFilename); }
+};
+
+TEST_F(HashCacheTest, WriteRead) {
+  HashCache cache1;
+  std::string err;
+  EXPECT_TRUE(cache1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(cache1.Record({ 1, 2, 100, 1000 }, ContentHash{ 0x1234, 0 }));
+  EXPECT_TRUE(cache1.Record({ 1, 3, 200, 2000 }, ContentHash{ 0x5678, 0 }));
+  EXPECT_TRUE(cache1.Record({ 1, 2, 101, 1001 }, ContentHash{ 0x9abc, 0 }));
+  cache1.Close();
+
+  HashCache cache2;
+  EXPECT_EQ(LOAD_SUCCESS, cache2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(2u, cache2.size());
+  EXPECT_EQ(0x9abcu, cache2.Lookup({ 1, 2, 101, 1001 }).low);
+  EXPECT_EQ(0x5678u, cache2.Lookup({ 1, 3, 200, 2000 }).low);
+
+  // A file whose size or mtime changed must be hashed again.
+  EXPECT_FALSE(cache2.Lookup({ 1, 2, 100, 1000 }));
+  EXPECT_FALSE(cache2.Lookup({ 1, 3, 201, 2000 }));
+  EXPECT_FALSE(cache2.Lookup({ 1, 3, 200, 2001 }));
+  // So must another file.
+  EXPECT_FALSE(cache2.Lookup({ 2, 3, 200, 2000 }));
+}
+
+TEST_F(HashCacheTest, Truncated) {
+  HashCache cache1;
+  std::string err;
+  EXPECT_TRUE(cache1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(cache1.Record({ 1, 2, 100, 1000 }, ContentHash{ 0x1234, 0 }));
+  EXPECT_TRUE(cache1.Record({ 1, 3, 200, 2000 }, ContentHash{ 0x5678, 0 }));
+  cache1.Close();
+
+  // Cut the last record in the middle, as an interrupted build could.
+  struct stat st;
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+  ASSERT_TRUE(Truncate(kTestFilename, st.st_size - 3, &err));
+
+  HashCache cache2;
+  EXPECT_EQ(LOAD_SUCCESS, cache2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, cache2.size());
+  EXPECT_EQ(0x1234u, cache2.Lookup({ 1, 2, 100, 1000 }).low);
+
+  // Records appended afterwards are read back.
+  EXPECT_TRUE(cache2.OpenForWrite(kTestFilename, &err));
+  EXPECT_TRUE(cache2.Record({ 1, 4, 300, 3000 }, ContentHash{ 0xdef0, 0 }));
+  cache2.Close();
+
+  HashCache cache3;
+  EXPECT_EQ(LOAD_SUCCESS, cache3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(2u, cache3.size());
+  EXPECT_EQ(0xdef0u, cache3.Lookup({ 1, 4, 300, 3000 }).low);
+}
+
+TEST_F(HashCacheTest, Recompact) {
+  HashCache cache1;
+  std::string err;
+  EXPECT_TRUE(cache1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  for (int i = 0; i < 2000; ++i) {
+    ContentHash hash{ (uint64_t)i + 1, 0 };
+    EXPECT_TRUE(cache1.Record({ 1, 2, i, i }, hash));
+  }
+  cache1.Close();
+
+  struct stat st;
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+  off_t full_size = st.st_size;
+
+  // Loading notices the dead records, and opening for write drops them.
+  HashCache cache2;
+  EXPECT_EQ(LOAD_SUCCESS, cache2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(cache2.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  cache2.Close();
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+  EXPECT_LT(st.st_size, full_size);
+
+  HashCache cache3;
+  EXPECT_EQ(LOAD_SUCCESS, cache3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, cache3.size());
+  EXPECT_EQ(2000u, cache3.Lookup({ 1, 2, 1999, 1999 }).low);
+}
+
+TEST_F(HashCacheTest, BadSignature) {
+  FILE* f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f);
+  fputs("# not a hash cache\n", f);
+  fclose(f);
+
+  HashCache cache;
+  std::string err;
+  EXPECT_EQ(LOAD_SUCCESS, cache.Load(kTestFilename, &err));
+  EXPECT_NE("", err);
+  EXPECT_EQ(0u, cache.size());
+}
+
+}  // anonymous namespace
@@ -16,8 +16,12 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <string>
 
 #include "build_log.h"
+#include "content_hash.h"
+#include "hash.h"
+#include "metrics.h"
 
 int random(int low, int high) {
   return int(low + (rand() / double(RAND_MAX)) * (high - low) + 0.5);
@@ -58,4 +62,48 @@ int main() {
     }
   }
   printf("\n\n%d collisions after %d runs\n", collision_count, N);
+
+  // Content hashes are compared whole, but check that even their low 64 bits
+  // alone don't collide on the same inputs.
+  for (int i = 0; i < N; ++i) {
+    hashes[i] = std::make_pair(
+        HashContents(commands[i], strlen(commands[i])).low, i);
+  }
+
+  sort(hashes, hashes + N);
+
+  collision_count = 0;
+  for (int i = 1; i < N; ++i) {
+    if (hashes[i - 1].first == hashes[i].first &&
+        strcmp(commands[hashes[i - 1].second], commands[hashes[i].second]) !=
+            0) {
+      collision_count++;
+    }
+  }
+  printf("%d content hash collisions after %d runs\n", collision_count, N);
+
+  // Throughput on inputs the size of a large source file, against what hashed
+  // contents before.
+  std::string contents(1 << 20, '\0');
+  for (char& c : contents)
+    c = (char)random(0, 255);
+  const int kRuns = 2000;
+  const double kMegabytes = kRuns * (contents.size() >> 20);
+
+  uint64_t sink = 0;
+  int64_t start = GetTimeMillis();
+  for (int run = 0; run < kRuns; ++run)
+    sink += MurmurHash64A(contents.data(), contents.size());
+  int64_t delta = std::max<int64_t>(GetTimeMillis() - start, 1);
+  printf("%-12s %8.0f MB/s\n", "murmur64a", kMegabytes * 1000 / delta);
+
+  for (const ContentHasher& hasher : AvailableContentHashers()) {
+    start = GetTimeMillis();
+    for (int run = 0; run < kRuns; ++run)
+      sink += hasher.hash(contents.data(), contents.size()).low;
+    delta = std::max<int64_t>(GetTimeMillis() - start, 1);
+    printf("%-12s %8.0f MB/s\n", hasher.name, kMegabytes * 1000 / delta);
+  }
+  // Keep the hashes from being optimized away.
+  return sink == 42;
 }
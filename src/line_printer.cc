@@ -14,6 +14,7 @@
 
 #include "line_printer.h"
 
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #ifdef _WIN32
@@ -28,8 +29,19 @@
 #include <unistd.h>
 #endif
 
+#include "metrics.h"
 #include "util.h"
 
+#ifndef _WIN32
+namespace {
+
+/// Size of the text waiting to be written out beyond which printing waits
+/// for the writer to catch up, rather than use ever more memory.
+const size_t kMaxBufferedOutput = 16 << 20;
+
+}  // namespace
+#endif
+
 LinePrinter::LinePrinter()  {
   const char* term = getenv("TERM");
 #ifndef _WIN32
@@ -67,6 +79,20 @@ LinePrinter::LinePrinter()  {
 #endif
 }
 
+LinePrinter::~LinePrinter() {
+#ifndef _WIN32
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!writer_.joinable())
+      return;
+    CommitLine();
+    stopping_ = true;
+  }
+  write_cv_.notify_one();
+  writer_.join();
+#endif
+}
+
 void LinePrinter::Print(std::string to_print, LineType type) {
   if (console_locked_) {
     line_buffer_ = to_print;
@@ -74,14 +100,28 @@ void LinePrinter::Print(std::string to_print, LineType type) {
     return;
   }
 
-  if (smart_terminal_) {
+#ifndef _WIN32
+  if (type == ELIDE) {
+    // Leave it to the writer, which prints the line at most every refresh
+    // interval: overprinting the previous one on a smart terminal, or else
+    // on a line of its own, so as not to flood logs either.
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      line_ = std::move(to_print);
+      line_overprints_ = smart_terminal_;
+      has_line_ = true;
+      StartWriter();
+    }
+    write_cv_.notify_one();
+    if (smart_terminal_)
+      have_blank_line_ = false;
+    return;
+  }
+#else
+  if (smart_terminal_ && type == ELIDE) {
     printf("\r");  // Print over previous line, if any.
     // On Windows, calling a C library function writing to stdout also handles
     // pausing the executable when the "Pause" key or Ctrl-S is pressed.
-  }
-
-  if (smart_terminal_ && type == ELIDE) {
-#ifdef _WIN32
     CONSOLE_SCREEN_BUFFER_INFO csbi;
     GetConsoleScreenBufferInfo(console_, &csbi);
 
@@ -101,34 +141,121 @@ void LinePrinter::Print(std::string to_print, LineType type) {
       char_data[i].Attributes = csbi.wAttributes;
     }
     WriteConsoleOutput(console_, &char_data[0], buf_size, zero_zero, &target);
-#else
-    // Limit output to width of the terminal if provided so we don't cause
-    // line-wrapping.
-    winsize size;
-    if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) && size.ws_col) {
-      to_print = ElideMiddle(to_print, size.ws_col);
-    }
-    printf("%s", to_print.c_str());
-    printf("\x1B[K");  // Clear to end of line.
-    fflush(stdout);
-#endif
 
     have_blank_line_ = false;
-  } else {
-    printf("%s\n", to_print.c_str());
+    return;
   }
+#endif
+
+  if (smart_terminal_)
+    to_print.insert(0, "\r");  // Print over previous line, if any.
+  to_print += '\n';
+  Write(to_print.data(), to_print.size());
 }
 
 void LinePrinter::PrintOrBuffer(const char* data, size_t size) {
   if (console_locked_) {
     output_buffer_.append(data, size);
   } else {
-    // Avoid printf and C std::strings, since the actual output might contain
-    // null bytes like UTF-16 does (yuck).
-    fwrite(data, 1, size, stdout);
+    Write(data, size);
   }
 }
 
+void LinePrinter::Write(const char* data, size_t size) {
+#ifdef _WIN32
+  // Avoid printf and C std::strings, since the actual output might contain
+  // null bytes like UTF-16 does (yuck).
+  fwrite(data, 1, size, stdout);
+#else
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // The overprinted line goes first, e.g. to tell which command printed
+    // what follows.
+    CommitLine();
+    output_.append(data, size);
+    StartWriter();
+    write_cv_.notify_one();
+    written_cv_.wait(lock,
+                     [this] { return output_.size() <= kMaxBufferedOutput; });
+  }
+#endif
+}
+
+void LinePrinter::Flush() {
+#ifdef _WIN32
+  fflush(stdout);
+#else
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!writer_.joinable())
+    return;
+  CommitLine();
+  write_cv_.notify_one();
+  written_cv_.wait(lock, [this] { return output_.empty() && !writing_; });
+#endif
+}
+
+#ifndef _WIN32
+std::string LinePrinter::RenderLine(const std::string& line, bool overprint) {
+  if (!overprint)
+    return line + '\n';
+  std::string to_print = line;
+  // Limit output to width of the terminal if provided so we don't cause
+  // line-wrapping.
+  winsize size;
+  if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) && size.ws_col) {
+    to_print = ElideMiddle(to_print, size.ws_col);
+  }
+  // Print over previous line, if any, and clear to end of line.
+  return "\r" + to_print + "\x1B[K";
+}
+
+void LinePrinter::CommitLine() {
+  if (!has_line_)
+    return;
+  output_ += RenderLine(line_, line_overprints_);
+  has_line_ = false;
+  next_refresh_millis_ = GetTimeMillis() + refresh_interval_millis_;
+}
+
+void LinePrinter::StartWriter() {
+  if (!writer_.joinable()) {
+    ScopedSignalsBlocked signals_blocked;
+    writer_ = std::thread(&LinePrinter::WriteLoop, this);
+  }
+}
+
+void LinePrinter::WriteLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    if (output_.empty() && has_line_ &&
+        GetTimeMillis() >= next_refresh_millis_)
+      CommitLine();
+
+    if (!output_.empty()) {
+      std::string output;
+      output.swap(output_);
+      writing_ = true;
+      lock.unlock();
+      fwrite(output.data(), 1, output.size(), stdout);
+      fflush(stdout);
+      lock.lock();
+      writing_ = false;
+      written_cv_.notify_all();
+      continue;
+    }
+
+    if (stopping_)
+      return;
+    if (has_line_) {
+      write_cv_.wait_for(lock, std::chrono::milliseconds(
+                                   next_refresh_millis_ - GetTimeMillis()));
+    } else {
+      write_cv_.wait(lock);
+    }
+  }
+}
+#endif  // !_WIN32
+
 void LinePrinter::PrintOnNewLine(const std::string& to_print) {
   if (console_locked_ && !line_buffer_.empty()) {
     output_buffer_.append(line_buffer_);
@@ -148,8 +275,11 @@ void LinePrinter::SetConsoleLocked(bool locked) {
   if (locked == console_locked_)
     return;
 
-  if (locked)
+  if (locked) {
     PrintOnNewLine("");
+    // The console is about to be handed over.
+    Flush();
+  }
 
   console_locked_ = locked;
 
@@ -15,13 +15,26 @@
 #ifndef NINJA_LINE_PRINTER_H_
 #define NINJA_LINE_PRINTER_H_
 
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <mutex>
 #include <string>
+#include <thread>
 
 /// Prints lines of text, possibly overprinting previously printed lines
 /// if the terminal supports it.
+///
+/// Except on Windows, the text is written out by a thread of its own, so
+/// that a slow terminal or pipe doesn't hold the caller back, and ELIDE
+/// lines are printed at most every refresh_interval_millis(), overprinting
+/// each other on a smart terminal or on lines of their own otherwise: lines
+/// replaced in between are dropped, except for the last one, and the one
+/// printed before any other text.
 struct LinePrinter {
   LinePrinter();
+  /// Writes out everything printed so far.
+  ~LinePrinter();
 
   bool is_smart_terminal() const { return smart_terminal_; }
   void set_smart_terminal(bool smart) { smart_terminal_ = smart; }
@@ -40,6 +53,15 @@ struct LinePrinter {
   /// console is locked will not be printed until it is unlocked.
   void SetConsoleLocked(bool locked);
 
+  /// Wait until everything printed so far is written out, including the
+  /// latest overprinted line.
+  void Flush();
+
+  int64_t refresh_interval_millis() const { return refresh_interval_millis_; }
+  void set_refresh_interval_millis(int64_t millis) {
+    refresh_interval_millis_ = millis;
+  }
+
  private:
   /// Whether we can do fancy terminal control codes.
   bool smart_terminal_;
@@ -66,8 +88,56 @@ struct LinePrinter {
   void* console_;
 #endif
 
+  int64_t refresh_interval_millis_{ 50 };
+
   /// Print the given data to the console, or buffer it if it is locked.
   void PrintOrBuffer(const char* data, size_t size);
+
+  /// Write the given data out after everything printed before.
+  void Write(const char* data, size_t size);
+
+#ifndef _WIN32
+  /// Turn an ELIDE line into the text printing it, overprinting the
+  /// current line of the terminal if |overprint|.
+  static std::string RenderLine(const std::string& line, bool overprint);
+
+  /// Queue the pending overprinted line, if any, for writing right away.
+  /// Must be called with mutex_ held.
+  void CommitLine();
+
+  /// Start writer_ unless it's running.  Must be called with mutex_ held.
+  void StartWriter();
+
+  /// Body of writer_.
+  void WriteLoop();
+
+  /// Protects the members below, shared with writer_.
+  std::mutex mutex_;
+
+  /// Signals writer_ that there is something to write, or to stop.
+  std::condition_variable write_cv_;
+
+  /// Signals that writer_ wrote something out.
+  std::condition_variable written_cv_;
+
+  /// Text waiting to be written out, in order.
+  std::string output_;
+
+  /// ELIDE line waiting to be printed, once the refresh interval allows it,
+  /// and whether it overprints the current one.
+  std::string line_;
+  bool has_line_{ false };
+  bool line_overprints_{ false };
+
+  /// When the current line may be overprinted again.
+  int64_t next_refresh_millis_{ 0 };
+
+  /// Whether writer_ is writing text it took out of output_.
+  bool writing_{ false };
+
+  bool stopping_{ false };
+  std::thread writer_;
+#endif
 };
 
 #endif  // NINJA_LINE_PRINTER_H_
@@ -0,0 +1,123 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "line_printer.h"
+
+#include <cstdio>
+#include <string>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "test.h"
+
+#ifndef _WIN32
+
+namespace {
+
+/// Redirects stdout to a pipe, to see what the printer writes out.
+struct LinePrinterTest : public testing::Test {
+  void SetUp() override {
+    fflush(stdout);
+    ASSERT_EQ(0, pipe(fds_));
+    ASSERT_EQ(0, fcntl(fds_[0], F_SETFL, O_NONBLOCK));
+    saved_stdout_ = dup(STDOUT_FILENO);
+    ASSERT_GE(dup2(fds_[1], STDOUT_FILENO), 0);
+  }
+
+  void TearDown() override {
+    fflush(stdout);
+    dup2(saved_stdout_, STDOUT_FILENO);
+    close(saved_stdout_);
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+
+  /// What was written out since the last call.
+  std::string Read() {
+    std::string output;
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(fds_[0], buf, sizeof(buf))) > 0)
+      output.append(buf, len);
+    return output;
+  }
+
+  int fds_[2];
+  int saved_stdout_;
+};
+
+}  // anonymous namespace
+
+TEST_F(LinePrinterTest, CoalescesStatusLines) {
+  LinePrinter printer;
+  ASSERT_FALSE(printer.is_smart_terminal());
+  printer.set_refresh_interval_millis(60 * 1000);
+
+  printer.Print("1", LinePrinter::ELIDE);
+  printer.Flush();
+  EXPECT_EQ("1\n", Read());
+
+  // Within the interval, only the last line shows, and before any other
+  // output at that.
+  for (int i = 2; i <= 100; ++i)
+    printer.Print(std::to_string(i), LinePrinter::ELIDE);
+  EXPECT_EQ("", Read());
+  printer.PrintOnNewLine("output\n");
+  printer.Print("101", LinePrinter::ELIDE);
+  printer.Print("102", LinePrinter::ELIDE);
+  printer.Flush();
+  EXPECT_EQ("100\noutput\n102\n", Read());
+
+  // Full lines are never dropped.
+  printer.Print("a", LinePrinter::FULL);
+  printer.Print("b", LinePrinter::FULL);
+  printer.Flush();
+  EXPECT_EQ("a\nb\n", Read());
+}
+
+TEST_F(LinePrinterTest, PrintsLastLineAfterInterval) {
+  LinePrinter printer;
+  printer.set_refresh_interval_millis(10);
+
+  printer.Print("1", LinePrinter::ELIDE);
+  printer.Flush();
+  printer.Print("2", LinePrinter::ELIDE);
+  printer.Print("3", LinePrinter::ELIDE);
+
+  // The writer prints the pending line on its own once the interval is up.
+  std::string output = Read();
+  for (int i = 0; i < 200 && output != "1\n3\n"; ++i) {
+    usleep(10 * 1000);
+    output += Read();
+  }
+  EXPECT_EQ("1\n3\n", output);
+}
+
+TEST_F(LinePrinterTest, SmartTerminalOverprints) {
+  LinePrinter printer;
+  printer.set_smart_terminal(true);
+  printer.set_refresh_interval_millis(60 * 1000);
+
+  printer.Print("1", LinePrinter::ELIDE);
+  printer.Flush();
+  printer.Print("2", LinePrinter::ELIDE);
+  printer.Print("3", LinePrinter::ELIDE);
+  printer.PrintOnNewLine("output\n");
+  printer.Flush();
+  EXPECT_EQ("\r1\x1B[K\r3\x1B[K\noutput\n", Read());
+}
+
+#endif  // !_WIN32
@@ -0,0 +1,162 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+#ifndef _WIN32
+namespace {
+
+/// Where the thread reading a mapping goes back to if touching it raises
+/// SIGBUS, or null when it isn't reading one.
+thread_local sigjmp_buf* bus_error_jump = nullptr;
+
+void OnBusError(int /*signo*/) {
+  if (bus_error_jump)
+    siglongjmp(*bus_error_jump, 1);
+  // Not from reading a mapping: die of it as if there were no handler.
+  signal(SIGBUS, SIG_DFL);
+  raise(SIGBUS);
+}
+
+void HandleBusErrors() {
+  static const bool handled = [] {
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = OnBusError;
+    sigemptyset(&act.sa_mask);
+    return sigaction(SIGBUS, &act, nullptr) == 0;
+  }();
+  (void)handled;
+}
+
+}  // namespace
+#endif
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+void MappedFile::Close() {
+#ifndef _WIN32
+  if (mapping_)
+    munmap(mapping_, size_);
+#endif
+  mapping_ = nullptr;
+  buffer_.clear();
+  data_ = "";
+  size_ = 0;
+}
+
+bool MappedFile::Read(
+    const std::function<void(std::string_view)>& fn) const {
+#ifndef _WIN32
+  if (mapping_) {
+    HandleBusErrors();
+    sigjmp_buf jump;
+    sigjmp_buf* const outer_jump = bus_error_jump;
+    if (sigsetjmp(jump, 1)) {
+      bus_error_jump = outer_jump;
+      return false;
+    }
+    bus_error_jump = &jump;
+    fn(contents());
+    bus_error_jump = outer_jump;
+    return true;
+  }
+#endif
+  fn(contents());
+  return true;
+}
+
+#ifdef _WIN32
+int MappedFile::Open(const std::string& path, std::string* err) {
+  // Windows keeps reading files through, with sequential scan hints.
+  Close();
+  int ret = ::ReadFile(path, &buffer_, err);
+  if (ret < 0)
+    return ret;
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  return 0;
+}
+#else
+int MappedFile::Open(const std::string& path, std::string* err) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    err->assign(strerror(errno));
+    return -errno;
+  }
+  struct stat st;
+  int ret = 0;
+  if (fstat(fd, &st) < 0) {
+    err->assign(strerror(errno));
+    ret = -errno;
+  } else {
+    ret = Open(fd, st, err);
+  }
+  close(fd);
+  return ret;
+}
+
+int MappedFile::Open(int fd, const struct stat& st, std::string* err) {
+  Close();
+
+  if (S_ISREG(st.st_mode) && (size_t)st.st_size >= kMapThreshold) {
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      // The contents are typically read once, from start to end: have the
+      // kernel read ahead aggressively and drop pages behind.
+      madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+      mapping_ = mapping;
+      data_ = static_cast<const char*>(mapping);
+      size_ = st.st_size;
+      return 0;
+    }
+    // Some file systems can't map files; read those through.
+  }
+
+  if (S_ISREG(st.st_mode))
+    buffer_.reserve(st.st_size);
+  char buf[64 << 10];
+  for (;;) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len == 0)
+      break;
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      err->assign(strerror(errno));
+      buffer_.clear();
+      return -errno;
+    }
+    buffer_.append(buf, len);
+  }
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  return 0;
+}
+#endif  // _WIN32
@@ -0,0 +1,79 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MAPPED_FILE_H_
+#define NINJA_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#ifndef _WIN32
+struct stat;
+#endif
+
+/// The read-only contents of a whole file.
+///
+/// Large regular files are mapped in memory, so that reading them through
+/// doesn't copy them to the heap first.  Smaller files, and files which
+/// can't be mapped such as pipes, are read into a buffer instead, which is
+/// cheaper than setting a mapping up.
+///
+/// A mapped file truncated by another process while it's read raises
+/// SIGBUS on the pages past its new end: read files which may be written
+/// meanwhile through Read(), which survives that.
+struct MappedFile {
+  MappedFile() = default;
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  /// Read |path|, releasing what was read before.
+  /// Returns -errno and fills in \a err on error.
+  int Open(const std::string& path, std::string* err);
+
+#ifndef _WIN32
+  /// Read the file open as |fd|, whose fstat() is |st|.  The descriptor
+  /// remains the caller's and may be closed right after.
+  int Open(int fd, const struct stat& st, std::string* err);
+#endif
+
+  /// Release the contents.
+  void Close();
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  std::string_view contents() const { return std::string_view(data_, size_); }
+
+  /// Call |fn| with the contents.  Returns false if it was cut short
+  /// because the file was truncated while mapped.  |fn| is left without
+  /// unwinding then, so it mustn't own anything needing to be destroyed.
+  bool Read(const std::function<void(std::string_view)>& fn) const;
+
+  /// Whether the contents are mapped rather than read into a buffer.
+  bool mapped() const { return mapping_ != nullptr; }
+
+  /// Files at least this large are mapped.
+  static const size_t kMapThreshold = 256 << 10;
+
+ private:
+  const char* data_{ "" };
+  size_t size_{ 0 };
+  void* mapping_{ nullptr };
+  std::string buffer_;
+};
+
+#endif  // NINJA_MAPPED_FILE_H_
@@ -0,0 +1,119 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <cstdio>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "test.h"
+
+namespace {
+
+struct MappedFileTest : public testing::Test {
+  void SetUp() override { temp_dir_.CreateAndEnter("Ninja-MappedFileTest"); }
+  void TearDown() override { temp_dir_.Cleanup(); }
+
+  static bool Write(const char* path, const std::string& contents) {
+    FILE* f = fopen(path, "wb");
+    if (!f)
+      return false;
+    bool ok = fwrite(contents.data(), 1, contents.size(), f) == contents.size();
+    return fclose(f) == 0 && ok;
+  }
+
+  ScopedTempDir temp_dir_;
+};
+
+TEST_F(MappedFileTest, Small) {
+  ASSERT_TRUE(Write("small", "contents"));
+  MappedFile file;
+  std::string err;
+  EXPECT_EQ(0, file.Open("small", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ("contents", file.contents());
+  EXPECT_FALSE(file.mapped());
+}
+
+TEST_F(MappedFileTest, Empty) {
+  ASSERT_TRUE(Write("empty", ""));
+  MappedFile file;
+  std::string err;
+  EXPECT_EQ(0, file.Open("empty", &err));
+  EXPECT_EQ(0u, file.size());
+  EXPECT_TRUE(file.data() != nullptr);
+}
+
+TEST_F(MappedFileTest, Large) {
+  std::string contents;
+  for (size_t i = 0; contents.size() < MappedFile::kMapThreshold + 123; ++i)
+    contents += std::to_string(i) + '\n';
+  ASSERT_TRUE(Write("large", contents));
+
+  MappedFile file;
+  std::string err;
+  EXPECT_EQ(0, file.Open("large", &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(file.contents() == contents);
+#ifndef _WIN32
+  EXPECT_TRUE(file.mapped());
+#endif
+
+  // Opening another file releases the first one.
+  ASSERT_TRUE(Write("small", "contents"));
+  EXPECT_EQ(0, file.Open("small", &err));
+  EXPECT_EQ("contents", file.contents());
+  EXPECT_FALSE(file.mapped());
+
+  file.Close();
+  EXPECT_EQ(0u, file.size());
+}
+
+#ifndef _WIN32
+TEST_F(MappedFileTest, TruncatedWhileRead) {
+  ASSERT_TRUE(Write("large", std::string(2 * MappedFile::kMapThreshold, 'x')));
+  MappedFile file;
+  std::string err;
+  ASSERT_EQ(0, file.Open("large", &err));
+  ASSERT_TRUE(file.mapped());
+
+  size_t xs = 0;
+  auto count_xs = [&xs](std::string_view data) {
+    xs = 0;
+    for (char c : data)
+      xs += c == 'x';
+  };
+  EXPECT_TRUE(file.Read(count_xs));
+  EXPECT_EQ(2 * MappedFile::kMapThreshold, xs);
+
+  // Touching the pages which no longer exist is cut short, rather than
+  // killing the process.
+  ASSERT_EQ(0, truncate("large", MappedFile::kMapThreshold / 2));
+  EXPECT_FALSE(file.Read(count_xs));
+  EXPECT_FALSE(file.Read(count_xs));
+}
+#endif
+
+TEST_F(MappedFileTest, Missing) {
+  MappedFile file;
+  std::string err;
+  EXPECT_EQ(-ENOENT, file.Open("nosuchfile", &err));
+  EXPECT_NE("", err);
+  EXPECT_EQ(0u, file.size());
+}
+
+}  // anonymous namespace
@@ -90,13 +90,13 @@ ScopedMetric::~ScopedMetric() {
 Metric* Metrics::NewMetric(const std::string& name) {
   auto* metric = new Metric;
   metric->name = name;
-  metric->count = 0;
-  metric->sum = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
   metrics_.push_back(metric);
   return metric;
 }
 
 void Metrics::Report() {
+  std::lock_guard<std::mutex> lock(mutex_);
   int width = 0;
   for (auto metric : metrics_) {
     width = std::max((int)(metric->name.size()), width);
@@ -108,7 +108,7 @@ void Metrics::Report() {
     double total = metric->sum / (double)1000;
     double avg = metric->sum / (double)metric->count;
     printf("%-*s\t%-6d\t%-8.1f\t%.1f\n", width, metric->name.c_str(),
-           metric->count, avg, total);
+           metric->count.load(), avg, total);
   }
 }
 
@@ -15,6 +15,8 @@
 #ifndef NINJA_METRICS_H_
 #define NINJA_METRICS_H_
 
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -25,12 +27,13 @@
 /// various actions.  To use, see METRIC_RECORD below.
 
 /// A single metrics we're tracking, like "depfile load time".
+/// Code paths running on several threads may record it at once.
 struct Metric {
   std::string name;
   /// Number of times we've hit the code path.
-  int count;
+  std::atomic<int> count{ 0 };
   /// Total time (in micros) we've spent on the code path.
-  int64_t sum;
+  std::atomic<int64_t> sum{ 0 };
 };
 
 
@@ -56,6 +59,8 @@ struct Metrics {
 
 private:
   std::vector<Metric*> metrics_;
+  /// Protects metrics_ from code paths hit for the first time at once.
+  std::mutex mutex_;
 };
 
 /// Get the current time as relative to some epoch.
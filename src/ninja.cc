@@ -12,11 +12,15 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <cerrno>
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <utility>
 
 #ifdef _WIN32
 #include <direct.h>
@@ -41,12 +45,14 @@
 #include "disk_interface.h"
 #include "graph.h"
 #include "graphviz.h"
+#include "hash_cache.h"
 #include "host_parser.h"
 #include "manifest_parser.h"
 #include "metrics.h"
 #include "state.h"
 #include "util.h"
 #include "version.h"
+#include "watcher.h"
 
 #ifdef _MSC_VER
 // Defined in msvc_helper_main-win32.cc.
@@ -78,6 +84,9 @@ struct Options {
   bool phony_cycle_should_err;
 
   const char* hosts_file;
+
+  /// Whether to trust the mtimes kept by a running 'ninja -t watch'.
+  bool use_watcher;
 };
 
 /// The Ninja main() loads up a series of data structures; various tools need
@@ -103,6 +112,7 @@ struct NinjaMain : public BuildLogUser {
 
   BuildLog build_log_;
   DepsLog deps_log_;
+  HashCache hash_cache_;
 
   /// The type of functions that are the entry points to tools (subcommands).
   typedef int (NinjaMain::*ToolFunc)(const Options*, int, char**);
@@ -128,8 +138,10 @@ struct NinjaMain : public BuildLogUser {
   int ToolCompilationDatabase(const Options* options, int argc, char* argv[]);
   int ToolRecompact(const Options* options, int argc, char* argv[]);
   int ToolRestat(const Options* options, int argc, char* argv[]);
+  int ToolResources(const Options* options, int argc, char* argv[]);
   int ToolUrtle(const Options* options, int argc, char** argv);
   int ToolRules(const Options* options, int argc, char* argv[]);
+  int ToolWatch(const Options* options, int argc, char* argv[]);
 
   /// Open the build log.
   /// @return LOAD_ERROR on error.
@@ -139,10 +151,18 @@ struct NinjaMain : public BuildLogUser {
   /// @return LOAD_ERROR on error.
   bool OpenDepsLog(bool recompact_only = false);
 
+  /// Open the hash cache: load it, then open for writing, and let
+  /// disk_interface_ use it.
+  /// @return false on error.
+  bool OpenHashCache(bool recompact_only = false);
+
   /// Ensure the build directory exists, creating it if necessary.
   /// @return false on error.
   bool EnsureBuildDirExists();
 
+  /// Path of the socket on which a watcher of the build's files listens.
+  std::string WatcherSocketPath() const;
+
   /// Rebuild the manifest, if necessary.
   /// Fills in \a err on error.
   /// @return true if the manifest was rebuilt.
@@ -150,7 +170,7 @@ struct NinjaMain : public BuildLogUser {
 
   /// Build the targets listed on the command line.
   /// @return an exit code.
-  int RunBuild(int argc, char** argv);
+  int RunBuild(int argc, char** argv, const Options* options);
 
   /// Dump the output requested by '-d stats'.
   void DumpMetrics();
@@ -220,7 +240,15 @@ void Usage(const BuildConfig& config) {
       "this system]\n"
       "  -k N     keep going until N jobs fail (0 means infinity) [default=1]\n"
       "  -l N     do not start new jobs if the load average is greater than N\n"
+      "  --max-memory SIZE\n"
+      "           do not start new jobs if the memory they used last time\n"
+      "           would exceed SIZE in total, with an optional K, M or G\n"
+      "           suffix, or the memory available if SIZE is 'available'\n"
+      "           (0 means infinity) [default=0]\n"
       "  -n       dry run (don't run commands but act like they succeeded)\n"
+      "  --watched\n"
+      "           use the mtimes kept by 'ninja -t watch' rather than\n"
+      "           stat'ing the files (see manual for what it can miss)\n"
       "\n"
       "  -d MODE  enable debugging (use '-d list' to list modes)\n"
       "  -t TOOL  run a subtool (use '-t list' to list subtools)\n"
@@ -850,7 +878,8 @@ int NinjaMain::ToolRecompact(const Options* /*options*/, int /*argc*/,
     return 1;
 
   if (OpenBuildLog(/*recompact_only=*/true) == LOAD_ERROR ||
-      OpenDepsLog(/*recompact_only=*/true) == LOAD_ERROR)
+      OpenDepsLog(/*recompact_only=*/true) == LOAD_ERROR ||
+      !OpenHashCache(/*recompact_only=*/true))
     return 1;
 
   return 0;
@@ -914,6 +943,129 @@ int NinjaMain::ToolRestat(const Options* /*options*/, int argc, char* argv[]) {
   return EXIT_SUCCESS;
 }
 
+int NinjaMain::ToolResources(const Options* /*options*/, int argc,
+                             char* argv[]) {
+  // The resources tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "resources"
+  argc++;
+  argv--;
+
+  enum { SORT_OUTPUT, SORT_WALL, SORT_CPU, SORT_RSS, SORT_IO } sort_key =
+      SORT_OUTPUT;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("s:h"))) != -1) {
+    const std::string key = opt == 's' ? optarg : "";
+    if (key == "wall") {
+      sort_key = SORT_WALL;
+    } else if (key == "cpu") {
+      sort_key = SORT_CPU;
+    } else if (key == "rss") {
+      sort_key = SORT_RSS;
+    } else if (key == "io") {
+      sort_key = SORT_IO;
+    } else {
+      printf(
+          "usage: ninja -t resources [-s KEY] [outputs]\n"
+          "\n"
+          "show the resources used by the commands that last built the\n"
+          "outputs\n"
+          "\n"
+          "options:\n"
+          "  -s KEY  sort by KEY, largest first: wall (time), cpu (user and\n"
+          "          system time), rss (peak memory) or io (blocks read and\n"
+          "          written) [default=sort by output]\n");
+      return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  std::string log_path = ".ninja_log";
+  if (!build_dir_.empty())
+    log_path = build_dir_ + "/" + log_path;
+
+  std::string err;
+  const LoadStatus status = build_log_.Load(log_path, &err);
+  if (status == LOAD_ERROR) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return EXIT_FAILURE;
+  }
+  if (!err.empty()) {
+    // Hack: Load() can return a warning via err by returning LOAD_SUCCESS.
+    Warning("%s", err.c_str());
+    err.clear();
+  }
+
+  std::vector<const BuildLog::LogEntry*> entries;
+  if (argc == 0) {
+    for (const auto& entry : build_log_.entries())
+      entries.push_back(entry.second);
+  } else {
+    for (int i = 0; i < argc; ++i) {
+      if (const BuildLog::LogEntry* entry = build_log_.LookupByOutput(argv[i]))
+        entries.push_back(entry);
+      else
+        Warning("'%s' isn't in the build log", argv[i]);
+    }
+  }
+
+  auto sort_value = [sort_key](const BuildLog::LogEntry* entry) -> int64_t {
+    const ResourceUsage& usage = entry->usage;
+    switch (sort_key) {
+    case SORT_WALL:
+      return entry->end_time - entry->start_time;
+    case SORT_CPU:
+      return usage.user_time_ms + usage.system_time_ms;
+    case SORT_RSS:
+      return usage.max_rss_kb;
+    case SORT_IO:
+      return usage.blocks_read + usage.blocks_written;
+    default:
+      return 0;
+    }
+  };
+  std::sort(entries.begin(), entries.end(),
+            [&](const BuildLog::LogEntry* a, const BuildLog::LogEntry* b) {
+              const int64_t value_a = sort_value(a);
+              const int64_t value_b = sort_value(b);
+              if (value_a != value_b)
+                return value_a > value_b;
+              return a->output < b->output;
+            });
+
+  printf("%9s %9s %9s %10s %10s %10s  %s\n", "wall(ms)", "user(ms)",
+         "sys(ms)", "rss(KiB)", "blk read", "blk write", "output");
+  for (const BuildLog::LogEntry* entry : entries) {
+    const ResourceUsage& usage = entry->usage;
+    printf("%9d %9" PRId64 " %9" PRId64 " %10" PRId64 " %10" PRId64
+           " %10" PRId64 "  %s\n",
+           entry->end_time - entry->start_time, usage.user_time_ms,
+           usage.system_time_ms, usage.max_rss_kb, usage.blocks_read,
+           usage.blocks_written, entry->output.c_str());
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int NinjaMain::ToolWatch(const Options* /*options*/, int /*argc*/,
+                         char* /*argv*/[]) {
+  Watcher watcher(state_);
+  std::string err;
+  if (!watcher.Start(WatcherSocketPath(), &err)) {
+    Error("%s", err.c_str());
+    return EXIT_FAILURE;
+  }
+  printf("ninja: watching %d files, listening on %s\n",
+         (int)watcher.mtimes().size(), WatcherSocketPath().c_str());
+  fflush(stdout);
+  if (!watcher.Run(&err)) {
+    Error("%s", err.c_str());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
 int NinjaMain::ToolUrtle(const Options* /*options*/, int /*argc*/,
                          char** /*argv*/) {
   // RLE encoded.
@@ -969,10 +1121,15 @@ const Tool* ChooseTool(const std::string& tool_name) {
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRecompact },
     { "restat", "restats all outputs in the build log", Tool::RUN_AFTER_FLAGS,
       &NinjaMain::ToolRestat },
+    { "resources", "show the resources the commands used when they last ran",
+      Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolResources },
     { "rules", "list all rules", Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRules },
     { "cleandead",
       "clean built files that are no longer produced by the manifest",
       Tool::RUN_AFTER_LOGS, &NinjaMain::ToolCleanDead },
+    { "watch",
+      "keep the mtimes of the files in memory for builds to use (Linux only)",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolWatch },
     { "urtle", nullptr, Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolUrtle },
     { nullptr, nullptr, Tool::RUN_AFTER_FLAGS, nullptr }
   };
@@ -1162,6 +1319,43 @@ bool NinjaMain::OpenDepsLog(bool recompact_only) {
   return true;
 }
 
+bool NinjaMain::OpenHashCache(bool recompact_only) {
+  std::string path = ".ninja_hashes";
+  if (!build_dir_.empty())
+    path = build_dir_ + "/" + path;
+
+  std::string err;
+  const LoadStatus status = hash_cache_.Load(path, &err);
+  if (status == LOAD_ERROR) {
+    Error("loading hash cache %s: %s", path.c_str(), err.c_str());
+    return false;
+  }
+  if (!err.empty()) {
+    // Hack: Load() can return a warning via err by returning LOAD_SUCCESS.
+    Warning("%s", err.c_str());
+    err.clear();
+  }
+
+  if (recompact_only) {
+    if (status == LOAD_NOT_FOUND)
+      return true;
+    bool success = hash_cache_.Recompact(path, &err);
+    if (!success)
+      Error("failed recompaction: %s", err.c_str());
+    return success;
+  }
+
+  if (!config_.dry_run) {
+    if (!hash_cache_.OpenForWrite(path, &err)) {
+      Error("opening hash cache: %s", err.c_str());
+      return false;
+    }
+  }
+
+  disk_interface_.SetHashCache(&hash_cache_);
+  return true;
+}
+
 void NinjaMain::DumpMetrics() {
   g_metrics->Report();
 
@@ -1172,6 +1366,12 @@ void NinjaMain::DumpMetrics() {
          count / (double)buckets, count, buckets);
 }
 
+std::string NinjaMain::WatcherSocketPath() const {
+  if (build_dir_.empty())
+    return kWatcherSocketName;
+  return build_dir_ + "/" + kWatcherSocketName;
+}
+
 bool NinjaMain::EnsureBuildDirExists() {
   build_dir_ = state_.bindings_.LookupVariable("builddir");
   if (!build_dir_.empty() && !config_.dry_run) {
@@ -1184,7 +1384,7 @@ bool NinjaMain::EnsureBuildDirExists() {
   return true;
 }
 
-int NinjaMain::RunBuild(int argc, char** argv) {
+int NinjaMain::RunBuild(int argc, char** argv, const Options* options) {
   std::string err;
   std::vector<Node*> targets;
   if (!CollectTargetsFromArgs(argc, argv, &targets, &err)) {
@@ -1193,8 +1393,15 @@ int NinjaMain::RunBuild(int argc, char** argv) {
   }
 
   disk_interface_.AllowStatCache(g_experimental_statcache);
+  if (g_experimental_statcache && options->use_watcher) {
+    // A watcher, if one runs, already knows the mtimes of most files.
+    std::unordered_map<std::string, TimeStamp> mtimes;
+    if (LoadWatchedMtimes(WatcherSocketPath(), &mtimes))
+      disk_interface_.SetKnownMtimes(std::move(mtimes));
+  }
 
   Builder builder(&state_, config_, &build_log_, &deps_log_, &disk_interface_);
+  builder.StatAhead(targets);
   for (auto& target : targets) {
     if (!builder.AddTarget(target, &err)) {
       if (!err.empty()) {
@@ -1253,12 +1460,18 @@ int ExceptionFilter(unsigned int code, struct _EXCEPTION_POINTERS* ep) {
 /// Returns an exit code, or -1 if Ninja should continue.
 int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
   config->parallelism = GuessParallelism();
+  // The disk work around commands is mostly waiting on the disk; a few
+  // threads keep up with many running commands.  Stat'ing the graph before
+  // a build, though, goes as fast as there are processors to do it.
+  config->io_threads = std::max(4, GetProcessorCount());
 
-  enum { OPT_VERSION = 1, OPT_DIST = 2 };
+  enum { OPT_VERSION = 1, OPT_DIST = 2, OPT_MAX_MEMORY = 3, OPT_WATCHED = 4 };
   const option kLongOptions[] = {
     { "help", no_argument, nullptr, 'h' },
     { "version", no_argument, nullptr, OPT_VERSION },
     { "dist", required_argument, nullptr, OPT_DIST },
+    { "max-memory", required_argument, nullptr, OPT_MAX_MEMORY },
+    { "watched", no_argument, nullptr, OPT_WATCHED },
     { "verbose", no_argument, nullptr, 'v' },
     { nullptr, 0, nullptr, 0 }
   };
@@ -1330,6 +1543,43 @@ int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
     case OPT_DIST:
       options->hosts_file = optarg;
       break;
+    case OPT_WATCHED:
+      options->use_watcher = true;
+      break;
+    case OPT_MAX_MEMORY: {
+      if (strcmp(optarg, "available") == 0) {
+        config->max_memory_kb = -1;
+        break;
+      }
+      char* end;
+      errno = 0;
+      int64_t bytes = strtoll(optarg, &end, 10);
+      if (end == optarg || bytes < 0 || errno == ERANGE)
+        Fatal("invalid --max-memory parameter");
+      int shift = 0;
+      switch (*end) {
+      case 'G':
+      case 'g':
+        shift = 30;
+        ++end;
+        break;
+      case 'M':
+      case 'm':
+        shift = 20;
+        ++end;
+        break;
+      case 'K':
+      case 'k':
+        shift = 10;
+        ++end;
+        break;
+      }
+      if (*end != 0 || bytes > (std::numeric_limits<int64_t>::max() >> shift))
+        Fatal("invalid --max-memory parameter");
+      bytes <<= shift;
+      config->max_memory_kb = bytes / 1024 + (bytes % 1024 != 0);
+      break;
+    }
     case 'h':
     default:
       Usage(*config);
@@ -1407,7 +1657,13 @@ NORETURN void real_main(int argc, char** argv) {
     if (!ninja.EnsureBuildDirExists())
       exit(1);
 
-    if (!ninja.OpenBuildLog() || !ninja.OpenDepsLog())
+    // Keep the whole output of overly verbose commands along with the logs.
+    config.output_spill_dir = ".ninja_output";
+    if (!ninja.build_dir_.empty())
+      config.output_spill_dir = ninja.build_dir_ + "/.ninja_output";
+
+    if (!ninja.OpenBuildLog() || !ninja.OpenDepsLog() ||
+        !ninja.OpenHashCache())
       exit(1);
 
     if (options.tool && options.tool->when == Tool::RUN_AFTER_LOGS)
@@ -1426,7 +1682,7 @@ NORETURN void real_main(int argc, char** argv) {
       exit(1);
     }
 
-    int result = ninja.RunBuild(argc, argv);
+    int result = ninja.RunBuild(argc, argv, &options);
     if (g_metrics)
       ninja.DumpMetrics();
     exit(result);
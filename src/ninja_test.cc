@@ -154,6 +154,8 @@ int main(int argc, char** argv) {
     printer.Print(
         StringPrintf("[%d/%d] %s", tests_started, nactivetests, tests[i].name),
         LinePrinter::ELIDE);
+    // Tests may redirect stdout, so have the name written out beforehand.
+    printer.Flush();
     test->SetUp();
     test->Run();
     test->TearDown();
@@ -0,0 +1,133 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "build.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "util.h"
+
+/// Builds a graph shaped like a large C++ project: |num_objects| objects
+/// compiled from their own source, linked into libraries of
+/// |objects_per_lib| objects each, all depended upon by a phony "all".
+bool CreateGraph(State* state, int num_objects, int objects_per_lib,
+                 std::string* err) {
+  std::string manifest =
+      "rule cc\n"
+      "  command = cc -c $in -o $out\n"
+      "rule ar\n"
+      "  command = ar rcs $out $in\n";
+  std::string all = "build all: phony";
+  char buf[80];
+  for (int i = 0; i < num_objects; ++i) {
+    sprintf(buf, "build obj/%d.o: cc src/%d.cc\n", i, i);
+    manifest += buf;
+  }
+  for (int lib = 0; lib * objects_per_lib < num_objects; ++lib) {
+    sprintf(buf, "build lib/%d.a: ar", lib);
+    manifest += buf;
+    for (int i = lib * objects_per_lib;
+         i < num_objects && i < (lib + 1) * objects_per_lib; ++i) {
+      sprintf(buf, " obj/%d.o", i);
+      manifest += buf;
+    }
+    manifest += "\n";
+    sprintf(buf, " lib/%d.a", lib);
+    all += buf;
+  }
+  manifest += all + "\n";
+
+  ManifestParser parser(state, nullptr);
+  return parser.ParseTest(manifest, err);
+}
+
+/// Plans and "runs" a build of every edge of |state|.  Returns the number
+/// of edges that were started, or -1 on error.
+int RunPlan(State* state, std::string* err) {
+  // Every output needs building; the sources are up to date.
+  state->Reset();
+  for (Edge* edge : state->edges_) {
+    for (Node* output : edge->outputs_)
+      output->MarkDirty();
+  }
+
+  Plan plan;
+  if (!plan.AddTarget(state->LookupNode("all"), err))
+    return -1;
+  plan.PrepareQueue();
+
+  int started = 0;
+  while (Edge* edge = plan.FindWork()) {
+    ++started;
+    if (!plan.EdgeFinished(edge, Plan::kEdgeSucceeded, err))
+      return -1;
+  }
+  if (plan.more_to_do()) {
+    *err = "plan finished with work left to do";
+    return -1;
+  }
+  return started;
+}
+
+int main(int argc, char** argv) {
+  int num_objects = 400000;
+  if (argc > 1)
+    num_objects = atoi(argv[1]);
+  if (num_objects <= 0) {
+    fprintf(stderr, "usage: plan_perftest [number of objects]\n");
+    return 1;
+  }
+
+  std::string err;
+  State state;
+  if (!CreateGraph(&state, num_objects, 100, &err)) {
+    fprintf(stderr, "Failed to create graph: %s\n", err.c_str());
+    return 1;
+  }
+  printf("%d edges\n", (int)state.edges_.size());
+
+  std::vector<int> times;
+  const int kNumRepetitions = 5;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    int64_t start = GetTimeMillis();
+    int started = RunPlan(&state, &err);
+    if (started < 0) {
+      fprintf(stderr, "Failed to run plan: %s\n", err.c_str());
+      return 1;
+    }
+    int delta = (int)(GetTimeMillis() - start);
+    printf("%d edges planned and finished in %dms\n", started, delta);
+    times.push_back(delta);
+  }
+
+  int min = times[0];
+  int max = times[0];
+  float total = 0;
+  for (int time : times) {
+    total += time;
+    if (time < min)
+      min = time;
+    else if (time > max)
+      max = time;
+  }
+
+  printf("min %dms  max %dms  avg %.1fms\n", min, max, total / times.size());
+
+  return 0;
+}
@@ -0,0 +1,41 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_RESOURCE_USAGE_H_
+#define NINJA_RESOURCE_USAGE_H_
+
+#include <cstdint>
+
+/// Resources used by a finished command.  Values are 0 when they weren't
+/// measured, e.g. on platforms that don't report them.
+struct ResourceUsage {
+  /// Peak resident set size of the command, in KiB.
+  int64_t max_rss_kb{ 0 };
+
+  /// CPU time spent in user and in system mode, in milliseconds.
+  int64_t user_time_ms{ 0 };
+  int64_t system_time_ms{ 0 };
+
+  /// Number of blocks read from and written to file systems.
+  int64_t blocks_read{ 0 };
+  int64_t blocks_written{ 0 };
+
+  bool operator==(const ResourceUsage& o) const {
+    return max_rss_kb == o.max_rss_kb && user_time_ms == o.user_time_ms &&
+           system_time_ms == o.system_time_ms &&
+           blocks_read == o.blocks_read && blocks_written == o.blocks_written;
+  }
+};
+
+#endif  // NINJA_RESOURCE_USAGE_H_
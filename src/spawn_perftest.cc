@@ -0,0 +1,114 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+#include "subprocess.h"
+
+namespace {
+
+#ifdef _WIN32
+const char kCommand[] = "cmd /c exit 0";
+#else
+const char kCommand[] = "true";
+#endif
+
+const int kNumSpawns = 200;
+
+/// Average time, in microseconds, to run |kCommand| to completion through a
+/// SubprocessSet, as the build does.
+double TimeSubprocess() {
+  SubprocessSet subprocs;
+  Stopwatch stopwatch;
+  stopwatch.Restart();
+  for (int i = 0; i < kNumSpawns; ++i) {
+    Subprocess* subproc = subprocs.Add(kCommand);
+    if (!subproc) {
+      fprintf(stderr, "failed to start '%s'\n", kCommand);
+      exit(1);
+    }
+    while (!subproc->Done())
+      subprocs.DoWork();
+    if (subproc->Finish() != ExitSuccess) {
+      fprintf(stderr, "'%s' failed\n", kCommand);
+      exit(1);
+    }
+    subprocs.NextFinished();
+    delete subproc;
+  }
+  return stopwatch.Elapsed() * 1e6 / kNumSpawns;
+}
+
+#ifndef _WIN32
+/// Average time, in microseconds, to fork() a child that exits right away
+/// and wait for it.  This is the cost posix_spawn() avoids by sharing the
+/// parent's memory with the child until it execs.
+double TimeFork() {
+  Stopwatch stopwatch;
+  stopwatch.Restart();
+  for (int i = 0; i < kNumSpawns; ++i) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(1);
+    }
+    if (pid == 0)
+      _exit(0);
+    waitpid(pid, nullptr, 0);
+  }
+  return stopwatch.Elapsed() * 1e6 / kNumSpawns;
+}
+#endif
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int max_rss_mb = 1024;
+  if (argc > 1)
+    max_rss_mb = atoi(argv[1]);
+  if (max_rss_mb <= 0) {
+    fprintf(stderr, "usage: spawn_perftest [largest parent RSS in MiB]\n");
+    return 1;
+  }
+
+  // Grow the memory the parent has touched, as a large State would, and
+  // check that the cost of each spawn doesn't grow with it.
+  std::vector<std::unique_ptr<char[]>> ballast;
+  int rss_mb = 0;
+  for (int target_mb = 0; target_mb <= max_rss_mb;
+       target_mb = target_mb ? target_mb * 2 : 64) {
+    for (; rss_mb < target_mb; ++rss_mb) {
+      ballast.emplace_back(new char[1 << 20]);
+      memset(ballast.back().get(), rss_mb, 1 << 20);
+    }
+
+    printf("parent RSS +%5d MiB: %7.1fus per spawn", rss_mb, TimeSubprocess());
+#ifndef _WIN32
+    printf(", %7.1fus per fork", TimeFork());
+#endif
+    printf("\n");
+  }
+
+  return 0;
+}
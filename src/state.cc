@@ -37,13 +37,13 @@ void Pool::DelayEdge(Edge* edge) {
   delayed_.insert(edge);
 }
 
-void Pool::RetrieveReadyEdges(std::set<Edge*>* ready_queue) {
+void Pool::RetrieveReadyEdges(EdgePriorityQueue* ready_queue) {
   auto it = delayed_.begin();
   while (it != delayed_.end()) {
     Edge* edge = *it;
     if (current_use_ + edge->weight() > depth_)
       break;
-    ready_queue->insert(edge);
+    ready_queue->push(edge);
     EdgeScheduled(*edge);
     ++it;
   }
@@ -65,7 +65,10 @@ bool Pool::WeightedEdgeCmp(const Edge* a, const Edge* b) {
   if (!b)
     return false;
   int weight_diff = a->weight() - b->weight();
-  return ((weight_diff < 0) || (weight_diff == 0 && a < b));
+  if (weight_diff != 0)
+    return weight_diff < 0;
+  // The most urgent edges come first.
+  return EdgePriorityLess()(b, a);
 }
 
 Pool State::kDefaultPool("", 0);
@@ -95,6 +98,7 @@ Edge* State::AddEdge(const Rule* rule) {
   edge->rule_ = rule;
   edge->pool_ = &State::kDefaultPool;
   edge->env_ = &bindings_;
+  edge->id_ = edges_.size();
   edges_.push_back(edge);
   return edge;
 }
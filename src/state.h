@@ -27,6 +27,7 @@
 #include "util.h"
 
 struct Edge;
+struct EdgePriorityQueue;
 struct Node;
 struct Rule;
 
@@ -63,8 +64,9 @@ struct Pool {
   /// adds the given edge to this Pool to be delayed.
   void DelayEdge(Edge* edge);
 
-  /// Pool will add zero or more edges to the ready_queue
-  void RetrieveReadyEdges(std::set<Edge*>* ready_queue);
+  /// Pool will add zero or more edges to the ready_queue, most urgent
+  /// first.
+  void RetrieveReadyEdges(EdgePriorityQueue* ready_queue);
 
   /// Dump the Pool and its edges (useful for debugging).
   void Dump() const;
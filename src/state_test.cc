@@ -44,4 +44,15 @@ TEST(State, Basic) {
   EXPECT_FALSE(state.GetNode("out", 0)->dirty());
 }
 
+TEST(State, EdgeIds) {
+  State state;
+  Rule* rule = new Rule("cat");
+  state.bindings_.AddRule(rule);
+
+  for (size_t i = 0; i < 3; ++i)
+    EXPECT_EQ(i, state.AddEdge(rule)->id_);
+  for (size_t i = 0; i < state.edges_.size(); ++i)
+    EXPECT_EQ(i, state.edges_[i]->id_);
+}
+
 }  // namespace
@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <spawn.h>
+#include <sys/resource.h>
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -26,16 +27,53 @@
 
 #include "subprocess.h"
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+
 extern char** environ;
 
 #include "util.h"
 
+namespace {
+
+/// Drains the read end of the wake-up pipe of a SubprocessSet.
+void DrainWakePipe(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0) {
+  }
+}
+
+#ifdef USE_EPOLL
+/// Tags the epoll events about a process exiting, as opposed to its output
+/// pipe being ready.  Subprocess pointers are aligned, so the bit is free.
+const uint64_t kProcessExitedTag = 1;
+
+/// Returns a pidfd for |pid|, or -1 if the kernel doesn't support them
+/// (they were added to Linux 5.3).
+int OpenPidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+  return -1;
+#endif
+}
+#endif  // USE_EPOLL
+
+}  // namespace
+
 Subprocess::Subprocess(bool use_console)
     : fd_(-1), pid_(-1), use_console_(use_console) {}
 
 Subprocess::~Subprocess() {
+  ReleaseBuffer();
   if (fd_ >= 0)
     close(fd_);
+#ifdef USE_EPOLL
+  if (pidfd_ >= 0)
+    close(pidfd_);
+#endif
   // Reap child if forgotten.
   if (pid_ != -1)
     Finish();
@@ -46,14 +84,23 @@ bool Subprocess::Start(SubprocessSet* set, const std::string& command) {
   if (pipe(output_pipe) < 0)
     Fatal("pipe: %s", strerror(errno));
   fd_ = output_pipe[0];
-#if !defined(USE_PPOLL)
-  // If available, we use ppoll in DoWork(); otherwise we use pselect
-  // and so must avoid overly-large FDs.
+#if !defined(USE_PPOLL) && !defined(USE_EPOLL)
+  // If available, we use epoll or ppoll in DoWork(); otherwise we use
+  // pselect and so must avoid overly-large FDs.
   if (fd_ >= static_cast<int>(FD_SETSIZE))
     Fatal("pipe: %s", strerror(EMFILE));
-#endif  // !USE_PPOLL
+#endif  // !USE_PPOLL && !USE_EPOLL
   SetCloseOnExec(fd_);
 
+#ifdef USE_EPOLL
+  // The registration lasts until fd_ is closed.
+  epoll_event event = {};
+  event.events = EPOLLIN | EPOLLPRI;
+  event.data.u64 = reinterpret_cast<uintptr_t>(this);
+  if (epoll_ctl(set->epoll_fd_, EPOLL_CTL_ADD, fd_, &event) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#endif  // USE_EPOLL
+
   posix_spawn_file_actions_t action;
   int err = posix_spawn_file_actions_init(&action);
   if (err != 0)
@@ -103,6 +150,10 @@ bool Subprocess::Start(SubprocessSet* set, const std::string& command) {
     // closed when the subprocess finishes, which then notifies ninja.
   }
 #ifdef POSIX_SPAWN_USEVFORK
+  // Have older glibc share our memory with the child until it execs, rather
+  // than copy our page tables, so that spawning stays cheap however large
+  // the build graph is.  Newer glibc (clone with CLONE_VM | CLONE_VFORK),
+  // musl and macOS always spawn this way.  See spawn_perftest.
   flags |= POSIX_SPAWN_USEVFORK;
 #endif
 
@@ -124,6 +175,22 @@ bool Subprocess::Start(SubprocessSet* set, const std::string& command) {
     Fatal("posix_spawn_file_actions_destroy: %s", strerror(err));
 
   close(output_pipe[1]);
+
+#ifdef USE_EPOLL
+  // Also watch the process itself, so that its exit is noticed even if
+  // processes it left running (e.g. daemons) keep the pipe open.  The pipe
+  // then has to be drained without blocking.
+  pidfd_ = OpenPidfd(pid_);
+  if (pidfd_ >= 0) {
+    if (fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK) < 0)
+      Fatal("fcntl: %s", strerror(errno));
+    event.events = EPOLLIN;
+    event.data.u64 = reinterpret_cast<uintptr_t>(this) | kProcessExitedTag;
+    if (epoll_ctl(set->epoll_fd_, EPOLL_CTL_ADD, pidfd_, &event) < 0)
+      Fatal("epoll_ctl: %s", strerror(errno));
+  }
+#endif  // USE_EPOLL
+
   return true;
 }
 
@@ -131,22 +198,63 @@ void Subprocess::OnPipeReady() {
   char buf[4 << 10];
   ssize_t len = read(fd_, buf, sizeof(buf));
   if (len > 0) {
-    buf_.append(buf, len);
+    AppendOutput(buf, len);
   } else {
-    if (len < 0)
+    if (len < 0) {
+      if (errno == EAGAIN)
+        return;
       Fatal("read: %s", strerror(errno));
+    }
     close(fd_);
     fd_ = -1;
+    FinishOutput();
+#ifdef USE_EPOLL
+    if (pidfd_ >= 0) {
+      close(pidfd_);
+      pidfd_ = -1;
+    }
+#endif
   }
 }
 
+#ifdef USE_EPOLL
+void Subprocess::OnProcessExited() {
+  // Everything the process wrote is in the pipe by now.  Collect it, but
+  // don't wait for the end of the pipe.
+  char buf[4 << 10];
+  ssize_t len;
+  while ((len = read(fd_, buf, sizeof(buf))) > 0)
+    AppendOutput(buf, len);
+  if (len < 0 && errno != EAGAIN)
+    Fatal("read: %s", strerror(errno));
+  close(fd_);
+  fd_ = -1;
+  FinishOutput();
+  close(pidfd_);
+  pidfd_ = -1;
+}
+#endif  // USE_EPOLL
+
 ExitStatus Subprocess::Finish() {
   assert(pid_ != -1);
   int status;
-  if (waitpid(pid_, &status, 0) < 0)
-    Fatal("waitpid(%d): %s", pid_, strerror(errno));
+  struct rusage usage;
+  if (wait4(pid_, &status, 0, &usage) < 0)
+    Fatal("wait4(%d): %s", pid_, strerror(errno));
   pid_ = -1;
 
+#ifdef __APPLE__
+  usage_.max_rss_kb = usage.ru_maxrss / 1024;  // Reported in bytes.
+#else
+  usage_.max_rss_kb = usage.ru_maxrss;
+#endif
+  usage_.user_time_ms =
+      usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000;
+  usage_.system_time_ms =
+      usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000;
+  usage_.blocks_read = usage.ru_inblock;
+  usage_.blocks_written = usage.ru_oublock;
+
   if (WIFEXITED(status)) {
     int exit = WEXITSTATUS(status);
     if (exit == 0)
@@ -206,6 +314,26 @@ SubprocessSet::SubprocessSet() {
     Fatal("sigaction: %s", strerror(errno));
   if (sigaction(SIGHUP, &act, &old_hup_act_) < 0)
     Fatal("sigaction: %s", strerror(errno));
+
+  if (pipe(wake_pipe_) < 0)
+    Fatal("pipe: %s", strerror(errno));
+  for (int fd : wake_pipe_) {
+    SetCloseOnExec(fd);
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+      Fatal("fcntl: %s", strerror(errno));
+  }
+
+#ifdef USE_EPOLL
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0)
+    Fatal("epoll_create1: %s", strerror(errno));
+  // Subprocess pointers are never null, so 0 identifies the wake-up pipe.
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = 0;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_pipe_[0], &event) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#endif
 }
 
 SubprocessSet::~SubprocessSet() {
@@ -219,22 +347,83 @@ SubprocessSet::~SubprocessSet() {
     Fatal("sigaction: %s", strerror(errno));
   if (sigprocmask(SIG_SETMASK, &old_mask_, nullptr) < 0)
     Fatal("sigprocmask: %s", strerror(errno));
+
+#ifdef USE_EPOLL
+  close(epoll_fd_);
+#endif
+  close(wake_pipe_[0]);
+  close(wake_pipe_[1]);
 }
 
-Subprocess* SubprocessSet::Add(const std::string& command, bool use_console) {
+Subprocess* SubprocessSet::Add(const std::string& command, bool use_console,
+                               const std::string& spill_path) {
   auto* subprocess = new Subprocess(use_console);
+  subprocess->UseBufferOf(this);
+  subprocess->spill_path_ = spill_path;
   if (!subprocess->Start(this, command)) {
     delete subprocess;
     return nullptr;
   }
+  subprocess->running_index_ = running_.size();
   running_.push_back(subprocess);
   return subprocess;
 }
 
-#ifdef USE_PPOLL
+void SubprocessSet::MoveToFinished(Subprocess* subproc) {
+  Subprocess* last = running_.back();
+  running_[subproc->running_index_] = last;
+  last->running_index_ = subproc->running_index_;
+  running_.pop_back();
+  finished_.push(subproc);
+}
+
+#if defined(USE_EPOLL)
+bool SubprocessSet::DoWork() {
+  epoll_event events[64];
+
+  interrupted_ = 0;
+  int ret = epoll_pwait(epoll_fd_, events, sizeof(events) / sizeof(events[0]),
+                        -1, &old_mask_);
+  if (ret == -1) {
+    if (errno != EINTR) {
+      perror("ninja: epoll_pwait");
+      return false;
+    }
+    return IsInterrupted();
+  }
+
+  HandlePendingInterruption();
+  if (IsInterrupted())
+    return true;
+
+  for (int i = 0; i < ret; ++i) {
+    const uint64_t data = events[i].data.u64;
+    if (data == 0) {
+      DrainWakePipe(wake_pipe_[0]);
+      woken_ = true;
+      continue;
+    }
+    auto* subproc = reinterpret_cast<Subprocess*>(data & ~kProcessExitedTag);
+    // Both the exit and the end of the pipe may be reported at once.
+    if (subproc->Done())
+      continue;
+    if (data & kProcessExitedTag)
+      subproc->OnProcessExited();
+    else
+      subproc->OnPipeReady();
+    if (subproc->Done())
+      MoveToFinished(subproc);
+  }
+
+  return IsInterrupted();
+}
+
+#elif defined(USE_PPOLL)
 bool SubprocessSet::DoWork() {
   std::vector<pollfd> fds;
-  nfds_t nfds = 0;
+  pollfd wake_pfd = { wake_pipe_[0], POLLIN, 0 };
+  fds.push_back(wake_pfd);
+  nfds_t nfds = 1;
 
   for (std::vector<Subprocess*>::iterator i = running_.begin();
        i != running_.end(); ++i) {
@@ -260,32 +449,41 @@ bool SubprocessSet::DoWork() {
   if (IsInterrupted())
     return true;
 
-  nfds_t cur_nfd = 0;
-  for (std::vector<Subprocess*>::iterator i = running_.begin();
-       i != running_.end();) {
-    int fd = (*i)->fd_;
-    if (fd < 0)
-      continue;
-    assert(fd == fds[cur_nfd].fd);
-    if (fds[cur_nfd++].revents) {
-      (*i)->OnPipeReady();
-      if ((*i)->Done()) {
-        finished_.push(*i);
-        i = running_.erase(i);
-        continue;
+  if (fds[0].revents) {
+    DrainWakePipe(wake_pipe_[0]);
+    woken_ = true;
+  }
+
+  // Finished subprocesses are moved out once all were looked at, as fds
+  // follows the order of running_.
+  nfds_t cur_nfd = 1;
+  size_t kept = 0;
+  for (Subprocess* subproc : running_) {
+    int fd = subproc->fd_;
+    if (fd >= 0) {
+      assert(fd == fds[cur_nfd].fd);
+      if (fds[cur_nfd++].revents) {
+        subproc->OnPipeReady();
+        if (subproc->Done()) {
+          finished_.push(subproc);
+          continue;
+        }
       }
     }
-    ++i;
+    subproc->running_index_ = kept;
+    running_[kept++] = subproc;
   }
+  running_.resize(kept);
 
   return IsInterrupted();
 }
 
-#else   // !defined(USE_PPOLL)
+#else   // !defined(USE_EPOLL) && !defined(USE_PPOLL)
 bool SubprocessSet::DoWork() {
   fd_set set;
-  int nfds = 0;
   FD_ZERO(&set);
+  FD_SET(wake_pipe_[0], &set);
+  int nfds = wake_pipe_[0] + 1;
 
   for (auto & i : running_) {
     int fd = i->fd_;
@@ -310,23 +508,35 @@ bool SubprocessSet::DoWork() {
   if (IsInterrupted())
     return true;
 
-  for (auto i = running_.begin();
-       i != running_.end();) {
-    int fd = (*i)->fd_;
+  if (FD_ISSET(wake_pipe_[0], &set)) {
+    DrainWakePipe(wake_pipe_[0]);
+    woken_ = true;
+  }
+
+  size_t kept = 0;
+  for (Subprocess* subproc : running_) {
+    int fd = subproc->fd_;
     if (fd >= 0 && FD_ISSET(fd, &set)) {
-      (*i)->OnPipeReady();
-      if ((*i)->Done()) {
-        finished_.push(*i);
-        i = running_.erase(i);
+      subproc->OnPipeReady();
+      if (subproc->Done()) {
+        finished_.push(subproc);
         continue;
       }
     }
-    ++i;
+    subproc->running_index_ = kept;
+    running_[kept++] = subproc;
   }
+  running_.resize(kept);
 
   return IsInterrupted();
 }
-#endif  // !defined(USE_PPOLL)
+#endif  // !defined(USE_EPOLL) && !defined(USE_PPOLL)
+
+void SubprocessSet::Wake() {
+  // A full pipe already has a wake-up pending.
+  if (write(wake_pipe_[1], "", 1) < 0 && errno != EAGAIN)
+    Fatal("write: %s", strerror(errno));
+}
 
 Subprocess* SubprocessSet::NextFinished() {
   if (finished_.empty())
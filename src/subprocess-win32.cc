@@ -25,6 +25,7 @@ Subprocess::Subprocess(bool use_console)
       use_console_(use_console) {}
 
 Subprocess::~Subprocess() {
+  ReleaseBuffer();
   if (pipe_) {
     if (!CloseHandle(pipe_))
       Win32Fatal("CloseHandle");
@@ -146,13 +147,14 @@ void Subprocess::OnPipeReady() {
     if (GetLastError() == ERROR_BROKEN_PIPE) {
       CloseHandle(pipe_);
       pipe_ = NULL;
+      FinishOutput();
       return;
     }
     Win32Fatal("GetOverlappedResult");
   }
 
   if (is_reading_ && bytes)
-    buf_.append(overlapped_buf_, bytes);
+    AppendOutput(overlapped_buf_, bytes);
 
   memset(&overlapped_, 0, sizeof(overlapped_));
   is_reading_ = true;
@@ -161,6 +163,7 @@ void Subprocess::OnPipeReady() {
     if (GetLastError() == ERROR_BROKEN_PIPE) {
       CloseHandle(pipe_);
       pipe_ = NULL;
+      FinishOutput();
       return;
     }
     if (GetLastError() != ERROR_IO_PENDING)
@@ -224,8 +227,11 @@ BOOL WINAPI SubprocessSet::NotifyInterrupted(DWORD dwCtrlType) {
   return FALSE;
 }
 
-Subprocess* SubprocessSet::Add(const std::string& command, bool use_console) {
+Subprocess* SubprocessSet::Add(const std::string& command, bool use_console,
+                               const std::string& spill_path) {
   Subprocess* subprocess = new Subprocess(use_console);
+  subprocess->UseBufferOf(this);
+  subprocess->spill_path_ = spill_path;
   if (!subprocess->Start(this, command)) {
     delete subprocess;
     return 0;
@@ -252,6 +258,11 @@ bool SubprocessSet::DoWork() {
                  // delivered by NotifyInterrupted above.
     return true;
 
+  if (subproc == reinterpret_cast<Subprocess*>(this)) {  // Posted by Wake().
+    woken_ = true;
+    return false;
+  }
+
   subproc->OnPipeReady();
 
   if (subproc->Done()) {
@@ -266,6 +277,12 @@ bool SubprocessSet::DoWork() {
   return false;
 }
 
+void SubprocessSet::Wake() {
+  if (!PostQueuedCompletionStatus(ioport_, 0,
+                                  reinterpret_cast<ULONG_PTR>(this), NULL))
+    Win32Fatal("PostQueuedCompletionStatus");
+}
+
 Subprocess* SubprocessSet::NextFinished() {
   if (finished_.empty())
     return NULL;
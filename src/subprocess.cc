@@ -0,0 +1,175 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "subprocess.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <utility>
+
+namespace {
+
+/// Create the missing directories leading to |path|.
+void MakeParentDirs(const std::string& path) {
+  for (size_t slash = path.find_first_of("/\\", 1);
+       slash != std::string::npos;
+       slash = path.find_first_of("/\\", slash + 1)) {
+#ifdef _WIN32
+    _mkdir(path.substr(0, slash).c_str());
+#else
+    mkdir(path.substr(0, slash).c_str(), 0777);
+#endif
+  }
+}
+
+/// Open |path| for the output of a subprocess, without letting the
+/// subprocesses started later inherit it.  Its directory is only created
+/// then, as few commands print enough to need it.
+FILE* OpenSpillFile(const std::string& path) {
+#ifdef _WIN32
+  FILE* file = fopen(path.c_str(), "wbN");
+  if (!file) {
+    MakeParentDirs(path);
+    file = fopen(path.c_str(), "wbN");
+  }
+  return file;
+#else
+  const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int fd = open(path.c_str(), flags, 0666);
+  if (fd < 0 && errno == ENOENT) {
+    MakeParentDirs(path);
+    fd = open(path.c_str(), flags, 0666);
+  }
+  if (fd < 0)
+    return nullptr;
+  FILE* file = fdopen(fd, "wb");
+  if (!file)
+    close(fd);
+  return file;
+#endif
+}
+
+}  // namespace
+
+void Subprocess::UseBufferOf(SubprocessSet* set) {
+  set_ = set;
+  if (!set->spare_buffers_.empty()) {
+    buf_.swap(set->spare_buffers_.back());
+    set->spare_buffers_.pop_back();
+    buf_.clear();
+  }
+}
+
+void Subprocess::AppendOutput(const char* data, size_t size) {
+  output_size_ += size;
+  const size_t head_size = set_->output_limit_ / 2;
+  const size_t tail_size = set_->output_limit_ - head_size;
+
+  if (!truncated_) {
+    buf_.append(data, size);
+    if (buf_.size() <= set_->output_limit_)
+      return;
+    // Everything printed so far still is in buf_: start the spill file with
+    // it, then only keep the head.
+    truncated_ = true;
+    if (!spill_path_.empty()) {
+      spill_ = OpenSpillFile(spill_path_);
+      if (spill_) {
+        set_->spill_files_.insert(spill_path_);
+        fwrite(buf_.data(), 1, buf_.size(), spill_);
+      }
+    }
+    tail_.assign(buf_, head_size, std::string::npos);
+    buf_.resize(head_size);
+  } else {
+    if (spill_)
+      fwrite(data, 1, size, spill_);
+    tail_.append(data, size);
+  }
+
+  // Trimming only once the tail doubled keeps the copies linear in the
+  // size of the output.
+  if (tail_.size() > 2 * tail_size)
+    tail_.erase(0, tail_.size() - tail_size);
+}
+
+void Subprocess::FinishOutput() {
+  if (!truncated_) {
+    // Don't leave around what an earlier run of the command spilled.
+    if (!spill_path_.empty() && set_->spill_files_.erase(spill_path_))
+      remove(spill_path_.c_str());
+    return;
+  }
+  const size_t tail_size = set_->output_limit_ - set_->output_limit_ / 2;
+  if (tail_.size() > tail_size)
+    tail_.erase(0, tail_.size() - tail_size);
+
+  bool spilled = false;
+  if (spill_) {
+    spilled = fclose(spill_) == 0;
+    spill_ = nullptr;
+  }
+
+  uint64_t omitted = output_size_ - buf_.size() - tail_.size();
+  buf_ += "\n[... " + std::to_string(omitted) + " bytes of output omitted";
+  if (spilled)
+    buf_ += "; all of it is in " + spill_path_;
+  buf_ += " ...]\n";
+  buf_ += tail_;
+  tail_.clear();
+  tail_.shrink_to_fit();
+}
+
+void Subprocess::ReleaseBuffer() {
+  if (spill_) {
+    fclose(spill_);
+    spill_ = nullptr;
+  }
+  if (set_ && set_->spare_buffers_.size() < set_->max_spare_buffers_ &&
+      buf_.capacity() <= set_->output_limit_)
+    set_->spare_buffers_.push_back(std::move(buf_));
+}
+
+void SubprocessSet::FindSpillFiles(const std::string& dir) {
+#ifdef _WIN32
+  WIN32_FIND_DATAA ffd;
+  HANDLE find_handle = FindFirstFileA((dir + "\\*").c_str(), &ffd);
+  if (find_handle == INVALID_HANDLE_VALUE)
+    return;
+  do {
+    if (!(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+      spill_files_.insert(dir + "/" + ffd.cFileName);
+  } while (FindNextFileA(find_handle, &ffd));
+  FindClose(find_handle);
+#else
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return;
+  while (struct dirent* entry = readdir(d)) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+      spill_files_.insert(dir + "/" + entry->d_name);
+  }
+  closedir(d);
+#endif
+}
@@ -15,8 +15,11 @@
 #ifndef NINJA_SUBPROCESS_H_
 #define NINJA_SUBPROCESS_H_
 
+#include <cstdint>
+#include <cstdio>
 #include <queue>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #ifdef _WIN32
@@ -33,12 +36,21 @@
 #endif
 #endif
 
+// On Linux, epoll() lets DoWork() wait on any number of subprocesses and
+// only look at those that are ready.
+#if defined(__linux__) && !defined(USE_EPOLL)
+#define USE_EPOLL
+#endif
+
 #include "exit_status.h"
+#include "resource_usage.h"
+
+struct SubprocessSet;
 
 /// Subprocess wraps a single async subprocess.  It is entirely
 /// passive: it expects the caller to notify it when its fds are ready
 /// for reading, as well as call Finish() to reap the child once done()
-/// is true.
+/// is true.  It must be deleted before the SubprocessSet that added it.
 struct Subprocess {
   ~Subprocess();
 
@@ -48,14 +60,52 @@ struct Subprocess {
 
   bool Done() const;
 
+  /// What the process printed.  Past the output limit of its set, only the
+  /// head and the tail of it, around a note telling how much was left out
+  /// and where to find all of it.
   const std::string& GetOutput() const;
 
+  /// Resources used by the process, known once Finish() returned.
+  const ResourceUsage& GetResourceUsage() const { return usage_; }
+
  private:
   Subprocess(bool use_console);
   bool Start(struct SubprocessSet* set, const std::string& command);
   void OnPipeReady();
+#ifdef USE_EPOLL
+  /// Called once the process exited, even if the pipe is still open.
+  void OnProcessExited();
+#endif
 
+  /// Take a spare buffer of |set| to collect the output in.
+  void UseBufferOf(SubprocessSet* set);
+
+  /// Collect output of the process, or finish collecting it once the pipe
+  /// is closed.
+  void AppendOutput(const char* data, size_t size);
+  void FinishOutput();
+
+  /// Give buf_ back to the set, for another subprocess to reuse.
+  void ReleaseBuffer();
+
+  /// Whole output while it's within the limit, then only its head.
   std::string buf_;
+  /// Latest output past the head, trimmed to the last half of the limit
+  /// whenever it grows to twice that.
+  std::string tail_;
+  /// Number of bytes the process printed.
+  uint64_t output_size_{ 0 };
+  /// File to which all of the output goes once it's past the limit, or empty
+  /// to only keep its head and tail.
+  std::string spill_path_;
+  FILE* spill_{ nullptr };
+  bool truncated_{ false };
+  /// Set that added the process, which gets buf_ back once it's deleted.
+  SubprocessSet* set_{ nullptr };
+  /// Position of the process in the running_ of its set, while it runs.
+  size_t running_index_{ 0 };
+
+  ResourceUsage usage_;
 
 #ifdef _WIN32
   /// Set up pipe_ as the parent-side pipe of the subprocess; return the
@@ -70,27 +120,69 @@ struct Subprocess {
 #else
   int fd_;
   pid_t pid_;
+#ifdef USE_EPOLL
+  /// A pidfd referring to the process, or -1 if the kernel doesn't support
+  /// them.
+  int pidfd_{ -1 };
+#endif
 #endif
   bool use_console_;
 
   friend struct SubprocessSet;
 };
 
-/// SubprocessSet runs a ppoll/pselect() loop around a std::set of Subprocesses.
+/// SubprocessSet runs an epoll/ppoll/pselect() loop around a std::set of
+/// Subprocesses.
 /// DoWork() waits for any state change in subprocesses; finished_
 /// is a queue of subprocesses as they finish.
 struct SubprocessSet {
   SubprocessSet();
   ~SubprocessSet();
 
-  Subprocess* Add(const std::string& command, bool use_console = false);
+  /// Start |command|.  If it prints more than output_limit_ bytes, all of
+  /// its output goes to |spill_path| and only the head and the tail of it
+  /// stay in memory.  Otherwise |spill_path| is removed once it finishes if
+  /// it's among spill_files_, so that it doesn't hold the output of an
+  /// earlier run.
+  Subprocess* Add(const std::string& command, bool use_console = false,
+                  const std::string& spill_path = std::string());
+
+  /// Add the files already in |dir|, left by earlier runs, to spill_files_.
+  void FindSpillFiles(const std::string& dir);
   bool DoWork();
   Subprocess* NextFinished();
   void Clear();
 
+  /// Make DoWork() return, now if it's waiting on another thread or else
+  /// on its next call, with woken_ set.  May be called from any thread.
+  void Wake();
+
   std::vector<Subprocess*> running_;
   std::queue<Subprocess*> finished_;
 
+  /// Move |subproc|, which is done, from running_ to finished_, swapping the
+  /// last running subprocess into its place.
+  void MoveToFinished(Subprocess* subproc);
+
+  /// Bytes of output of a subprocess kept in memory.  Past that, half of it
+  /// is kept for the head of the output and half for its tail.
+  size_t output_limit_{ 1 << 20 };
+
+  /// Output buffers of deleted subprocesses, kept for new ones to reuse
+  /// rather than growing theirs from scratch.  At most max_spare_buffers_
+  /// of them are kept, and none that outgrew output_limit_.
+  std::vector<std::string> spare_buffers_;
+  size_t max_spare_buffers_{ 1 };
+
+  /// Spill files that may exist: those subprocesses wrote to, and those
+  /// found by FindSpillFiles().  Others aren't removed, sparing a syscall
+  /// for each command that prints little.
+  std::unordered_set<std::string> spill_files_;
+
+  /// Whether DoWork() returned because of Wake().  Left for the caller to
+  /// clear.
+  bool woken_{ false };
+
 #ifdef _WIN32
   static BOOL WINAPI NotifyInterrupted(DWORD dwCtrlType);
   static HANDLE ioport_;
@@ -107,6 +199,15 @@ struct SubprocessSet {
   struct sigaction old_term_act_;
   struct sigaction old_hup_act_;
   sigset_t old_mask_;
+
+  /// Self-pipe through which Wake() makes DoWork() return.  Both ends are
+  /// non-blocking.
+  int wake_pipe_[2];
+
+#ifdef USE_EPOLL
+  /// The epoll instance every running subprocess' pipe is registered with.
+  int epoll_fd_;
+#endif
 #endif
 };
 
@@ -14,13 +14,21 @@
 
 #include "subprocess.h"
 
+#include <thread>
+
+#include "metrics.h"
 #include "test.h"
+#include "util.h"
 
 #ifndef _WIN32
 // SetWithLots need std::setrlimit.
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
+#ifdef USE_EPOLL
+#include <sys/syscall.h>
+#endif
 
 #include <cstdio>
 #endif
@@ -162,6 +170,153 @@ TEST_F(SubprocessTest, Console) {
   }
 }
 
+TEST_F(SubprocessTest, ReportsResourceUsage) {
+  // Spin long enough to be charged some CPU time.
+  Subprocess* subproc = subprocs_.Add(
+      "i=0; while [ $i -lt 100000 ]; do i=$((i + 1)); done");
+  ASSERT_NE((Subprocess*)nullptr, subproc);
+
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  const ResourceUsage& usage = subproc->GetResourceUsage();
+  EXPECT_GT(usage.max_rss_kb, 0);
+  EXPECT_GT(usage.user_time_ms + usage.system_time_ms, 0);
+}
+
+#if defined(USE_EPOLL) && defined(SYS_pidfd_open)
+// A process is done once it exits, even if it left behind a process that
+// keeps its output pipe open.
+TEST_F(SubprocessTest, DoneWhenProcessExits) {
+  // Skip test if the kernel doesn't support pidfds.
+  int pidfd = static_cast<int>(syscall(SYS_pidfd_open, getpid(), 0));
+  if (pidfd < 0)
+    return;
+  close(pidfd);
+
+  Subprocess* subproc = subprocs_.Add("echo started; sleep 5 &");
+  ASSERT_NE((Subprocess*)nullptr, subproc);
+
+  const int64_t start = GetTimeMillis();
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  EXPECT_LT(GetTimeMillis() - start, 4000);
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("started\n", subproc->GetOutput());
+}
+#endif
+
+// Past the output limit, only the head and the tail of the output are kept,
+// and all of it goes to the spill file, whose directory is created then.
+TEST_F(SubprocessTest, SpillsLongOutput) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("SubprocessTest-SpillsLongOutput");
+
+  std::string expected;
+  for (int i = 1; i <= 100000; ++i)
+    expected += std::to_string(i) + "\n";
+
+  subprocs_.output_limit_ = 1000;
+  Subprocess* subproc = subprocs_.Add("seq 1 100000", false, "out/spill");
+  ASSERT_NE((Subprocess*)nullptr, subproc);
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+
+  const std::string& output = subproc->GetOutput();
+  EXPECT_EQ(expected.substr(0, 500), output.substr(0, 500));
+  EXPECT_EQ(expected.substr(expected.size() - 500),
+            output.substr(output.size() - 500));
+  EXPECT_NE(std::string::npos,
+            output.find("[... " + std::to_string(expected.size() - 1000) +
+                        " bytes of output omitted; all of it is in "
+                        "out/spill"));
+
+  std::string spilled, err;
+  EXPECT_EQ(0, ReadFile("out/spill", &spilled, &err));
+  EXPECT_TRUE(spilled == expected);
+
+  // The buffer outgrew the limit, so isn't kept for reuse.  The next
+  // subprocess keeps all of a short output, and removes the spill file,
+  // which no longer is its output.
+  ASSERT_EQ(subproc, subprocs_.NextFinished());
+  delete subproc;
+  EXPECT_EQ(0u, subprocs_.spare_buffers_.size());
+  subproc = subprocs_.Add("echo short", false, "out/spill");
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("short\n", subproc->GetOutput());
+  EXPECT_EQ(-ENOENT, ReadFile("out/spill", &spilled, &err));
+  ASSERT_EQ(subproc, subprocs_.NextFinished());
+  delete subproc;
+
+  temp_dir.Cleanup();
+}
+
+// A spill file is only removed if the set wrote it or found it in the
+// spill directory, and only buffers within the output limit are reused, up
+// to a number of them.
+TEST_F(SubprocessTest, RemovesOnlyKnownSpillFiles) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("SubprocessTest-RemovesOnlyKnownSpillFiles");
+  ASSERT_EQ(0, mkdir("out", 0777));
+  std::string spilled, err;
+  {
+    FILE* f = fopen("out/spill", "wb");
+    ASSERT_TRUE(f);
+    fputs("stale", f);
+    fclose(f);
+  }
+
+  subprocs_.output_limit_ = 1000;
+  Subprocess* subproc = subprocs_.Add("echo short", false, "out/spill");
+  ASSERT_NE((Subprocess*)nullptr, subproc);
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ(0, ReadFile("out/spill", &spilled, &err));
+  ASSERT_EQ(subproc, subprocs_.NextFinished());
+  delete subproc;
+
+  subprocs_.FindSpillFiles("out");
+  subproc = subprocs_.Add("seq 1 1000", false, "out/spill");
+  Subprocess* other = subprocs_.Add("echo short", false, "out/other");
+  while (!subproc->Done() || !other->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  ASSERT_EQ(ExitSuccess, other->Finish());
+  while (Subprocess* finished = subprocs_.NextFinished())
+    delete finished;
+  // The stale file was rewritten.  The long output's buffer was dropped,
+  // and the short one's kept.
+  EXPECT_EQ(0, ReadFile("out/spill", &spilled, &err));
+  EXPECT_NE(std::string::npos, spilled.find("\n1000\n"));
+  EXPECT_EQ(1u, subprocs_.spare_buffers_.size());
+
+  // No more than max_spare_buffers_ are kept.
+  subproc = subprocs_.Add("echo short", false, "out/spill");
+  other = subprocs_.Add("echo short", false, "out/other");
+  while (!subproc->Done() || !other->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  ASSERT_EQ(ExitSuccess, other->Finish());
+  while (Subprocess* finished = subprocs_.NextFinished())
+    delete finished;
+  EXPECT_EQ(1u, subprocs_.spare_buffers_.size());
+  EXPECT_EQ(-ENOENT, ReadFile("out/spill", &spilled, &err));
+  EXPECT_EQ(-ENOENT, ReadFile("out/other", &spilled, &err));
+
+  temp_dir.Cleanup();
+}
+
 #endif
 
 TEST_F(SubprocessTest, SetWithSingle) {
@@ -177,6 +332,19 @@ TEST_F(SubprocessTest, SetWithSingle) {
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
 
+TEST_F(SubprocessTest, Wake) {
+  std::thread waker([this] { subprocs_.Wake(); });
+  while (!subprocs_.woken_)
+    subprocs_.DoWork();
+  waker.join();
+
+  // A wake-up before DoWork() is called isn't lost.
+  subprocs_.woken_ = false;
+  subprocs_.Wake();
+  EXPECT_FALSE(subprocs_.DoWork());
+  EXPECT_TRUE(subprocs_.woken_);
+}
+
 TEST_F(SubprocessTest, SetWithMulti) {
   Subprocess* processes[3];
   const char* kCommands[3] = {
@@ -217,7 +385,7 @@ TEST_F(SubprocessTest, SetWithMulti) {
   }
 }
 
-#if defined(USE_PPOLL)
+#if defined(USE_EPOLL) || defined(USE_PPOLL)
 TEST_F(SubprocessTest, SetWithLots) {
   // Arbitrary big number; needs to be over 1024 to confirm we're no longer
   // hostage to pselect.
@@ -166,13 +166,15 @@ TimeStamp VirtualFileSystem::Stat(const std::string& path,
   return 0;
 }
 
-uint64_t VirtualFileSystem::Hash(const std::string& path, std::string* err) const {
+ContentHash VirtualFileSystem::Hash(const std::string& path,
+                                    std::string* err) const {
   auto i = files_.find(path);
   if (i != files_.end()) {
-    return MurmurHash64A(i->second.contents.c_str(), i->second.contents.size());
+    return HashContents(i->second.contents.c_str(),
+                        i->second.contents.size());
   }
   *err = "File not found";
-  return 0;
+  return ContentHash();
 }
 
 bool VirtualFileSystem::WriteFile(const std::string& path,
@@ -181,6 +183,27 @@ bool VirtualFileSystem::WriteFile(const std::string& path,
   return true;
 }
 
+bool VirtualFileSystem::ReplaceFile(const std::string& path,
+                                    const std::string& contents,
+                                    bool executable) {
+  Create(path, contents);
+  files_[path].executable = executable;
+  return true;
+}
+
+bool VirtualFileSystem::IsExecutable(const std::string& path) const {
+  auto i = files_.find(path);
+  return i != files_.end() && i->second.executable;
+}
+
+bool VirtualFileSystem::SetMtime(const std::string& path, TimeStamp mtime) {
+  auto i = files_.find(path);
+  if (i == files_.end())
+    return false;
+  i->second.mtime = mtime;
+  return true;
+}
+
 bool VirtualFileSystem::MakeDir(const std::string& path) {
   directories_made_.push_back(path);
   return true;  // success
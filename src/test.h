@@ -170,8 +170,12 @@ struct VirtualFileSystem : public DiskInterface {
 
   // DiskInterface
   TimeStamp Stat(const std::string& path, std::string* err) const override;
-  uint64_t Hash(const std::string& path, std::string* err) const override;
+  ContentHash Hash(const std::string& path, std::string* err) const override;
   bool WriteFile(const std::string& path, const std::string& contents) override;
+  bool ReplaceFile(const std::string& path, const std::string& contents,
+                   bool executable) override;
+  bool IsExecutable(const std::string& path) const override;
+  bool SetMtime(const std::string& path, TimeStamp mtime) override;
   bool MakeDir(const std::string& path) override;
   bool RemoveDir(const std::string& path) override;
   Status ReadFile(const std::string& path, std::string* contents,
@@ -183,6 +187,7 @@ struct VirtualFileSystem : public DiskInterface {
     int mtime;
     std::string stat_error;  // If mtime is -1.
     std::string contents;
+    bool executable{ false };
   };
 
   std::vector<std::string> directories_made_;
@@ -395,6 +395,20 @@ void SetCloseOnExec(int fd) {
 #endif  // ! _WIN32
 }
 
+ScopedSignalsBlocked::ScopedSignalsBlocked() {
+#ifndef _WIN32
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old_mask_);
+#endif
+}
+
+ScopedSignalsBlocked::~ScopedSignalsBlocked() {
+#ifndef _WIN32
+  pthread_sigmask(SIG_SETMASK, &old_mask_, nullptr);
+#endif
+}
+
 const char* SpellcheckStringV(const std::string& text,
                               const std::vector<const char*>& words) {
   const bool kAllowReplacements = true;
@@ -594,6 +608,37 @@ double GetLoadAverage() {
 }
 #endif  // _WIN32
 
+#ifdef _WIN32
+int64_t GetAvailableMemoryKb() {
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if (!GlobalMemoryStatusEx(&status))
+    return -1;
+  return static_cast<int64_t>(status.ullAvailPhys / 1024);
+}
+#elif defined(__linux__)
+int64_t GetAvailableMemoryKb() {
+  FILE* meminfo = fopen("/proc/meminfo", "r");
+  if (!meminfo)
+    return -1;
+  int64_t available = -1;
+  char line[256];
+  while (fgets(line, sizeof(line), meminfo)) {
+    long long kb;
+    if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1) {
+      available = kb;
+      break;
+    }
+  }
+  fclose(meminfo);
+  return available;
+}
+#else
+int64_t GetAvailableMemoryKb() {
+  return -1;
+}
+#endif  // _WIN32
+
 std::string ElideMiddle(const std::string& str, size_t width) {
   switch (width) {
   case 0:
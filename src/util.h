@@ -18,6 +18,7 @@
 #ifdef _WIN32
 #include "win32port.h"
 #else
+#include <csignal>
 #include <cstdint>
 #endif
 
@@ -62,6 +63,19 @@ int ReadFile(const std::string& path, std::string* contents, std::string* err);
 /// Mark a file descriptor to not be inherited on exec()s.
 void SetCloseOnExec(int fd);
 
+/// Blocks every signal in the calling thread while in scope, so that the
+/// threads started meanwhile leave them to the main thread, which waits for
+/// interruptions along with the commands.  Does nothing on Windows.
+struct ScopedSignalsBlocked {
+  ScopedSignalsBlocked();
+  ~ScopedSignalsBlocked();
+
+ private:
+#ifndef _WIN32
+  sigset_t old_mask_;
+#endif
+};
+
 /// Given a misspelled std::string and a list of correct spellings, returns
 /// the closest match or NULL if there is no close enough match.
 const char* SpellcheckStringV(const std::string& text,
@@ -83,6 +97,10 @@ int GetProcessorCount();
 /// on error.
 double GetLoadAverage();
 
+/// @return the memory, in KiB, that new processes can use without making the
+/// machine swap.  A negative value is returned when it isn't known.
+int64_t GetAvailableMemoryKb();
+
 /// Elide the given std::string @a str with '...' in the middle if the length
 /// exceeds @a width.
 std::string ElideMiddle(const std::string& str, size_t width);
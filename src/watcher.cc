@@ -0,0 +1,410 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "watcher.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "graph.h"
+#include "state.h"
+#include "util.h"
+
+const char kWatcherSocketName[] = ".ninja_watch";
+
+namespace {
+
+/// Set |parent| to the directory containing |dir|, "" for the current
+/// one.  Returns false if |dir| has no parent to watch.
+bool ParentDir(const std::string& dir, std::string* parent) {
+  if (dir.empty() || dir == "/")
+    return false;
+  std::string::size_type slash = dir.find_last_of('/');
+  if (slash == std::string::npos)
+    parent->clear();
+  else
+    *parent = dir.substr(0, slash == 0 ? 1 : slash);
+  return true;
+}
+
+#ifdef __linux__
+/// Fill |addr| for the Unix socket at |path|.  Returns false if the path is
+/// too long for one.
+bool SocketAddress(const std::string& path, sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path))
+    return false;
+  memcpy(addr->sun_path, path.c_str(), path.size());
+  return true;
+}
+
+/// Connect to the Unix socket at |path|, returning the fd or -1.  With a
+/// |timeout|, connecting, and then each send and recv on the fd, give up
+/// after that long.
+int ConnectTo(const std::string& path, const timeval* timeout = nullptr) {
+  sockaddr_un addr;
+  if (!SocketAddress(path, &addr))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  // Connecting to a Unix socket whose backlog is full waits as long as a
+  // send would.
+  if (timeout &&
+      (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, timeout, sizeof(*timeout)) <
+           0 ||
+       setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, timeout, sizeof(*timeout)) <
+           0)) {
+    close(fd);
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+std::string JoinPath(const std::string& dir, const std::string& name) {
+  if (dir.empty())
+    return name;
+  if (dir == "/")
+    return dir + name;
+  return dir + "/" + name;
+}
+
+const uint32_t kWatchMask = IN_ATTRIB | IN_CLOSE_WRITE | IN_MODIFY |
+                            IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                            IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                            IN_ONLYDIR;
+
+volatile sig_atomic_t g_stop_watching = 0;
+
+void StopWatching(int /*signum*/) {
+  g_stop_watching = 1;
+}
+#endif  // __linux__
+
+}  // namespace
+
+Watcher::Watcher(const State& state) {
+  for (const auto& entry : state.paths_) {
+    const std::string& path = entry.second->path();
+    std::string dir;
+    ParentDir(path, &dir);
+    std::string::size_type slash = path.find_last_of('/');
+    files_[dir].insert(slash == std::string::npos ? path
+                                                  : path.substr(slash + 1));
+  }
+}
+
+Watcher::~Watcher() {
+#ifdef __linux__
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+  }
+  if (inotify_fd_ >= 0)
+    close(inotify_fd_);
+#endif
+}
+
+#ifdef __linux__
+bool Watcher::Start(const std::string& socket_path, std::string* err) {
+  sockaddr_un addr;
+  if (!SocketAddress(socket_path, &addr)) {
+    *err = "socket path too long: " + socket_path;
+    return false;
+  }
+  int other = ConnectTo(socket_path);
+  if (other >= 0) {
+    close(other);
+    *err = "a watcher already listens on " + socket_path;
+    return false;
+  }
+  unlink(socket_path.c_str());  // Left behind by a watcher that was killed.
+
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ < 0) {
+    *err = std::string("inotify_init1: ") + strerror(errno);
+    return false;
+  }
+  for (const auto& dir : files_) {
+    if (!WatchDir(dir.first))
+      unwatched_dirs_.insert(dir.first);
+  }
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    *err = std::string("socket: ") + strerror(errno);
+    return false;
+  }
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(listen_fd_, 16) < 0) {
+    *err = socket_path + ": " + strerror(errno);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  socket_path_ = socket_path;
+  return true;
+}
+
+bool Watcher::Run(std::string* err) {
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = StopWatching;
+  sigaction(SIGINT, &act, nullptr);
+  sigaction(SIGTERM, &act, nullptr);
+  sigaction(SIGHUP, &act, nullptr);
+
+  while (!g_stop_watching) {
+    pollfd fds[2] = { { inotify_fd_, POLLIN, 0 }, { listen_fd_, POLLIN, 0 } };
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      *err = std::string("poll: ") + strerror(errno);
+      return false;
+    }
+    if (fds[0].revents)
+      ReadEvents();
+    if (fds[1].revents) {
+      int client = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client >= 0) {
+        Serve(client);
+        close(client);
+      }
+    }
+  }
+  return true;
+}
+
+void Watcher::Update() {
+  ReadEvents();
+  // Directories made since, e.g. for the outputs of a build, can be
+  // watched now.
+  for (auto i = unwatched_dirs_.begin(); i != unwatched_dirs_.end();) {
+    if (WatchDir(*i))
+      i = unwatched_dirs_.erase(i);
+    else
+      ++i;
+  }
+}
+
+bool Watcher::WatchDir(const std::string& dir) {
+  if (dir_wds_.count(dir))
+    return true;
+  // Moving a parent directory isn't reported to the watch of |dir|, so
+  // they all are watched too.
+  std::string parent;
+  if (ParentDir(dir, &parent) && !WatchDir(parent))
+    return false;
+  int wd = inotify_add_watch(inotify_fd_, dir.empty() ? "." : dir.c_str(),
+                             kWatchMask);
+  if (wd < 0)
+    return false;
+  watched_dirs_[wd] = dir;
+  dir_wds_[dir] = wd;
+  // Stat the files only once watching, so that no change is missed.
+  auto files = files_.find(dir);
+  if (files != files_.end()) {
+    for (const std::string& name : files->second)
+      StatFile(JoinPath(dir, name));
+  }
+  return true;
+}
+
+void Watcher::ForgetDir(int wd) {
+  auto i = watched_dirs_.find(wd);
+  if (i == watched_dirs_.end())
+    return;
+  const std::string dir = i->second;
+  watched_dirs_.erase(i);
+  dir_wds_.erase(dir);
+  auto files = files_.find(dir);
+  if (files != files_.end()) {
+    for (const std::string& name : files->second)
+      mtimes_.erase(JoinPath(dir, name));
+    unwatched_dirs_.insert(dir);
+  }
+
+  // The directories under it may have moved along.
+  const std::string prefix = dir + "/";
+  std::vector<int> below;
+  for (const auto& watched : watched_dirs_) {
+    if (dir.empty() || watched.second.compare(0, prefix.size(), prefix) == 0)
+      below.push_back(watched.first);
+  }
+  for (int below_wd : below) {
+    inotify_rm_watch(inotify_fd_, below_wd);
+    ForgetDir(below_wd);
+  }
+}
+
+void Watcher::StatFile(const std::string& path) {
+  // Changes to the target of a symlink or to the contents of a directory
+  // aren't reported by the watch of the parent directory.
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0 &&
+      (S_ISLNK(st.st_mode) || S_ISDIR(st.st_mode))) {
+    mtimes_.erase(path);
+    return;
+  }
+  std::string err;
+  TimeStamp mtime = disk_interface_.Stat(path, &err);
+  if (mtime < 0)
+    mtimes_.erase(path);
+  else
+    mtimes_[path] = mtime;
+}
+
+void Watcher::ReadEvents() {
+  alignas(inotify_event) char buf[64 << 10];
+  ssize_t len;
+  while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+    for (char* p = buf; p < buf + len;) {
+      const inotify_event* event = reinterpret_cast<inotify_event*>(p);
+      p += sizeof(inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Changes were lost: start over.
+        for (const auto& dir : files_) {
+          if (!dir_wds_.count(dir.first))
+            continue;
+          for (const std::string& name : dir.second)
+            StatFile(JoinPath(dir.first, name));
+        }
+        continue;
+      }
+      if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (!(event->mask & IN_IGNORED))
+          inotify_rm_watch(inotify_fd_, event->wd);
+        ForgetDir(event->wd);
+        continue;
+      }
+      auto dir = watched_dirs_.find(event->wd);
+      if (dir == watched_dirs_.end() || event->len == 0)
+        continue;
+      auto files = files_.find(dir->second);
+      if (files != files_.end() && files->second.count(event->name))
+        StatFile(JoinPath(dir->second, event->name));
+    }
+  }
+}
+
+void Watcher::Serve(int fd) {
+  // Don't let a stuck client hold up the others.
+  timeval timeout = { 5, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  std::string request;
+  char c;
+  while (request.size() < 64 && recv(fd, &c, 1, 0) == 1 && c != '\n')
+    request += c;
+  if (request != "MTIMES")
+    return;
+
+  // Everything written before the request is queued in inotify by now.
+  Update();
+
+  std::string response;
+  char line[32];
+  for (const auto& entry : mtimes_) {
+    if (entry.first.find('\n') != std::string::npos)
+      continue;
+    snprintf(line, sizeof(line), "%" PRId64 " ", entry.second);
+    response += line;
+    response += entry.first;
+    response += '\n';
+  }
+  for (size_t sent = 0; sent < response.size();) {
+    ssize_t n = send(fd, response.data() + sent, response.size() - sent,
+                     MSG_NOSIGNAL);
+    if (n <= 0)
+      return;
+    sent += n;
+  }
+}
+#else
+bool Watcher::Start(const std::string& /*socket_path*/, std::string* err) {
+  *err = "watching files is not supported on this platform";
+  return false;
+}
+
+bool Watcher::Run(std::string* err) {
+  *err = "watching files is not supported on this platform";
+  return false;
+}
+
+void Watcher::Update() {}
+#endif  // __linux__
+
+bool LoadWatchedMtimes(const std::string& socket_path,
+                       std::unordered_map<std::string, TimeStamp>* mtimes) {
+#ifndef __linux__
+  return false;
+#else
+  // The watcher may be stopped, or busy with another client or with
+  // catching up after inotify overflowed.  Rather than wait for it, stat
+  // the files as if there were none.
+  const timeval kTimeout = { 1, 0 };
+  int fd = ConnectTo(socket_path, &kTimeout);
+  if (fd < 0)
+    return false;
+  static const char kRequest[] = "MTIMES\n";
+  if (send(fd, kRequest, sizeof(kRequest) - 1, MSG_NOSIGNAL) !=
+      static_cast<ssize_t>(sizeof(kRequest) - 1)) {
+    close(fd);
+    return false;
+  }
+  std::string response;
+  char buf[64 << 10];
+  ssize_t len;
+  while ((len = recv(fd, buf, sizeof(buf), 0)) > 0)
+    response.append(buf, len);
+  close(fd);
+  if (len < 0)
+    return false;
+
+  for (size_t start = 0; start < response.size();) {
+    size_t end = response.find('\n', start);
+    if (end == std::string::npos)
+      break;  // Cut short: the watcher went away.
+    char* path;
+    TimeStamp mtime = strtoll(response.c_str() + start, &path, 10);
+    if (*path == ' ') {
+      ++path;
+      mtimes->emplace(std::string(path, response.c_str() + end - path),
+                      mtime);
+    }
+    start = end + 1;
+  }
+  return true;
+#endif
+}
@@ -0,0 +1,102 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_WATCHER_H_
+#define NINJA_WATCHER_H_
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "disk_interface.h"
+#include "timestamp.h"
+
+struct State;
+
+/// Name of the socket, in the build directory, on which a Watcher listens.
+extern const char kWatcherSocketName[];
+
+/// Keeps the mtimes of the files of a build graph in memory, watching
+/// their directories for changes, and serves them to builds so that they
+/// don't stat every file.  Only implemented on Linux, with inotify.
+///
+/// Clients connect to a Unix socket and send "MTIMES\n".  The response is
+/// a "<mtime> <path>\n" line for each file whose mtime is known, after which
+/// the watcher closes the connection.  The files it can't vouch for, e.g.
+/// symlinks, directories or files in a directory it can't watch, aren't
+/// listed, for clients to stat them themselves.
+class Watcher {
+ public:
+  explicit Watcher(const State& state);
+  ~Watcher();
+
+  /// Start watching the files of the graph, and listen on |socket_path|.
+  /// Returns false on error.
+  bool Start(const std::string& socket_path, std::string* err);
+
+  /// Serve clients until SIGINT, SIGTERM or SIGHUP.  Returns false on error.
+  bool Run(std::string* err);
+
+  /// Catch up with the changes made to the files so far.
+  void Update();
+
+  /// Mtimes of the files the watcher can vouch for, by path.
+  const std::unordered_map<std::string, TimeStamp>& mtimes() const {
+    return mtimes_;
+  }
+
+ private:
+  /// Watch |dir| and its parents, then stat its files.  Returns false if
+  /// it can't be watched, e.g. because it doesn't exist yet.
+  bool WatchDir(const std::string& dir);
+
+  /// Stop vouching for the files of the directory watched as |wd| and of
+  /// the directories under it.
+  void ForgetDir(int wd);
+
+  /// Stat |path| again, vouching for it only if it's a regular file or
+  /// missing.
+  void StatFile(const std::string& path);
+
+  /// Handle the changes inotify queued.
+  void ReadEvents();
+
+  /// Answer the client connected to |fd|.
+  void Serve(int fd);
+
+  RealDiskInterface disk_interface_;
+
+  /// Names of the files of the graph, by directory.
+  std::unordered_map<std::string, std::unordered_set<std::string>> files_;
+
+  /// Directories watched, by watch descriptor and the other way around.
+  /// Those that have files of the graph but can't be watched, e.g. because
+  /// they don't exist yet, are tried again before answering a client.
+  std::unordered_map<int, std::string> watched_dirs_;
+  std::unordered_map<std::string, int> dir_wds_;
+  std::unordered_set<std::string> unwatched_dirs_;
+
+  std::unordered_map<std::string, TimeStamp> mtimes_;
+
+  int inotify_fd_{ -1 };
+  int listen_fd_{ -1 };
+  std::string socket_path_;
+};
+
+/// Ask the watcher listening on |socket_path| for the mtimes it knows.
+/// Returns false if none is running.
+bool LoadWatchedMtimes(const std::string& socket_path,
+                       std::unordered_map<std::string, TimeStamp>* mtimes);
+
+#endif  // NINJA_WATCHER_H_
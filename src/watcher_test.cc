@@ -0,0 +1,119 @@
+// Copyright 2020 Félix-Antoine Ouellet. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "watcher.h"
+
+#include <cstdio>
+#include <cstring>
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+#include "state.h"
+#include "test.h"
+
+#ifdef __linux__
+
+namespace {
+
+struct WatcherTest : public testing::Test {
+  void SetUp() override { temp_dir_.CreateAndEnter("Ninja-WatcherTest"); }
+  void TearDown() override { temp_dir_.Cleanup(); }
+
+  static bool Touch(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f)
+      return false;
+    return fclose(f) == 0;
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+  State state_;
+};
+
+}  // anonymous namespace
+
+TEST_F(WatcherTest, FollowsChanges) {
+  ASSERT_TRUE(Touch("file"));
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  state_.GetNode("file", 0);
+  state_.GetNode("missing", 0);
+  state_.GetNode("subdir", 0);
+  state_.GetNode("subdir/file", 0);
+  state_.GetNode("later/file", 0);
+
+  Watcher watcher(state_);
+  std::string err;
+  ASSERT_TRUE(watcher.Start("watch", &err));
+  ASSERT_EQ("", err);
+
+  // Directories aren't vouched for, nor are files in directories that
+  // can't be watched.
+  const auto& mtimes = watcher.mtimes();
+  EXPECT_EQ(3u, mtimes.size());
+  EXPECT_EQ(disk_.Stat("file", &err), mtimes.at("file"));
+  EXPECT_EQ(0, mtimes.at("missing"));
+  EXPECT_EQ(0, mtimes.at("subdir/file"));
+
+  ASSERT_TRUE(Touch("missing"));
+  ASSERT_TRUE(Touch("subdir/file"));
+  ASSERT_TRUE(disk_.MakeDir("later"));
+  ASSERT_TRUE(Touch("later/file"));
+  ASSERT_EQ(0, remove("file"));
+  watcher.Update();
+  EXPECT_EQ(0, mtimes.at("file"));
+  EXPECT_EQ(disk_.Stat("missing", &err), mtimes.at("missing"));
+  EXPECT_EQ(disk_.Stat("subdir/file", &err), mtimes.at("subdir/file"));
+  EXPECT_EQ(disk_.Stat("later/file", &err), mtimes.at("later/file"));
+
+  // Moving a directory away stops vouching for its files.
+  ASSERT_EQ(0, rename("subdir", "moved"));
+  watcher.Update();
+  EXPECT_EQ(0u, mtimes.count("subdir/file"));
+
+  // A second watcher can't listen on the same socket.
+  Watcher other(state_);
+  EXPECT_FALSE(other.Start("watch", &err));
+  EXPECT_NE("", err);
+}
+
+TEST_F(WatcherTest, NoWatcher) {
+  std::unordered_map<std::string, TimeStamp> mtimes;
+  EXPECT_FALSE(LoadWatchedMtimes("watch", &mtimes));
+}
+
+TEST_F(WatcherTest, UnresponsiveWatcher) {
+  // Listening without ever answering, like a watcher that was stopped:
+  // connecting succeeds through the backlog, but no response comes.
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(fd, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, "watch");
+  ASSERT_EQ(0, bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+  ASSERT_EQ(0, listen(fd, 1));
+
+  std::unordered_map<std::string, TimeStamp> mtimes;
+  int64_t start = GetTimeMillis();
+  EXPECT_FALSE(LoadWatchedMtimes("watch", &mtimes));
+  EXPECT_LT(GetTimeMillis() - start, 5000);
+  close(fd);
+}
+
+#endif  // __linux__